@@ -1,6 +1,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include "allocator.h"
 
 /* Fati Iseni
@@ -8,59 +9,176 @@
 * It is tailored for our scenario, bunch of checks are omitted and it is safe to use only within this apps' context.
 */
 
-static const size_t BLOCK_SIZE_INITIAL = (size_t)(1000 * 1024) * 1024;
+/* Each arena is a chain of chunks. Allocations bump the offset of the current chunk with an atomic fetch-add,
+* so threads allocating concurrently never take a lock. Only when the current chunk is exhausted,
+* the threads synchronize on the arena mutex to chain a new one. Large allocations get a dedicated chunk,
+* so they don't waste the rest of the current one.
+*/
+
+static const size_t CHUNK_SIZE = (size_t)(64 * 1024) * 1024;
+static const size_t LARGE_ALLOCATION_SIZE = (size_t)(16 * 1024) * 1024;
 static const size_t ALIGNMENT = 64;
 
-static uint8_t *block = NULL;
-static size_t blockSize = 0;
-static size_t offset = 0;
-static thread_mutex_t mutex;
+typedef struct Chunk {
+    struct Chunk *next;
+    uint8_t *data;
+    size_t capacity;
+    size_t offset;                      // May go past the capacity when concurrent allocations exhaust the chunk
+} Chunk;
 
-// This will be called at startup on the main thread.
-void allocator_init() {
+struct Arena {
+    Chunk *current;
+    Chunk *chunks;                      // All chunks, including the current and the dedicated ones
+    thread_mutex_t mutex;
+};
+
+static Arena defaultArena;
 
-    thread_mutex_init(&mutex);
+// Bytes reserved by all arenas, for the stats. Updated only when a chunk is created or released, which is rare.
+static thread_mutex_t usageMutex;
+static size_t reservedBytes = 0;
+static size_t peakReservedBytes = 0;
 
-    blockSize = BLOCK_SIZE_INITIAL;
-    block = (uint8_t *)malloc(blockSize);
-    offset = 0;
+static void track_reserved(size_t capacity, bool released) {
+    thread_mutex_lock(&usageMutex);
+    if (released) {
+        reservedBytes -= capacity;
+    }
+    else {
+        reservedBytes += capacity;
+        if (reservedBytes > peakReservedBytes) {
+            peakReservedBytes = reservedBytes;
+        }
+    }
+    thread_mutex_unlock(&usageMutex);
+}
+
+static Chunk *chunk_create(size_t capacity) {
+    Chunk *chunk = malloc(sizeof(*chunk) + capacity + ALIGNMENT);
+    if (chunk == NULL) {
+        return NULL;
+    }
+    track_reserved(capacity, false);
+    uintptr_t dataAddress = (uintptr_t)(chunk + 1);
+    chunk->data = (uint8_t *)((dataAddress + ALIGNMENT - 1) & ~(uintptr_t)(ALIGNMENT - 1));
+    chunk->capacity = capacity;
+    chunk->offset = 0;
+    chunk->next = NULL;
+    return chunk;
+}
 
-    if (block == NULL) {
-        thread_mutex_destroy(&mutex);
+static void arena_init(Arena *arena) {
+    thread_mutex_init(&arena->mutex);
+    arena->chunks = NULL;
+    arena->current = chunk_create(CHUNK_SIZE);
+    if (arena->current == NULL) {
+        thread_mutex_destroy(&arena->mutex);
         fprintf(stderr, "Failed to initialize the allocator!\n");
         exit(EXIT_FAILURE);
     }
+    arena->chunks = arena->current;
 }
 
-void *allocator_alloc(size_t size) {
-    thread_mutex_lock(&mutex);
+static void arena_release(Arena *arena) {
+    thread_mutex_lock(&arena->mutex);
 
-    // Alignment padding
-    uintptr_t currentAddress = (uintptr_t)(block + offset);
-    size_t padding = (ALIGNMENT - (currentAddress % ALIGNMENT)) % ALIGNMENT;
+    Chunk *chunk = arena->chunks;
+    while (chunk) {
+        Chunk *next = chunk->next;
+        track_reserved(chunk->capacity, true);
+        free(chunk);
+        chunk = next;
+    }
+    arena->chunks = NULL;
+    arena->current = NULL;
 
-    if (offset + padding + size > blockSize) {
-        thread_mutex_unlock(&mutex);
-        fprintf(stderr, "Not enough space in the allocator!\n");
-        return NULL;
+    thread_mutex_unlock(&arena->mutex);
+    thread_mutex_destroy(&arena->mutex);
+}
+
+// Slow path, called when the chunk is exhausted or for large allocations.
+static void *arena_alloc_chunk(Arena *arena, Chunk *exhausted, size_t size) {
+    thread_mutex_lock(&arena->mutex);
+
+    if (size >= LARGE_ALLOCATION_SIZE) {
+        Chunk *chunk = chunk_create(size);
+        if (chunk == NULL) {
+            thread_mutex_unlock(&arena->mutex);
+            return NULL;
+        }
+        chunk->offset = size;
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        thread_mutex_unlock(&arena->mutex);
+        return chunk->data;
     }
 
-    offset += padding;
-    void *ptr = block + offset;
-    offset += size;
+    // Another thread may have chained a new chunk in the meantime.
+    if (arena->current == exhausted) {
+        Chunk *chunk = chunk_create(CHUNK_SIZE);
+        if (chunk == NULL) {
+            thread_mutex_unlock(&arena->mutex);
+            return NULL;
+        }
+        chunk->next = arena->chunks;
+        arena->chunks = chunk;
+        atomic_store_ptr(&arena->current, chunk);
+    }
 
-    thread_mutex_unlock(&mutex);
-    return ptr;
+    thread_mutex_unlock(&arena->mutex);
+    return arena_alloc(arena, size);
 }
 
-void allocator_destroy() {
-    thread_mutex_lock(&mutex);
+void *arena_alloc(Arena *arena, size_t size) {
+    // Rounding the size keeps every offset aligned, since the chunk data is aligned.
+    size = (size + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    if (size >= LARGE_ALLOCATION_SIZE) {
+        return arena_alloc_chunk(arena, NULL, size);
+    }
+
+    Chunk *chunk = atomic_load_ptr(&arena->current);
+    size_t offset = atomic_fetch_add_size(&chunk->offset, size);
+    if (offset + size <= chunk->capacity) {
+        return chunk->data + offset;
+    }
+    return arena_alloc_chunk(arena, chunk, size);
+}
+
+Arena *arena_create(void) {
+    Arena *arena = malloc(sizeof(*arena));
+    if (arena == NULL) {
+        fprintf(stderr, "Failed to create the arena!\n");
+        exit(EXIT_FAILURE);
+    }
+    arena_init(arena);
+    return arena;
+}
+
+void arena_destroy(Arena *arena) {
+    if (arena) {
+        arena_release(arena);
+        free(arena);
+    }
+}
+
+// This will be called at startup on the main thread.
+void allocator_init() {
+    thread_mutex_init(&usageMutex);
+    arena_init(&defaultArena);
+}
 
-    free(block);
-    block = NULL;
-    blockSize = 0;
-    offset = 0;
+void *allocator_alloc(size_t size) {
+    return arena_alloc(&defaultArena, size);
+}
+
+void allocator_destroy() {
+    arena_release(&defaultArena);
+    thread_mutex_destroy(&usageMutex);
+}
 
-    thread_mutex_unlock(&mutex);
-    thread_mutex_destroy(&mutex);
+size_t allocator_peak_reserved_bytes() {
+    thread_mutex_lock(&usageMutex);
+    size_t peak = peakReservedBytes;
+    thread_mutex_unlock(&usageMutex);
+    return peak;
 }
@@ -26,10 +26,34 @@ typedef pthread_mutex_t thread_mutex_t;
 
 #endif
 
+#if defined(_WIN32) || defined(_WIN64)
+#define atomic_load_ptr(ptr) InterlockedCompareExchangePointer((PVOID volatile *)(ptr), NULL, NULL)
+#define atomic_store_ptr(ptr, value) InterlockedExchangePointer((PVOID volatile *)(ptr), (value))
+#define atomic_fetch_add_size(ptr, value) ((size_t)InterlockedExchangeAdd64((LONG64 volatile *)(ptr), (LONG64)(value)))
+#else
+#define atomic_load_ptr(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define atomic_store_ptr(ptr, value) __atomic_store_n((ptr), (value), __ATOMIC_RELEASE)
+#define atomic_fetch_add_size(ptr, value) __atomic_fetch_add((ptr), (value), __ATOMIC_RELAXED)
+#endif
+
 #include <stdlib.h>
 
+/* Bump allocator. Memory is never freed individually, it's released in bulk when the arena is destroyed.
+* allocator_alloc uses the default arena, which lives until allocator_destroy.
+* Short-lived memory for a single phase (e.g. sort buffers) goes into its own arena,
+* which is destroyed once the phase is done.
+*/
+typedef struct Arena Arena;
+
 void allocator_init();
 void allocator_destroy();
 void *allocator_alloc(size_t size);
 
+// High-water mark of the memory reserved by all arenas. Mapped files are not included.
+size_t allocator_peak_reserved_bytes();
+
+Arena *arena_create(void);
+void *arena_alloc(Arena *arena, size_t size);
+void arena_destroy(Arena *arena);
+
 #endif
@@ -0,0 +1,99 @@
+#!/bin/bash
+
+# Scaling benchmark of the C v1 app on synthetic data.
+# Generates deterministic datasets with datagen at each scale, runs the app with --stats=json,
+# and reports the throughput and the peak RSS per phase.
+#
+# Usage: bench.sh [scale ...]            Default scales: 1 10 100 1000
+# Environment:
+#   BENCH_PARTS           Parts at scale 1 (default 1000)
+#   BENCH_MASTER_PARTS    Master parts at scale 1 (default 3000)
+#   BENCH_SEED            Seed of the generator (default 1)
+#   BENCH_DATAGEN_ARGS    Extra datagen options, e.g. "--hyphen-density 0.1 --match-ratio 0.8"
+#   BENCH_DIR             Where the data and the results go (default ./bench)
+#   BENCH_KEEP_DATA       Set to keep the generated files, they're removed after each scale by default
+
+set -euo pipefail
+
+script_dir=$(dirname "$(realpath "$0")")
+cd "$script_dir"
+
+scales=("$@")
+if [ ${#scales[@]} -eq 0 ]; then
+  scales=(1 10 100 1000)
+fi
+
+base_parts=${BENCH_PARTS:-1000}
+base_master_parts=${BENCH_MASTER_PARTS:-3000}
+seed=${BENCH_SEED:-1}
+datagen_args=${BENCH_DATAGEN_ARGS:-}
+bench_dir=${BENCH_DIR:-$script_dir/bench}
+results_file="$bench_dir/results.jsonl"
+
+echo "Building..."
+bash "$script_dir/build.sh" >/dev/null
+gcc -O2 -Wall -Wextra datagen.c -o publish/datagen
+mkdir -p "$bench_dir"
+rm -f "$results_file"
+
+####################################################################
+# Prints one row per phase from the stats JSON. Phases over the master parts are measured against the master parts count.
+print_phases() {
+  local stats_json=$1 parts=$2 master_parts=$3
+  echo "$stats_json" \
+    | sed 's/.*"phases":\[{\(.*\)}\],"tables".*/\1/' \
+    | sed 's/},{/\n/g' \
+    | awk -v parts="$parts" -v master="$master_parts" '
+      {
+        name = $0; sub(/.*"name":"/, "", name); sub(/".*/, "", name)
+        wall = $0; sub(/.*"wall_seconds":/, "", wall); sub(/[,}].*/, "", wall)
+        rss = $0; sub(/.*"peak_rss_bytes":/, "", rss); sub(/[,}].*/, "", rss)
+        records = (name ~ /master|mp_|suffix_hashes|load_index/) ? master : parts
+        throughput = wall > 0 ? records / wall / 1e6 : 0
+        printf "  %-22s %12.3f %16.2f %16.1f\n", name, wall * 1e3, throughput, rss / 1048576
+      }'
+}
+
+json_number() {
+  echo "$1" | sed "s/.*\"$2\":\([0-9.]*\).*/\1/"
+}
+
+####################################################################
+printf "\n%8s %12s %14s %12s %16s %14s\n" "Scale" "Parts" "Master parts" "Wall (ms)" "Parts/s (M)" "Peak RSS (MiB)"
+summary=()
+for scale in "${scales[@]}"; do
+  parts=$((base_parts * scale))
+  master_parts=$((base_master_parts * scale))
+  parts_file="$bench_dir/parts-$scale.txt"
+  master_parts_file="$bench_dir/master-parts-$scale.txt"
+
+  # shellcheck disable=SC2086
+  publish/datagen "$parts_file" "$master_parts_file" --seed "$seed" --parts "$parts" --master-parts "$master_parts" $datagen_args
+
+  start=$(date +%s.%N)
+  stats_json=$(publish/app "$parts_file" "$master_parts_file" "$bench_dir/results-$scale.txt" --stats=json 2>&1 >/dev/null | tail -n 1)
+  end=$(date +%s.%N)
+
+  wall=$(echo "$start $end" | awk '{ printf "%.3f", ($2 - $1) * 1e3 }')
+  rss=$(json_number "$stats_json" peak_rss_bytes)
+  throughput=$(echo "$parts $wall" | awk '{ printf "%.2f", $1 / ($2 / 1e3) / 1e6 }')
+  printf "%8s %12s %14s %12s %16s %14.1f\n" "$scale" "$parts" "$master_parts" "$wall" "$throughput" "$(echo "$rss" | awk '{ print $1 / 1048576 }')"
+
+  echo "{\"scale\":$scale,\"parts\":$parts,\"master_parts\":$master_parts,\"seed\":$seed,\"wall_ms\":$wall,\"stats\":$stats_json}" >> "$results_file"
+  summary+=("$scale|$parts|$master_parts|$stats_json")
+
+  if [ -z "${BENCH_KEEP_DATA:-}" ]; then
+    rm -f "$parts_file" "$master_parts_file" "$bench_dir/results-$scale.txt"
+  fi
+done
+
+for entry in "${summary[@]}"; do
+  IFS="|" read -r scale parts master_parts stats_json <<< "$entry"
+  echo ""
+  echo "Scale $scale:"
+  printf "  %-22s %12s %16s %16s\n" "Phase" "Wall (ms)" "Records/s (M)" "Peak RSS (MiB)"
+  print_phases "$stats_json" "$parts" "$master_parts"
+done
+
+echo ""
+echo "Results: $results_file"
@@ -0,0 +1,106 @@
+#include <string.h>
+#include "allocator.h"
+#include "common.h"
+#include "bloom_filter.h"
+
+/* 12 bits per key. With 8 bits set per key, that's about 0.5% false positives.
+* The filters are far smaller than the tables they guard, so they mostly stay in the cache,
+* and a miss is rejected without touching the control bytes or the entries of the table.
+*/
+#define BITS_PER_KEY ((size_t)12)
+#define BLOCK_SIZE (BLOOM_WORDS_PER_BLOCK * sizeof(uint32_t))
+
+BloomFilter *bloom_create(size_t count) {
+    size_t blockCount = (count * BITS_PER_KEY + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8);
+    if (blockCount == 0) {
+        blockCount = 1;
+    }
+    assert(blockCount <= UINT32_MAX);
+
+    BloomFilter *filter = allocator_alloc(sizeof(*filter));
+    CHECK_ALLOC(filter);
+    filter->blockCount = blockCount;
+
+    // The allocator aligns to 64 bytes, so a block never straddles two cache lines.
+    filter->words = allocator_alloc(blockCount * BLOCK_SIZE);
+    CHECK_ALLOC(filter->words);
+    memset(filter->words, 0, blockCount * BLOCK_SIZE);
+    return filter;
+}
+
+void bloom_add(BloomFilter *filter, uint64_t keyHash) {
+    uint32_t *block = filter->words + bloom_block(filter, keyHash) * BLOOM_WORDS_PER_BLOCK;
+    for (size_t word = 0; word < BLOOM_WORDS_PER_BLOCK; word++) {
+        block[word] |= bloom_word_mask(keyHash, word);
+    }
+}
+
+void bloom_prefetch(const BloomFilter *filter, uint64_t keyHash) {
+    if (filter) {
+        PREFETCH(filter->words + bloom_block(filter, keyHash) * BLOOM_WORDS_PER_BLOCK);
+    }
+}
+
+void bloom_add_hashes(BloomFilter *filter, const uint64_t *keyHashes, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        bloom_add(filter, keyHashes[i]);
+    }
+}
+
+void bloom_free(BloomFilter *filter) {
+    if (filter) {
+        free(filter->words);
+        free(filter);
+    }
+}
+
+/* Serialized layout, 64-byte aligned like the hash tables:
+*   SerializedHeader
+*   words[blockCount * BLOOM_WORDS_PER_BLOCK]
+*/
+typedef struct SerializedHeader {
+    uint64_t blockCount;
+    uint64_t blockSize;                 // The bits of a key depend on it, so both sides must agree.
+    uint64_t reserved[6];
+} SerializedHeader;
+
+#define SERIALIZED_ALIGNMENT ((size_t)64)
+
+static inline size_t align_serialized(size_t size) {
+    return (size + SERIALIZED_ALIGNMENT - 1) & ~(SERIALIZED_ALIGNMENT - 1);
+}
+
+size_t bloom_serialized_size(const BloomFilter *filter) {
+    return sizeof(SerializedHeader) + align_serialized(filter->blockCount * BLOCK_SIZE);
+}
+
+bool bloom_write(const BloomFilter *filter, FILE *file) {
+    static const char padding[SERIALIZED_ALIGNMENT] = { 0 };
+    SerializedHeader header = { .blockCount = filter->blockCount, .blockSize = BLOCK_SIZE };
+    size_t wordsSize = filter->blockCount * BLOCK_SIZE;
+    size_t paddingSize = align_serialized(wordsSize) - wordsSize;
+
+    return fwrite(&header, sizeof(header), 1, file) == 1
+        && fwrite(filter->words, 1, wordsSize, file) == wordsSize
+        && fwrite(padding, 1, paddingSize, file) == paddingSize;
+}
+
+BloomFilter *bloom_view(const void *source, size_t sourceSize) {
+    if (sourceSize < sizeof(SerializedHeader)) {
+        return NULL;
+    }
+    const SerializedHeader *header = (const SerializedHeader *)source;
+    if (header->blockSize != BLOCK_SIZE || header->blockCount == 0 || header->blockCount > UINT32_MAX) {
+        return NULL;
+    }
+    size_t blockCount = (size_t)header->blockCount;
+    if (blockCount > (sourceSize - sizeof(SerializedHeader)) / BLOCK_SIZE) {
+        return NULL;
+    }
+
+    BloomFilter *filter = allocator_alloc(sizeof(*filter));
+    CHECK_ALLOC(filter);
+    filter->blockCount = blockCount;
+    filter->words = (uint32_t *)((const char *)source + sizeof(SerializedHeader));
+    return filter;
+}
@@ -0,0 +1,65 @@
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Split block Bloom filter. A key sets one bit in each of the 8 words of a single 32-byte block,
+// so a check touches one cache line. It works on the 64-bit hashes of the hash tables, the keys are never hashed again.
+// The words of a block are 32-bit, the layout is the same on all platforms and the filter can be persisted.
+typedef struct BloomFilter {
+    uint32_t *words;
+    size_t blockCount;
+} BloomFilter;
+
+// The filter is sized for the given number of keys, adding more keys only raises the false positive rate.
+BloomFilter *bloom_create(size_t count);
+void bloom_add(BloomFilter *filter, uint64_t keyHash);
+
+// Same as adding them one by one. The adds don't depend on each other, so their cache misses overlap in a tight loop.
+void bloom_add_hashes(BloomFilter *filter, const uint64_t *keyHashes, size_t count);
+
+#define BLOOM_WORDS_PER_BLOCK ((size_t)8)
+
+// The block is picked by the high 32 bits of the hash, the bits within the block by the low 32 bits.
+static inline size_t bloom_block(const BloomFilter *filter, uint64_t keyHash) {
+    return (size_t)(((keyHash >> 32) * (uint64_t)filter->blockCount) >> 32);
+}
+
+// Bit of the key in the given word of its block. Each word has its own odd multiplier, the top 5 bits of the product pick the bit.
+static inline uint32_t bloom_word_mask(uint64_t keyHash, size_t word) {
+    static const uint32_t salts[BLOOM_WORDS_PER_BLOCK] = {
+        0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU, 0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+    };
+    return (uint32_t)1 << (((uint32_t)keyHash * salts[word]) >> 27);
+}
+
+// False means the key was never added. True means it may have been added. A NULL filter may contain anything.
+// Inlined, since it's called in front of every probe of the filtered tables.
+static inline bool bloom_may_contain(const BloomFilter *filter, uint64_t keyHash) {
+    if (filter == NULL) {
+        return true;
+    }
+    const uint32_t *block = filter->words + bloom_block(filter, keyHash) * BLOOM_WORDS_PER_BLOCK;
+    uint32_t missing = 0;
+    for (size_t word = 0; word < BLOOM_WORDS_PER_BLOCK; word++) {
+        missing |= bloom_word_mask(keyHash, word) & ~block[word];
+    }
+    return missing == 0;
+}
+
+// Prefetches the block of the key, so a check right after it doesn't stall. Does nothing for a NULL filter.
+void bloom_prefetch(const BloomFilter *filter, uint64_t keyHash);
+void bloom_free(BloomFilter *filter);
+
+// Persistence, same conventions as the hash table. The size is a multiple of 64.
+size_t bloom_serialized_size(const BloomFilter *filter);
+bool bloom_write(const BloomFilter *filter, FILE *file);
+
+// Creates a read-only filter over a serialized one, without copying. The source must be 64-byte aligned and outlive the filter.
+// Returns NULL if the serialized filter doesn't fit in sourceSize bytes, or it was written with a different block layout.
+BloomFilter *bloom_view(const void *source, size_t sourceSize);
+
+#endif
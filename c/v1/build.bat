@@ -1,8 +1,17 @@
 @echo off
 setlocal enabledelayedexpansion
 
-set "FLAGS=/permissive- /GS /GL /Gy /Gm- /W3 /WX- /O2 /Oi /sdl /Gd /MD /arch:AVX2 /EHsc /Zc:inline /fp:precise /Zc:forScope /nologo /D ""NDEBUG"" /D ""_CRT_SECURE_NO_WARNINGS"" /D ""_CONSOLE"""
-set "FILES=main.c cross_platform_time.c allocator.c thread_utils.c hash_table.c source_data.c processor.c"
+set "FLAGS=/permissive- /GS /GL /Gy /Gm- /W3 /WX- /O2 /Oi /sdl /Gd /MD /EHsc /Zc:inline /fp:precise /Zc:forScope /nologo /D ""NDEBUG"" /D ""_CRT_SECURE_NO_WARNINGS"" /D ""_CONSOLE"""
+set "FILES=main.c cross_platform_time.c allocator.c thread_utils.c file_utils.c string_utils.c hash_table.c bloom_filter.c suffix_index.c suffix_trie.c source_data.c processor.c index_file.c delta_update.c server.c stream.c stats.c"
+set "MICROBENCH_FILES=microbench.c cross_platform_time.c allocator.c string_utils.c hash_table.c bloom_filter.c"
+
+rem The microbenchmarks are a separate target, they're built next to the app without touching it.
+if "%1"=="microbench" (
+    if not exist publish mkdir publish
+    cl %FLAGS% %MICROBENCH_FILES% /Fe:publish\microbench.exe
+    del *.obj
+    exit /b
+)
 
 if exist publish (
     rmdir /s /q publish
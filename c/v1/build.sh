@@ -1,9 +1,17 @@
 #!/bin/bash
 
+FLAGS="-O3 -s -flto -pthread -DNDEBUG -Wall -Wextra -Wno-unused-function -Wno-unused-parameter -Wno-unknown-pragmas"
+FILES="main.c cross_platform_time.c allocator.c thread_utils.c file_utils.c string_utils.c hash_table.c bloom_filter.c suffix_index.c suffix_trie.c source_data.c processor.c index_file.c delta_update.c server.c stream.c stats.c"
+MICROBENCH_FILES="microbench.c cross_platform_time.c allocator.c string_utils.c hash_table.c bloom_filter.c"
+
+# The microbenchmarks are a separate target, they're built next to the app without touching it.
+if [ "$1" == "microbench" ]; then
+  mkdir -p publish
+  gcc $FLAGS $MICROBENCH_FILES -o publish/microbench
+  exit
+fi
+
 rm -rf publish
 mkdir publish
 
-FLAGS="-O3 -march=native -s -flto -pthread -DNDEBUG -Wall -Wextra -Wno-unused-function -Wno-unused-parameter -Wno-unknown-pragmas"
-FILES="main.c cross_platform_time.c allocator.c thread_utils.c hash_table.c source_data.c processor.c"
-
 gcc $FLAGS $FILES -o publish/app
@@ -10,6 +10,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <assert.h>
+#include "string_utils.h"
 
 #define CHAR_SPACE ' '
 #define CHAR_HYPHEN '-'
@@ -26,16 +27,20 @@
 
 static const size_t MAX_SIZE_T_VALUE = ((size_t)-1);
 
+// Starts loading the cache line of the address, for the lookups that know their addresses well before reading them.
+#if defined(_MSC_VER)
+#include <xmmintrin.h>
+#define PREFETCH(address) _mm_prefetch((const char *)(address), _MM_HINT_T0)
+#else
+#define PREFETCH(address) __builtin_prefetch((address))
+#endif
+
 static inline const char *str_to_upper(const char *src, size_t srcLength, char *buffer) {
     assert(src);
     assert(buffer);
 
     // We know the buffer has enough space.
-    for (size_t i = 0; i < srcLength; i++) {
-        buffer[i] = (unsigned int)(src[i] - 97) <= 25 // 25 = 122 - 97
-            ? src[i] & 0x5F
-            : src[i];
-    }
+    str_kernels.to_upper(src, srcLength, buffer);
     buffer[srcLength] = '\0';
     return buffer;
 }
@@ -46,41 +51,40 @@ static inline const char *str_remove_hyphens(const char *src, size_t srcLength,
     assert(outLength);
 
     // We know the buffer has enough space.
-    size_t j = 0;
-    for (size_t i = 0; i < srcLength; i++) {
-        if (src[i] != CHAR_HYPHEN) {
-            // We know the chars are ASCII (no need to cast to unaligned char)
-            buffer[j++] = src[i];
-        }
-    }
-    buffer[j] = '\0';
-    *outLength = j;
+    size_t length = str_kernels.remove_char(src, srcLength, CHAR_HYPHEN, buffer);
+    buffer[length] = '\0';
+    *outLength = length;
     return buffer;
 }
 
-static inline const char *str_trim_in_place(char *src, size_t srcLength, size_t *outLength) {
+// Doesn't modify the source, it returns the start of the trimmed string and its length.
+static inline const char *str_trim(const char *src, size_t srcLength, size_t *outLength) {
     assert(src);
     assert(outLength);
 
-    size_t start = 0;
-    while (start < srcLength && src[start] == CHAR_SPACE) {
-        start++;
-    }
-
-    if (start == srcLength) {
-        src[0] = '\0';
-        *outLength = 0;
+    // Most records have nothing to trim, so we check the edges before calling the kernels.
+    if (srcLength == 0 || (src[0] != CHAR_SPACE && src[srcLength - 1] != CHAR_SPACE)) {
+        *outLength = srcLength;
         return src;
     }
 
-    size_t end = srcLength - 1;
-    while (end > start && src[end] == CHAR_SPACE) {
-        end--;
-    }
+    const char *start = str_kernels.find_not_char(src, src + srcLength, CHAR_SPACE);
+    const char *end = str_kernels.rfind_not_char(start, src + srcLength, CHAR_SPACE);
+    *outLength = end - start;
+    return start;
+}
 
-    src[end + 1] = '\0';
-    *outLength = end - start + 1;
-    return &src[start];
+// Reads the line starting at the given position. Returns the start of the next line.
+// The record is trimmed, without the CR/LF terminators.
+static inline const char *str_read_line(const char *line, const char *end, const char **outRecord, size_t *outLength) {
+    // Returns the end if the last line has no terminator.
+    const char *lineEnd = str_kernels.find_char(line, end, '\n');
+    size_t length = lineEnd - line;
+    if (length > 0 && line[length - 1] == '\r') {
+        length--;
+    }
+    *outRecord = str_trim(line, length, outLength);
+    return lineEnd < end ? lineEnd + 1 : end;
 }
 
 #endif
@@ -21,11 +21,22 @@ double time_get_seconds(void) {
     return (double)counter.QuadPart / (double)frequency.QuadPart;
 }
 
+double time_get_thread_cpu_seconds(void) {
+    FILETIME creationTime, exitTime, kernelTime, userTime;
+    GetThreadTimes(GetCurrentThread(), &creationTime, &exitTime, &kernelTime, &userTime);
+
+    // FILETIME is in 100 ns units
+    ULARGE_INTEGER kernel = { .LowPart = kernelTime.dwLowDateTime, .HighPart = kernelTime.dwHighDateTime };
+    ULARGE_INTEGER user = { .LowPart = userTime.dwLowDateTime, .HighPart = userTime.dwHighDateTime };
+    return (double)(kernel.QuadPart + user.QuadPart) / 1e7;
+}
+
 #else  // POSIX (Linux, macOS, etc.)
 
 //#define _POSIX_C_SOURCE 199309L
 #include <sys/time.h>
 #include <stddef.h>
+#include <time.h>
 
 //double time_get_seconds(void) {
 //    struct timespec now;
@@ -39,4 +50,10 @@ double time_get_seconds(void) {
     return (double)now.tv_sec + (double)now.tv_usec / 1000000.0;
 }
 
+double time_get_thread_cpu_seconds(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
 #endif
@@ -3,4 +3,7 @@
 
 double time_get_seconds(void);
 
+// CPU time (user + kernel) consumed by the calling thread.
+double time_get_thread_cpu_seconds(void);
+
 #endif
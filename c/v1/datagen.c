@@ -0,0 +1,340 @@
+/* Deterministic generator of synthetic parts and master parts files, for the scaling benchmarks.
+* It's a standalone tool, not part of the app. Build it with: gcc -O2 datagen.c -o publish/datagen
+* The same seed and options always produce the same files, on any platform.
+*
+* Master parts are random codes of uppercase letters and digits, with hyphens inserted at the given density.
+* A part is derived from a random master part with the given match ratio, so that it matches by one of the three rules
+* (suffix, suffix ignoring hyphens, or the master part as a suffix of the part). Otherwise it's a random code.
+* Some of the derived parts are lowercased, and a few records get leading/trailing spaces, to exercise trimming and casing.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "common.h"
+#include "source_data.h"
+
+// Records are shorter than MAX_STRING_LENGTH, as required by the challenge.
+#define MAX_RECORD_LENGTH (MAX_STRING_LENGTH - 1)
+#define LOWERCASE_RATE 0.25
+#define SPACES_RATE 0.02
+#define WRITE_BUFFER_SIZE ((size_t)(1 << 20))
+
+static const char ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+typedef struct Options {
+    uint64_t seed;
+    size_t partsCount;
+    size_t masterPartsCount;
+    size_t minLength;
+    size_t maxLength;
+    double hyphenDensity;               // Probability of a hyphen at each inner position of a master part
+    double duplicateRate;               // Probability that a record repeats an earlier record of the same file
+    double matchRatio;                  // Probability that a part is derived from a master part
+} Options;
+
+// The master parts are kept, the parts are derived from them.
+typedef struct CodeList {
+    char *block;
+    size_t blockLength;
+    size_t blockCapacity;
+    size_t *offsets;
+    uint8_t *lengths;
+    size_t count;
+} CodeList;
+
+typedef struct Writer {
+    FILE *file;
+    const char *path;
+    char *buffer;
+    size_t length;
+} Writer;
+
+/* SplitMix64, small and good enough to drive the distributions. */
+static uint64_t rng_state;
+
+static inline uint64_t rng_next(void) {
+    uint64_t z = (rng_state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Uniform in [0, bound).
+static inline size_t rng_below(size_t bound) {
+    return (size_t)(rng_next() % bound);
+}
+
+// Uniform in [0, 1).
+static inline double rng_unit(void) {
+    return (double)(rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Triangular between min and max, with the mode in the middle. Codes are mostly mid-length.
+static size_t random_length(const Options *options) {
+    size_t span = options->maxLength - options->minLength + 1;
+    return options->minLength + (rng_below(span) + rng_below(span)) / 2;
+}
+
+static void random_code(char *buffer, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        buffer[i] = ALPHABET[rng_below(sizeof(ALPHABET) - 1)];
+    }
+}
+
+static void code_list_add(CodeList *records, const char *code, size_t length) {
+    if (records->blockLength + length > records->blockCapacity) {
+        records->blockCapacity = records->blockCapacity * 2 + MAX_STRING_LENGTH;
+        records->block = realloc(records->block, records->blockCapacity);
+        CHECK_ALLOC(records->block);
+    }
+    memcpy(records->block + records->blockLength, code, length);
+    records->offsets[records->count] = records->blockLength;
+    records->lengths[records->count] = (uint8_t)length;
+    records->blockLength += length;
+    records->count++;
+}
+
+static void writer_flush(Writer *writer) {
+    if (writer->length > 0 && fwrite(writer->buffer, 1, writer->length, writer->file) != writer->length) {
+        fprintf(stderr, "Failed to write file: %s\n", writer->path);
+        exit(EXIT_FAILURE);
+    }
+    writer->length = 0;
+}
+
+static void writer_line(Writer *writer, const char *code, size_t length) {
+    if (writer->length + length + 3 > WRITE_BUFFER_SIZE) {
+        writer_flush(writer);
+    }
+    bool spaces = rng_unit() < SPACES_RATE;
+    if (spaces) {
+        writer->buffer[writer->length++] = CHAR_SPACE;
+    }
+    memcpy(writer->buffer + writer->length, code, length);
+    writer->length += length;
+    if (spaces) {
+        writer->buffer[writer->length++] = CHAR_SPACE;
+    }
+    writer->buffer[writer->length++] = '\n';
+}
+
+static void writer_open(Writer *writer, const char *path) {
+    writer->path = path;
+    writer->length = 0;
+    writer->file = fopen(path, "wb");
+    if (!writer->file) {
+        fprintf(stderr, "Failed to open file: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    writer->buffer = malloc(WRITE_BUFFER_SIZE);
+    CHECK_ALLOC(writer->buffer);
+}
+
+static void writer_close(Writer *writer) {
+    writer_flush(writer);
+    if (fclose(writer->file) != 0) {
+        fprintf(stderr, "Failed to write file: %s\n", writer->path);
+        exit(EXIT_FAILURE);
+    }
+    free(writer->buffer);
+}
+
+static size_t generate_master_part(const Options *options, char *buffer) {
+    size_t length = random_length(options);
+    random_code(buffer, length);
+    for (size_t i = 1; i + 1 < length; i++) {
+        if (rng_unit() < options->hyphenDensity) {
+            buffer[i] = CHAR_HYPHEN;
+        }
+    }
+    return length;
+}
+
+// Derives a part that matches the given master part by one of the rules. Returns the length.
+static size_t derive_part(const char *mp, size_t mpLength, char *buffer) {
+    char nh[MAX_STRING_LENGTH];
+    size_t nhLength = 0;
+    size_t length;
+
+    switch (rng_below(3)) {
+    case 0:
+        // Rule 1, a suffix of the master part.
+        length = MIN_STRING_LENGTH + rng_below(mpLength - MIN_STRING_LENGTH + 1);
+        memcpy(buffer, mp + mpLength - length, length);
+        break;
+    case 1:
+        // Rule 2, a suffix of the master part without hyphens.
+        for (size_t i = 0; i < mpLength; i++) {
+            if (mp[i] != CHAR_HYPHEN) {
+                nh[nhLength++] = mp[i];
+            }
+        }
+        if (nhLength < MIN_STRING_LENGTH) {
+            memcpy(buffer, mp, mpLength);
+            length = mpLength;
+            break;
+        }
+        length = MIN_STRING_LENGTH + rng_below(nhLength - MIN_STRING_LENGTH + 1);
+        memcpy(buffer, nh + nhLength - length, length);
+        break;
+    default: {
+        // Rule 3, the master part is a suffix of the part.
+        size_t prefixLength = 1 + rng_below(4);
+        if (mpLength + prefixLength > MAX_RECORD_LENGTH) {
+            prefixLength = MAX_RECORD_LENGTH - mpLength;
+        }
+        random_code(buffer, prefixLength);
+        memcpy(buffer + prefixLength, mp, mpLength);
+        length = prefixLength + mpLength;
+        break;
+    }
+    }
+
+    if (rng_unit() < LOWERCASE_RATE) {
+        for (size_t i = 0; i < length; i++) {
+            if (buffer[i] >= 'A' && buffer[i] <= 'Z') {
+                buffer[i] = (char)(buffer[i] - 'A' + 'a');
+            }
+        }
+    }
+    return length;
+}
+
+static void generate(const Options *options, const char *partsPath, const char *masterPartsPath) {
+    rng_state = options->seed;
+
+    CodeList mps = { 0 };
+    mps.offsets = malloc((options->masterPartsCount + 1) * sizeof(*mps.offsets));
+    mps.lengths = malloc((options->masterPartsCount + 1) * sizeof(*mps.lengths));
+    CHECK_ALLOC(mps.offsets);
+    CHECK_ALLOC(mps.lengths);
+
+    char buffer[MAX_STRING_LENGTH];
+    Writer writer;
+    writer_open(&writer, masterPartsPath);
+    for (size_t i = 0; i < options->masterPartsCount; i++) {
+        size_t length;
+        if (i > 0 && rng_unit() < options->duplicateRate) {
+            size_t source = rng_below(i);
+            length = mps.lengths[source];
+            memcpy(buffer, mps.block + mps.offsets[source], length);
+        }
+        else {
+            length = generate_master_part(options, buffer);
+        }
+        code_list_add(&mps, buffer, length);
+        writer_line(&writer, buffer, length);
+    }
+    writer_close(&writer);
+
+    // Only the last part is needed for duplicates, there's no need to keep them all. A duplicate repeats a recent part.
+    char previous[MAX_STRING_LENGTH];
+    size_t previousLength = 0;
+    writer_open(&writer, partsPath);
+    for (size_t i = 0; i < options->partsCount; i++) {
+        size_t length;
+        if (previousLength > 0 && rng_unit() < options->duplicateRate) {
+            length = previousLength;
+            memcpy(buffer, previous, length);
+        }
+        else if (mps.count > 0 && rng_unit() < options->matchRatio) {
+            size_t source = rng_below(mps.count);
+            length = derive_part(mps.block + mps.offsets[source], mps.lengths[source], buffer);
+        }
+        else {
+            length = random_length(options);
+            random_code(buffer, length);
+        }
+        memcpy(previous, buffer, length);
+        previousLength = length;
+        writer_line(&writer, buffer, length);
+    }
+    writer_close(&writer);
+
+    free(mps.block);
+    free(mps.offsets);
+    free(mps.lengths);
+}
+
+static void print_usage(const char *programName) {
+    printf("Usage: %s <parts file> <master parts file> [options]\n\n", programName);
+    printf("Options:\n");
+    printf("  --seed <n>                Seed of the generator (default 1)\n");
+    printf("  --parts <n>               Number of parts (default 10000)\n");
+    printf("  --master-parts <n>        Number of master parts (default 30000)\n");
+    printf("  --min-length <n>          Minimum code length, at least %zu (default 3)\n", MIN_STRING_LENGTH);
+    printf("  --max-length <n>          Maximum code length, at most %zu (default 24)\n", MAX_RECORD_LENGTH);
+    printf("  --hyphen-density <p>      Probability of a hyphen at each inner position of a master part (default 0.05)\n");
+    printf("  --duplicate-rate <p>      Probability that a record repeats an earlier one (default 0.05)\n");
+    printf("  --match-ratio <p>         Probability that a part is derived from a master part (default 0.5)\n\n");
+}
+
+static bool parse_size(const char *text, size_t *out) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (*text == '\0' || *end != '\0') {
+        return false;
+    }
+    *out = (size_t)value;
+    return true;
+}
+
+static bool parse_probability(const char *text, double *out) {
+    char *end;
+    double value = strtod(text, &end);
+    if (*text == '\0' || *end != '\0' || value < 0.0 || value > 1.0) {
+        return false;
+    }
+    *out = value;
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || (argc - 3) % 2 != 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    Options options = {
+        .seed = 1,
+        .partsCount = 10000,
+        .masterPartsCount = 30000,
+        .minLength = 3,
+        .maxLength = 24,
+        .hyphenDensity = 0.05,
+        .duplicateRate = 0.05,
+        .matchRatio = 0.5,
+    };
+
+    for (int i = 3; i < argc; i += 2) {
+        const char *name = argv[i];
+        const char *value = argv[i + 1];
+        size_t seed;
+        bool valid;
+        if (strcmp(name, "--seed") == 0) {
+            valid = parse_size(value, &seed);
+            options.seed = (uint64_t)seed;
+        }
+        else if (strcmp(name, "--parts") == 0) valid = parse_size(value, &options.partsCount);
+        else if (strcmp(name, "--master-parts") == 0) valid = parse_size(value, &options.masterPartsCount);
+        else if (strcmp(name, "--min-length") == 0) valid = parse_size(value, &options.minLength);
+        else if (strcmp(name, "--max-length") == 0) valid = parse_size(value, &options.maxLength);
+        else if (strcmp(name, "--hyphen-density") == 0) valid = parse_probability(value, &options.hyphenDensity);
+        else if (strcmp(name, "--duplicate-rate") == 0) valid = parse_probability(value, &options.duplicateRate);
+        else if (strcmp(name, "--match-ratio") == 0) valid = parse_probability(value, &options.matchRatio);
+        else valid = false;
+
+        if (!valid) {
+            fprintf(stderr, "Invalid option: %s %s\n", name, value);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.minLength < MIN_STRING_LENGTH || options.maxLength > MAX_RECORD_LENGTH || options.minLength > options.maxLength) {
+        fprintf(stderr, "The lengths must be within [%zu, %zu], with min <= max.\n", MIN_STRING_LENGTH, MAX_RECORD_LENGTH);
+        return EXIT_FAILURE;
+    }
+
+    generate(&options, argv[1], argv[2]);
+    return EXIT_SUCCESS;
+}
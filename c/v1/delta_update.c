@@ -0,0 +1,452 @@
+#include <string.h>
+#include "allocator.h"
+#include "common.h"
+#include "file_utils.h"
+#include "hash_table.h"
+#include "bloom_filter.h"
+#include "delta_update.h"
+#include "stats.h"
+
+/* Each table maps a key to the master part that comes first for it, the one with the shortest key, then the first in the file.
+* An added master part is last in the file, so it takes over a key only if its key is shorter. If it loses a suffix,
+* it loses all the shorter ones too, since the master part that beats it has those suffixes as well.
+*
+* A removed master part is replaced by the next one for each key it holds. The master parts with a suffix and a longer key
+* are the ones with one more char in front of it, and the table of the next length holds the first of them for each char.
+* The tables are patched from the longest suffix down, so the next length is already patched when it's read.
+* The master parts with exactly that key are the duplicates, and they're removed together. The codes without hyphens
+* may still have the same key with hyphens at other places, those are linked in mpNhNext.
+* A key without a master part left keeps its slot with MP_INDEX_NONE, the tables never delete.
+*
+* The filters are only added to. The removed keys stay as false positives, and the tables don't get new filters when
+* they grow. Both only make the filters less effective, rebuilding the index from the source restores them.
+*/
+
+typedef struct SuffixTables {
+    HTable **tables;
+    BloomFilter **filters;
+    bool noHyphens;
+} SuffixTables;
+
+typedef struct DeltaUpdate {
+    SourceData *data;
+    MasterPartsTables *tables;
+    SuffixTables suffixes;
+    SuffixTables nhSuffixes;
+    char *source;                       // Writable copies, only when something is added
+    char *keys;
+    size_t addedCount;                  // Sizes the tables created for lengths that had none
+} DeltaUpdate;
+
+typedef enum DeltaOperation {
+    DELTA_ADD = '+',
+    DELTA_REMOVE = '-',
+} DeltaOperation;
+
+// Reads the change from a trimmed line. Returns false for a line that is not a change, the code is NULL for the ones to skip.
+static bool parse_change(const char *record, size_t length, DeltaOperation *outOperation, const char **outCode, size_t *outCodeLength) {
+    *outCode = NULL;
+    if (length == 0) {
+        return true;
+    }
+    if (record[0] != DELTA_ADD && record[0] != DELTA_REMOVE) {
+        return false;
+    }
+    *outOperation = (DeltaOperation)record[0];
+
+    size_t codeLength;
+    const char *code = str_trim(record + 1, length - 1, &codeLength);
+    if (codeLength >= MAX_STRING_LENGTH) {
+        return false;
+    }
+    if (codeLength >= MIN_STRING_LENGTH) {
+        *outCode = code;
+        *outCodeLength = codeLength;
+    }
+    return true;
+}
+
+// The tie-break compares the key lengths, so for the tables without hyphens it's the length of the code without them.
+static size_t key_length(const DeltaUpdate *update, size_t mpIndex, bool noHyphens) {
+    const Records *mp = &update->data->masterPartsOriginal;
+    const char *code = records_code(mp, mpIndex);
+    size_t length = records_length(mp, mpIndex);
+    return noHyphens ? length - str_kernels.count_char(code, code + length, CHAR_HYPHEN) : length;
+}
+
+// A master part is live while mpTable maps its code to it or to an earlier duplicate.
+// Removing a code maps it to MP_INDEX_NONE, and adding it again maps it to the new master part, after the removed ones.
+static bool is_live(const DeltaUpdate *update, size_t mpIndex) {
+    const Records *mp = &update->data->masterPartsOriginal;
+    size_t codeLength = records_length(mp, mpIndex);
+    char buffer[MAX_STRING_LENGTH];
+    str_to_upper(records_code(mp, mpIndex), codeLength, buffer);
+
+    size_t firstIndex;
+    return htable_search(update->tables->mpTable, buffer, codeLength, &firstIndex) && firstIndex <= mpIndex;
+}
+
+// The key must be in the keys block. A length without a table gets a new one, for keys of that length.
+// Only the suffix tables can be missing, the mpTable with keys of all lengths always exists.
+static void insert_key(DeltaUpdate *update, HTable **table, BloomFilter **filter, const char *key, size_t keyLength, uint64_t hash, size_t mpIndex) {
+    if (*table == NULL) {
+        *table = htable_create(update->addedCount, update->keys, keyLength);
+        *filter = bloom_create(update->addedCount);
+    }
+    htable_reserve(*table, (*table)->count + 1);
+    htable_insert_if_not_exists_hashed(*table, key, keyLength, hash, mpIndex);
+    bloom_add(*filter, hash);
+}
+
+static void add_to_suffix_tables(DeltaUpdate *update, SuffixTables *suffixes, const char *key, size_t keyLength, const uint64_t *hashes, size_t mpIndex) {
+    uint32_t *nhNext = update->tables->mpNhNext;
+
+    for (size_t length = keyLength; length >= MIN_STRING_LENGTH; length--) {
+        const char *suffix = key + (keyLength - length);
+        HTable *table = suffixes->tables[length];
+        size_t currentIndex;
+        if (table == NULL || !htable_search_hashed(table, suffix, length, hashes[length], &currentIndex)) {
+            insert_key(update, &suffixes->tables[length], &suffixes->filters[length], suffix, length, hashes[length], mpIndex);
+            continue;
+        }
+
+        if (currentIndex != MP_INDEX_NONE) {
+            size_t currentLength = key_length(update, currentIndex, suffixes->noHyphens);
+            if (currentLength <= keyLength) {
+                // The same code without hyphens. It's linked after the current one, to take over when that one is removed.
+                if (suffixes->noHyphens && length == keyLength && currentLength == keyLength) {
+                    size_t tail = currentIndex;
+                    while (nhNext[tail] != MP_INDEX_NONE) {
+                        tail = nhNext[tail];
+                    }
+                    nhNext[tail] = (uint32_t)mpIndex;
+                }
+                break;
+            }
+        }
+        htable_replace_hashed(table, suffix, length, hashes[length], mpIndex);
+    }
+}
+
+static void add_key_bytes(uint64_t *keyBytes, const char *key, size_t keyLength) {
+    for (size_t i = 0; i < keyLength; i++) {
+        unsigned char c = (unsigned char)key[i];
+        keyBytes[c / 64] |= (uint64_t)1 << (c % 64);
+    }
+}
+
+// The first master part among the ones with a key longer than the suffix, from the table of the next length.
+static size_t find_first_with_longer_key(const DeltaUpdate *update, const SuffixTables *suffixes, const char *suffix, size_t length) {
+    if (length + 1 >= MAX_STRING_LENGTH || suffixes->tables[length + 1] == NULL) {
+        return MP_INDEX_NONE;
+    }
+    const HTable *table = suffixes->tables[length + 1];
+    const BloomFilter *filter = suffixes->filters[length + 1];
+
+    char key[MAX_STRING_LENGTH];
+    memcpy(key + 1, suffix, length);
+    size_t firstIndex = MP_INDEX_NONE;
+    size_t firstLength = 0;
+
+    // Only the bytes that occur in the keys may precede the suffix. Most of them are still rejected by the filter.
+    const uint64_t *keyBytes = update->tables->mpKeyBytes;
+    for (size_t c = 0; c <= UINT8_MAX; c++) {
+        if ((keyBytes[c / 64] & ((uint64_t)1 << (c % 64))) == 0 || (suffixes->noHyphens && c == (unsigned char)CHAR_HYPHEN)) {
+            continue;
+        }
+        key[0] = (char)c;
+        uint64_t hash = htable_hash(key, length + 1);
+        size_t mpIndex;
+        if (!bloom_may_contain(filter, hash) || !htable_search_hashed(table, key, length + 1, hash, &mpIndex) || mpIndex == MP_INDEX_NONE) {
+            continue;
+        }
+        size_t mpLength = key_length(update, mpIndex, suffixes->noHyphens);
+        if (firstIndex == MP_INDEX_NONE || mpLength < firstLength || (mpLength == firstLength && mpIndex < firstIndex)) {
+            firstIndex = mpIndex;
+            firstLength = mpLength;
+        }
+    }
+    return firstIndex;
+}
+
+static void remove_from_suffix_tables(DeltaUpdate *update, const SuffixTables *suffixes, const char *key, size_t keyLength, const uint64_t *hashes, size_t mpIndex) {
+    const uint32_t *nhNext = update->tables->mpNhNext;
+
+    for (size_t length = keyLength; length >= MIN_STRING_LENGTH; length--) {
+        const char *suffix = key + (keyLength - length);
+        size_t currentIndex;
+        if (!htable_search_hashed(suffixes->tables[length], suffix, length, hashes[length], &currentIndex) || currentIndex != mpIndex) {
+            // Another master part comes first for this suffix, and so for all the shorter ones too.
+            break;
+        }
+
+        size_t replacement = MP_INDEX_NONE;
+        if (suffixes->noHyphens && length == keyLength) {
+            for (size_t next = nhNext[mpIndex]; next != MP_INDEX_NONE; next = nhNext[next]) {
+                if (is_live(update, next)) {
+                    replacement = next;
+                    break;
+                }
+            }
+        }
+        if (replacement == MP_INDEX_NONE) {
+            replacement = find_first_with_longer_key(update, suffixes, suffix, length);
+        }
+        htable_replace_hashed(suffixes->tables[length], suffix, length, hashes[length], replacement);
+    }
+}
+
+static void add_master_part(DeltaUpdate *update, const char *code, size_t codeLength) {
+    SourceData *data = update->data;
+    MasterPartsTables *tables = update->tables;
+    Records *mp = &data->masterPartsOriginal;
+    StringAllocationBlock *block = &data->stringBlock;
+
+    // The code is appended to the source copy as a new line, so the copy reads like the updated master parts file.
+    size_t mpIndex = mp->count++;
+    memcpy(update->source + block->masterPartsSourceSize, code, codeLength);
+    update->source[block->masterPartsSourceSize + codeLength] = '\n';
+    mp->offsets[mpIndex] = (uint32_t)block->masterPartsSourceSize;
+    mp->lengths[mpIndex] = (uint8_t)codeLength;
+    block->masterPartsSourceSize += codeLength + 1;
+    tables->mpNhNext[mpIndex] = (uint32_t)MP_INDEX_NONE;
+
+    char *upperCode = update->keys + block->blockMasterPartsSize;
+    str_to_upper(code, codeLength, upperCode);
+    block->blockMasterPartsSize += codeLength + 1;
+    add_key_bytes(tables->mpKeyBytes, upperCode, codeLength);
+
+    uint64_t hashes[MAX_STRING_LENGTH];
+    htable_hash_suffixes(upperCode, codeLength, hashes);
+
+    // A later duplicate never takes over the code, unless it was removed.
+    size_t firstIndex;
+    if (!htable_search_hashed(tables->mpTable, upperCode, codeLength, hashes[codeLength], &firstIndex)) {
+        insert_key(update, &tables->mpTable, &tables->mpTableFilter, upperCode, codeLength, hashes[codeLength], mpIndex);
+    }
+    else if (firstIndex == MP_INDEX_NONE) {
+        htable_replace_hashed(tables->mpTable, upperCode, codeLength, hashes[codeLength], mpIndex);
+    }
+    add_to_suffix_tables(update, &update->suffixes, upperCode, codeLength, hashes, mpIndex);
+
+    if (str_kernels.find_char(upperCode, upperCode + codeLength, CHAR_HYPHEN) != upperCode + codeLength) {
+        size_t nhCodeLength;
+        char *nhCode = update->keys + block->blockMasterPartsSize;
+        str_remove_hyphens(upperCode, codeLength, nhCode, &nhCodeLength);
+        block->blockMasterPartsSize += nhCodeLength + 1;
+
+        htable_hash_suffixes(nhCode, nhCodeLength, hashes);
+        add_to_suffix_tables(update, &update->nhSuffixes, nhCode, nhCodeLength, hashes, mpIndex);
+    }
+}
+
+// Returns false if no master part has the code.
+static bool remove_master_part(DeltaUpdate *update, const char *code, size_t codeLength) {
+    MasterPartsTables *tables = update->tables;
+    char upperCode[MAX_STRING_LENGTH];
+    str_to_upper(code, codeLength, upperCode);
+
+    uint64_t hashes[MAX_STRING_LENGTH];
+    htable_hash_suffixes(upperCode, codeLength, hashes);
+
+    // The tables hold only the first of the duplicates, the later ones are dropped by is_live.
+    size_t mpIndex;
+    if (!htable_search_hashed(tables->mpTable, upperCode, codeLength, hashes[codeLength], &mpIndex) || mpIndex == MP_INDEX_NONE) {
+        return false;
+    }
+    htable_replace_hashed(tables->mpTable, upperCode, codeLength, hashes[codeLength], MP_INDEX_NONE);
+    remove_from_suffix_tables(update, &update->suffixes, upperCode, codeLength, hashes, mpIndex);
+
+    if (str_kernels.find_char(upperCode, upperCode + codeLength, CHAR_HYPHEN) != upperCode + codeLength) {
+        char nhCode[MAX_STRING_LENGTH];
+        size_t nhCodeLength;
+        str_remove_hyphens(upperCode, codeLength, nhCode, &nhCodeLength);
+
+        htable_hash_suffixes(nhCode, nhCodeLength, hashes);
+        remove_from_suffix_tables(update, &update->nhSuffixes, nhCode, nhCodeLength, hashes, mpIndex);
+    }
+    return true;
+}
+
+// Copies the records, the source and the keys with room for the added master parts.
+// The keys move, so the tables are pointed to the copy. The offsets stay the same.
+static void reserve_for_additions(DeltaUpdate *update, size_t addedCount, size_t addedSize) {
+    SourceData *data = update->data;
+    MasterPartsTables *tables = update->tables;
+    Records *mp = &data->masterPartsOriginal;
+    StringAllocationBlock *block = &data->stringBlock;
+
+    // Each added code takes its length plus a newline in the source, and at most twice that in the keys.
+    if (addedSize > MAX_FILE_SIZE - block->masterPartsSourceSize || 2 * addedSize > UINT32_MAX - block->blockMasterPartsSize) {
+        fprintf(stderr, "The master parts would exceed %zu bytes with the delta.\n", MAX_FILE_SIZE);
+        exit(EXIT_FAILURE);
+    }
+    size_t count = mp->count + addedCount;
+
+    uint32_t *offsets = allocator_alloc(count * sizeof(*offsets));
+    uint8_t *lengths = allocator_alloc(count * sizeof(*lengths));
+    uint32_t *nhNext = allocator_alloc(count * sizeof(*nhNext));
+    CHECK_ALLOC(offsets);
+    CHECK_ALLOC(lengths);
+    CHECK_ALLOC(nhNext);
+    memcpy(offsets, mp->offsets, mp->count * sizeof(*offsets));
+    memcpy(lengths, mp->lengths, mp->count * sizeof(*lengths));
+    memcpy(nhNext, tables->mpNhNext, mp->count * sizeof(*nhNext));
+
+    update->source = allocator_alloc(block->masterPartsSourceSize + addedSize);
+    update->keys = allocator_alloc(block->blockMasterPartsSize + 2 * addedSize);
+    CHECK_ALLOC(update->source);
+    CHECK_ALLOC(update->keys);
+    memcpy(update->source, mp->base, block->masterPartsSourceSize);
+    memcpy(update->keys, block->blockMasterParts, block->blockMasterPartsSize);
+
+    mp->base = update->source;
+    mp->offsets = offsets;
+    mp->lengths = lengths;
+    tables->mpNhNext = nhNext;
+    block->blockMasterParts = update->keys;
+
+    tables->mpTable->keyBase = update->keys;
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        if (tables->mpSuffixesTables[length]) {
+            tables->mpSuffixesTables[length]->keyBase = update->keys;
+        }
+        if (tables->mpNhSuffixesTables[length]) {
+            tables->mpNhSuffixesTables[length]->keyBase = update->keys;
+        }
+    }
+}
+
+static void fail_invalid_line(MappedFile *file, const char *deltaPath, size_t lineNumber) {
+    file_unmap(file);
+    fprintf(stderr, "Invalid change at line %zu of the delta file: %s\n", lineNumber, deltaPath);
+    exit(EXIT_FAILURE);
+}
+
+void delta_update_apply(const char *deltaPath, SourceData *data, MasterPartsTables *tables, DeltaUpdateResult *outResult) {
+    assert(deltaPath);
+    PhaseTimer timer = stats_phase_begin();
+
+    MappedFile file;
+    if (!file_map(deltaPath, FILE_ACCESS_SEQUENTIAL, &file)) {
+        fprintf(stderr, "Failed to open file: %s\n", deltaPath);
+        exit(EXIT_FAILURE);
+    }
+    const char *end = file.data + file.size;
+
+    // The whole delta is validated before anything is changed.
+    size_t addedCount = 0;
+    size_t addedSize = 0;
+    size_t lineNumber = 0;
+    for (const char *line = file.data; line < end; ) {
+        const char *record;
+        size_t length;
+        line = str_read_line(line, end, &record, &length);
+        lineNumber++;
+
+        DeltaOperation operation;
+        const char *code;
+        size_t codeLength;
+        if (!parse_change(record, length, &operation, &code, &codeLength)) {
+            fail_invalid_line(&file, deltaPath, lineNumber);
+        }
+        if (code && operation == DELTA_ADD) {
+            addedCount++;
+            addedSize += codeLength + 1;
+        }
+    }
+
+    if (tables->mpNhNext == NULL) {
+        tables->mpNhNext = delta_update_link_nh_codes(data, tables);
+        delta_update_collect_key_bytes(data, tables->mpKeyBytes);
+    }
+
+    DeltaUpdate update = {
+        .data = data,
+        .tables = tables,
+        .suffixes = { .tables = tables->mpSuffixesTables, .filters = tables->mpSuffixesFilters, .noHyphens = false },
+        .nhSuffixes = { .tables = tables->mpNhSuffixesTables, .filters = tables->mpNhSuffixesFilters, .noHyphens = true },
+        .addedCount = addedCount,
+    };
+    if (addedCount > 0) {
+        reserve_for_additions(&update, addedCount, addedSize);
+    }
+
+    DeltaUpdateResult result = { 0 };
+    for (const char *line = file.data; line < end; ) {
+        const char *record;
+        size_t length;
+        line = str_read_line(line, end, &record, &length);
+
+        DeltaOperation operation;
+        const char *code;
+        size_t codeLength;
+        parse_change(record, length, &operation, &code, &codeLength);
+        if (code == NULL) {
+            continue;
+        }
+        if (operation == DELTA_ADD) {
+            add_master_part(&update, code, codeLength);
+            result.addedCount++;
+        }
+        else if (remove_master_part(&update, code, codeLength)) {
+            result.removedCount++;
+        }
+        else {
+            result.missingCount++;
+        }
+    }
+    file_unmap(&file);
+
+    data->masterPartsAsc = (Records){ 0 };
+    data->masterPartsNhAsc = (Records){ 0 };
+    memset(data->masterPartsAscStartIndexByLength, 0, sizeof(data->masterPartsAscStartIndexByLength));
+    memset(data->masterPartsNhAscStartIndexByLength, 0, sizeof(data->masterPartsNhAscStartIndexByLength));
+    data->masterPartsDeltaCount++;
+
+    *outResult = result;
+    stats_phase_end(STATS_PHASE_DELTA_UPDATE, timer);
+}
+
+uint32_t *delta_update_link_nh_codes(const SourceData *data, const MasterPartsTables *tables) {
+    const Records *mpNhAsc = &data->masterPartsNhAsc;
+    const size_t *startIndexByLength = data->masterPartsNhAscStartIndexByLength;
+    size_t count = data->masterPartsOriginal.count;
+
+    uint32_t *nhNext = allocator_alloc(count * sizeof(*nhNext));
+    CHECK_ALLOC(nhNext);
+    memset(nhNext, 0xFF, count * sizeof(*nhNext));
+
+    // The last linked master part of each code, valid only for the first ones that have a link.
+    Arena *arena = arena_create();
+    uint32_t *tails = arena_alloc(arena, count * sizeof(*tails));
+    CHECK_ALLOC(tails);
+
+    // The records with the same length are in file order, and the table of that length has the first of each code.
+    for (size_t length = MIN_STRING_LENGTH; length < MAX_STRING_LENGTH; length++) {
+        for (size_t i = startIndexByLength[length]; i < startIndexByLength[length + 1]; i++) {
+            size_t mpIndex = records_index(mpNhAsc, i);
+            size_t firstIndex;
+            if (!htable_search(tables->mpNhSuffixesTables[length], records_code(mpNhAsc, i), length, &firstIndex) || firstIndex == mpIndex) {
+                continue;
+            }
+            size_t tail = nhNext[firstIndex] == MP_INDEX_NONE ? firstIndex : tails[firstIndex];
+            nhNext[tail] = (uint32_t)mpIndex;
+            tails[firstIndex] = (uint32_t)mpIndex;
+        }
+    }
+    arena_destroy(arena);
+    return nhNext;
+}
+
+void delta_update_collect_key_bytes(const SourceData *data, uint64_t *outKeyBytes) {
+    const Records *mp = &data->masterPartsOriginal;
+    memset(outKeyBytes, 0, MP_KEY_BYTES_WORDS * sizeof(*outKeyBytes));
+
+    char upperCode[MAX_STRING_LENGTH];
+    for (size_t i = 0; i < mp->count; i++) {
+        size_t length = records_length(mp, i);
+        str_to_upper(records_code(mp, i), length, upperCode);
+        add_key_bytes(outKeyBytes, upperCode, length);
+    }
+}
@@ -0,0 +1,35 @@
+#ifndef DELTA_UPDATE_H
+#define DELTA_UPDATE_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include "source_data.h"
+#include "processor.h"
+
+/* Delta updates of the master parts, patched into the tables in place instead of rebuilding them.
+* A delta file has one change per line. "+<code>" adds a master part, "-<code>" removes the master parts with that code, case-insensitive.
+* The codes are trimmed, and the ones shorter than MIN_STRING_LENGTH are ignored, same as in the master parts file.
+* An added master part goes after all the others, as if it was appended to the master parts file.
+* So the tie-break of the tables still holds, the shortest master part wins, then the first one in the file.
+*/
+typedef struct DeltaUpdateResult {
+    size_t addedCount;
+    size_t removedCount;
+    size_t missingCount;                // Removals of codes that were not in the master parts
+} DeltaUpdateResult;
+
+// The tables are patched per change, the cost depends on the size of the delta and not on the master parts count.
+// When something is added, the strings and the records are copied once with room for the additions.
+// The sorted records of the data no longer match the tables, they're dropped.
+// Not thread-safe, nothing may use the data or the tables meanwhile. Initialize the processor with the tables afterwards.
+// Exits on failure, same as loading the source files. The data and the tables are not modified if the delta is invalid.
+void delta_update_apply(const char *deltaPath, SourceData *data, MasterPartsTables *tables, DeltaUpdateResult *outResult);
+
+// Links the master parts that have the same code without hyphens, see MasterPartsTables.mpNhNext.
+// It needs the sorted records of the data, so it's done once, when the index is written.
+uint32_t *delta_update_link_nh_codes(const SourceData *data, const MasterPartsTables *tables);
+
+// Collects the bytes of the uppercased master parts, see MasterPartsTables.mpKeyBytes.
+void delta_update_collect_key_bytes(const SourceData *data, uint64_t *outKeyBytes);
+
+#endif
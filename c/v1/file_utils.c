@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <string.h>
+#include "file_utils.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+
+// ReadFile takes a 32-bit size, larger files are read in parts.
+#define MAX_READ_SIZE ((DWORD)(1u << 30))
+
+/* A file with a mapped view can't be replaced or deleted on Windows, whatever the sharing mode.
+* The copy-on-write files are the indexes being updated, and the update renames the new index over the old one.
+* So instead of a mapping, they're read into private memory and closed right away. The update reads all of it anyway, to write it out.
+*/
+static bool read_private_copy(HANDLE file, size_t size, MappedFile *outFile) {
+    char *data = VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (data == NULL) {
+        return false;
+    }
+    size_t offset = 0;
+    while (offset < size) {
+        DWORD readSize = size - offset > MAX_READ_SIZE ? MAX_READ_SIZE : (DWORD)(size - offset);
+        DWORD bytesRead;
+        if (!ReadFile(file, data + offset, readSize, &bytesRead, NULL) || bytesRead == 0) {
+            VirtualFree(data, 0, MEM_RELEASE);
+            return false;
+        }
+        offset += bytesRead;
+    }
+    outFile->data = data;
+    outFile->size = size;
+    return true;
+}
+
+bool file_map(const char *filePath, FileAccess access, MappedFile *outFile) {
+    outFile->data = NULL;
+    outFile->size = 0;
+    outFile->mapping = NULL;
+
+    DWORD flags = access == FILE_ACCESS_SEQUENTIAL ? FILE_FLAG_SEQUENTIAL_SCAN : FILE_FLAG_RANDOM_ACCESS;
+    outFile->file = CreateFileA(filePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, flags, NULL);
+    if (outFile->file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(outFile->file, &fileSize)) {
+        CloseHandle(outFile->file);
+        return false;
+    }
+    if (fileSize.QuadPart == 0) {
+        return true;
+    }
+
+    if (access == FILE_ACCESS_COPY_ON_WRITE) {
+        bool copied = read_private_copy(outFile->file, (size_t)fileSize.QuadPart, outFile);
+        CloseHandle(outFile->file);
+        outFile->file = INVALID_HANDLE_VALUE;
+        return copied;
+    }
+
+    outFile->mapping = CreateFileMappingA(outFile->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (outFile->mapping == NULL) {
+        CloseHandle(outFile->file);
+        return false;
+    }
+    outFile->data = MapViewOfFile(outFile->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (outFile->data == NULL) {
+        CloseHandle(outFile->mapping);
+        CloseHandle(outFile->file);
+        return false;
+    }
+    outFile->size = (size_t)fileSize.QuadPart;
+    return true;
+}
+
+void file_unmap(MappedFile *file) {
+    if (file->mapping) {
+        UnmapViewOfFile(file->data);
+        CloseHandle(file->mapping);
+    }
+    else if (file->data) {
+        // A private copy, see read_private_copy.
+        VirtualFree((void *)file->data, 0, MEM_RELEASE);
+    }
+    if (file->file != INVALID_HANDLE_VALUE) {
+        CloseHandle(file->file);
+    }
+    file->data = NULL;
+    file->size = 0;
+}
+
+#else
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+bool file_map(const char *filePath, FileAccess access, MappedFile *outFile) {
+    outFile->data = NULL;
+    outFile->size = 0;
+
+    int fd = open(filePath, O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return false;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return true;
+    }
+
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    // Fault in all pages upfront, instead of one page fault at a time during parsing.
+    if (access == FILE_ACCESS_SEQUENTIAL) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+    int protection = access == FILE_ACCESS_COPY_ON_WRITE ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *data = mmap(NULL, (size_t)st.st_size, protection, flags, fd, 0);
+    // The mapping keeps its own reference to the file.
+    close(fd);
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    if (access == FILE_ACCESS_SEQUENTIAL) {
+        madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+#ifndef MAP_POPULATE
+        madvise(data, (size_t)st.st_size, MADV_WILLNEED);
+#endif
+    }
+    else {
+        madvise(data, (size_t)st.st_size, MADV_RANDOM);
+    }
+
+    outFile->data = data;
+    outFile->size = (size_t)st.st_size;
+    return true;
+}
+
+void file_unmap(MappedFile *file) {
+    if (file->data) {
+        munmap((void *)file->data, file->size);
+    }
+    file->data = NULL;
+    file->size = 0;
+}
+
+#endif
+
+/* Four independent multiply-rotate lanes over 32-byte blocks, so the multiplications overlap.
+* The lanes and the tail are folded with the murmur3 finalizer.
+*/
+#define CHECKSUM_PRIME1 0x9E3779B185EBCA87ULL
+#define CHECKSUM_PRIME2 0xC2B2AE3D27D4EB4FULL
+
+static inline uint64_t checksum_round(uint64_t acc, uint64_t word) {
+    acc += word * CHECKSUM_PRIME2;
+    acc = (acc << 31) | (acc >> 33);
+    return acc * CHECKSUM_PRIME1;
+}
+
+static inline uint64_t read_word(const char *data) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    return word;
+}
+
+uint64_t file_checksum(const char *data, size_t size) {
+    uint64_t lanes[4] = { CHECKSUM_PRIME1, CHECKSUM_PRIME2, 0, (uint64_t)0 - CHECKSUM_PRIME1 };
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        lanes[0] = checksum_round(lanes[0], read_word(data + i));
+        lanes[1] = checksum_round(lanes[1], read_word(data + i + 8));
+        lanes[2] = checksum_round(lanes[2], read_word(data + i + 16));
+        lanes[3] = checksum_round(lanes[3], read_word(data + i + 24));
+    }
+
+    uint64_t h = (uint64_t)size;
+    for (size_t lane = 0; lane < 4; lane++) {
+        h = checksum_round(h, lanes[lane]);
+    }
+    for (; i + 8 <= size; i += 8) {
+        h = checksum_round(h, read_word(data + i));
+    }
+    for (; i < size; i++) {
+        h = checksum_round(h, (uint8_t)data[i]);
+    }
+
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
@@ -0,0 +1,35 @@
+#ifndef FILE_UTILS_H
+#define FILE_UTILS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#endif
+
+// View of a whole file, mapped into memory. Read-only, unless mapped with FILE_ACCESS_COPY_ON_WRITE.
+typedef struct MappedFile {
+    const char *data;                   // NULL for empty files
+    size_t size;
+#if defined(_WIN32) || defined(_WIN64)
+    HANDLE file;
+    HANDLE mapping;
+#endif
+} MappedFile;
+
+typedef enum FileAccess {
+    FILE_ACCESS_SEQUENTIAL,             // Prefaulted and hinted for sequential access. For input files read whole.
+    FILE_ACCESS_RANDOM,                 // Faulted in on demand. For index files where only the probed pages are touched.
+    FILE_ACCESS_COPY_ON_WRITE,          // Same as random, but writable. The written pages become private copies, the file is never modified.
+                                        // On Windows the file is read whole into private memory instead, so it can be replaced while in use.
+} FileAccess;
+
+bool file_map(const char *filePath, FileAccess access, MappedFile *outFile);
+void file_unmap(MappedFile *file);
+
+// Fast non-cryptographic checksum of the content, used to detect stale derived files.
+uint64_t file_checksum(const char *data, size_t size);
+
+#endif
@@ -1,3 +1,4 @@
+#include <string.h>
 #include "allocator.h"
 #include "common.h"
 #include "hash_table.h"
@@ -7,14 +8,149 @@
 * It is tailored for our scenario and it is safe to use only within this context.
 */
 
-static inline size_t hash(size_t tableSize, const char *key, size_t keyLength) {
-    size_t hash = 0x811C9DC5; // 2166136261
-    for (size_t i = 0; i < keyLength; i++) {
-        hash = (hash * 31) + key[i];
+/* The slots are split into groups. A probe loads the control bytes of a whole group at once,
+* and compares all of them against the fingerprint. Only the slots that match are compared by key.
+* With SSE2 a group is 16 slots. Otherwise we fall back to 8 slots compared within a 64-bit word.
+* We never delete, so there are no tombstones. A group with an empty slot ends the probe sequence.
+* The delta updates never delete either, a key without a match left keeps its slot with a value that marks it.
+*/
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define HTABLE_SSE2 1
+#define GROUP_SIZE ((size_t)16)
+#else
+#define GROUP_SIZE ((size_t)8)
+#endif
+
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CACHE_LINE_SIZE ((size_t)64)
+
+typedef uint32_t GroupMask;
+
+/* Polynomial hash, h = key[0]*B^(n-1) + key[1]*B^(n-2) + ... + key[n-1], followed by a bit mixer.
+* The polynomial of a suffix doesn't depend on the chars before it, so the hashes of all suffixes
+* of a record can be computed in one backward pass. The mixer (murmur3 finalizer) spreads the bits,
+* so the low bits we use for the fingerprint and the group index are well distributed.
+*/
+#define HASH_BASE 0x100000001B3ULL
+
+static inline uint64_t hash_finalize(uint64_t polynomial, size_t keyLength) {
+    uint64_t h = polynomial ^ ((uint64_t)keyLength * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Horner's rule 4 chars at a time, h = h*B^4 + ((key[i]*B + key[i+1])*B^2 + (key[i+2]*B + key[i+3])), then char by char.
+* It's the same polynomial modulo 2^64 as char by char, so the hashes match htable_hash_suffixes and the persisted tables.
+* The products within a block don't depend on h, only one multiply per 4 chars is on the critical path instead of one per char.
+*/
+#define HASH_BASE_2 (HASH_BASE * HASH_BASE)
+#define HASH_BASE_4 (HASH_BASE_2 * HASH_BASE_2)
+
+uint64_t htable_hash(const char *key, size_t keyLength) {
+    const uint8_t *chars = (const uint8_t *)key;
+    uint64_t polynomial = 0;
+    size_t i = 0;
+    for (; i + 4 <= keyLength; i += 4) {
+        uint64_t block = (chars[i] * HASH_BASE + chars[i + 1]) * HASH_BASE_2 + (chars[i + 2] * HASH_BASE + chars[i + 3]);
+        polynomial = polynomial * HASH_BASE_4 + block;
+    }
+    for (; i < keyLength; i++) {
+        polynomial = polynomial * HASH_BASE + chars[i];
+    }
+    return hash_finalize(polynomial, keyLength);
+}
+
+void htable_hash_suffixes(const char *key, size_t keyLength, uint64_t *outHashes) {
+    uint64_t polynomial = 0;
+    uint64_t power = 1;
+    for (size_t length = 1; length <= keyLength; length++) {
+        polynomial += (uint8_t)key[keyLength - length] * power;
+        power *= HASH_BASE;
+        outHashes[length] = hash_finalize(polynomial, length);
     }
-    return hash & (tableSize - 1);
 }
 
+static inline uint8_t hash_fingerprint(uint64_t hash) {
+    return (uint8_t)(hash & 0x7F);
+}
+
+static inline size_t hash_group(uint64_t hash) {
+    return (size_t)(hash >> 7);
+}
+
+// The low bits of the hash are already used for the fingerprint and the group, the tag takes the top 24 bits.
+// Comparing the tag checks the hash and the length at once.
+static inline uint32_t hash_tag(uint64_t hash, size_t keyLength) {
+    return ((uint32_t)(hash >> 32) & 0xFFFFFF00u) | (uint32_t)keyLength;
+}
+
+static inline size_t tag_key_length(uint32_t tag) {
+    return tag & 0xFFu;
+}
+
+static inline unsigned int trailing_zeros(GroupMask mask) {
+    assert(mask != 0);
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned int)index;
+#else
+    return (unsigned int)__builtin_ctz(mask);
+#endif
+}
+
+#ifdef HTABLE_SSE2
+
+static inline GroupMask group_match(const uint8_t *group, uint8_t fingerprint) {
+    __m128i ctrl = _mm_load_si128((const __m128i *)group);
+    return (GroupMask)_mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)fingerprint)));
+}
+
+static inline GroupMask group_match_empty(const uint8_t *group) {
+    // Only the empty control byte has the high bit set.
+    __m128i ctrl = _mm_load_si128((const __m128i *)group);
+    return (GroupMask)_mm_movemask_epi8(ctrl);
+}
+
+static inline unsigned int group_mask_next(GroupMask mask) {
+    return trailing_zeros(mask);
+}
+
+#else
+
+static const uint64_t LSB_BYTES = 0x0101010101010101ULL;
+static const uint64_t MSB_BYTES = 0x8080808080808080ULL;
+
+// Result has the high bit set in each matching byte. It may report false positives
+// for the bytes above a true match. That's fine, the keys are compared anyway.
+static inline GroupMask group_match(const uint8_t *group, uint8_t fingerprint) {
+    uint64_t ctrl;
+    memcpy(&ctrl, group, sizeof(ctrl));
+    uint64_t x = ctrl ^ (LSB_BYTES * fingerprint);
+    uint64_t matches = (x - LSB_BYTES) & ~x & MSB_BYTES;
+    // Pack the high bits into one bit per slot.
+    return (GroupMask)((matches * 0x02040810204081ULL) >> 56);
+}
+
+static inline GroupMask group_match_empty(const uint8_t *group) {
+    uint64_t ctrl;
+    memcpy(&ctrl, group, sizeof(ctrl));
+    uint64_t matches = ctrl & MSB_BYTES;
+    return (GroupMask)((matches * 0x02040810204081ULL) >> 56);
+}
+
+static inline unsigned int group_mask_next(GroupMask mask) {
+    return trailing_zeros(mask);
+}
+
+#endif
+
 static inline size_t next_power_of_two(size_t n) {
     if (n == 0)
         return 1;
@@ -43,85 +179,405 @@ static inline size_t next_power_of_two(size_t n) {
     return n;
 }
 
-static bool str_equals_one_length(const char *s1, const char *s2, size_t s2Length) {
-    assert(s1);
-    assert(s2);
+static inline bool equal_4(const char *a, const char *b) {
+    uint32_t x, y;
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    return x == y;
+}
 
-    for (size_t i = 0; i < s2Length; i++) {
-        if (s1[i] == '\0' || s1[i] != s2[i]) {
-            return false;
+static inline bool equal_8(const char *a, const char *b) {
+    uint64_t x, y;
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    return x == y;
+}
+
+static inline bool equal_16(const char *a, const char *b) {
+#ifdef HTABLE_SSE2
+    __m128i x = _mm_loadu_si128((const __m128i *)a);
+    __m128i y = _mm_loadu_si128((const __m128i *)b);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xFFFF;
+#else
+    return equal_8(a, b) && equal_8(a + 8, b + 8);
+#endif
+}
+
+/* Compares the first and the last bytes of the keys with fixed-width loads, which overlap unless the length is twice the width.
+* So it never reads past the keys, and there's no loop and no call. With a constant length, only the loads for it are left.
+*/
+static inline bool keys_equal(const char *a, const char *b, size_t length) {
+    if (length >= 16) {
+        if (length <= 32) {
+            return equal_16(a, b) && equal_16(a + length - 16, b + length - 16);
+        }
+        if (length <= 64) {
+            return equal_16(a, b) && equal_16(a + 16, b + 16)
+                && equal_16(a + length - 32, b + length - 32) && equal_16(a + length - 16, b + length - 16);
         }
+        return memcmp(a, b, length) == 0;
     }
-    return true;
+    if (length >= 8) {
+        return equal_8(a, b) && equal_8(a + length - 8, b + length - 8);
+    }
+    if (length >= 4) {
+        return equal_4(a, b) && equal_4(a + length - 4, b + length - 4);
+    }
+    // Up to 3 chars, the first, middle and last cover them all.
+    return length == 0 || (a[0] == b[0] && a[length / 2] == b[length / 2] && a[length - 1] == b[length - 1]);
+}
+
+/* One compare per key length of the codes, generated from keys_equal with a constant length, so the length branches fold away.
+* htable_create picks the one for the table, and the probes call it through the table. The mpTable has codes of all lengths,
+* it gets the generic one, and so does a length without a specialization.
+*/
+#define FIXED_KEY_LENGTHS(X) \
+    X(3) X(4) X(5) X(6) X(7) X(8) X(9) X(10) X(11) X(12) X(13) X(14) X(15) X(16) X(17) X(18) X(19) X(20) X(21) X(22) X(23) X(24) X(25) X(26) \
+    X(27) X(28) X(29) X(30) X(31) X(32) X(33) X(34) X(35) X(36) X(37) X(38) X(39) X(40) X(41) X(42) X(43) X(44) X(45) X(46) X(47) X(48) X(49)
+
+#define DEFINE_KEYS_EQUAL_FIXED(n) \
+    static bool keys_equal_##n(const char *a, const char *b, size_t length) { \
+        return keys_equal(a, b, n); \
+    }
+FIXED_KEY_LENGTHS(DEFINE_KEYS_EQUAL_FIXED)
+
+#define KEYS_EQUAL_FIXED_ENTRY(n) [n] = keys_equal_##n,
+static const HTableKeysEqual keysEqualByLength[] = { FIXED_KEY_LENGTHS(KEYS_EQUAL_FIXED_ENTRY) };
+
+static bool keys_equal_mixed(const char *a, const char *b, size_t length) {
+    return keys_equal(a, b, length);
 }
 
-HTable *htable_create(size_t size) {
-    size_t tableSize = next_power_of_two(size);
+static HTableKeysEqual select_keys_equal(size_t keyLength) {
+    size_t specializedCount = sizeof(keysEqualByLength) / sizeof(keysEqualByLength[0]);
+    if (keyLength < specializedCount && keysEqualByLength[keyLength] != NULL) {
+        return keysEqualByLength[keyLength];
+    }
+    return keys_equal_mixed;
+}
+
+static inline bool entry_equals(const HTable *table, const Entry *entry, uint32_t tag, const char *key, size_t keyLength) {
+    return entry->tag == tag
+        && table->keysEqual(table->keyBase + entry->keyOffset, key, keyLength);
+}
+
+static size_t table_size_for(size_t count) {
+    // Keep the load factor at 7/8 at most. The +1 ensures there is always an empty slot.
+    size_t tableSize = next_power_of_two(count + count / 7 + 1);
     if (tableSize == 0) {
         // Some default powerOfTwo value in case of overflow.
         tableSize = 32;
     }
-    HTable *table = allocator_alloc(sizeof(*table));
-    CHECK_ALLOC(table);
-    table->size = tableSize;
-    table->buckets = allocator_alloc(sizeof(*table->buckets) * tableSize);
-    CHECK_ALLOC(table->buckets);
-    for (size_t i = 0; i < tableSize; i++) {
-        table->buckets[i] = NULL;
+    if (tableSize < GROUP_SIZE) {
+        tableSize = GROUP_SIZE;
     }
+    return tableSize;
+}
+
+// Allocates empty slots for the table. The allocator aligns to 64 bytes, so the groups are aligned too.
+static void allocate_slots(HTable *table, size_t tableSize) {
+    table->size = tableSize;
+    table->groupMask = tableSize / GROUP_SIZE - 1;
 
-    table->blockEntriesIndex = 0;
-    table->blockEntriesCount = size;
-    table->blockEntries = allocator_alloc(sizeof(*table->blockEntries) * table->blockEntriesCount);
-    CHECK_ALLOC(table->blockEntries);
+    table->ctrl = allocator_alloc(sizeof(*table->ctrl) * tableSize);
+    CHECK_ALLOC(table->ctrl);
+    memset(table->ctrl, CTRL_EMPTY, sizeof(*table->ctrl) * tableSize);
 
+    table->entries = allocator_alloc(sizeof(*table->entries) * tableSize);
+    CHECK_ALLOC(table->entries);
+}
+
+HTable *htable_create(size_t size, const char *keyBase, size_t keyLength) {
+    HTable *table = allocator_alloc(sizeof(*table));
+    CHECK_ALLOC(table);
+    table->keyBase = keyBase;
+    table->keysEqual = select_keys_equal(keyLength);
+    table->keyLength = keyLength;
+    table->count = 0;
+    allocate_slots(table, table_size_for(size));
     return table;
 }
 
-// Used to avoid re-computing the hash value.
-static bool search_internal(const HTable *table, const char *key, size_t keyLength, size_t index, size_t *outValue) {
-    Entry *entry = table->buckets[index];
-    while (entry) {
-        if (str_equals_one_length(entry->key, key, keyLength)) {
-            *outValue = entry->value;
-            return true;
+// Returns the slot of the key if found. Otherwise, the first empty slot in the probe sequence.
+static size_t find_slot(const HTable *table, const char *key, size_t keyLength, uint64_t keyHash, bool *outFound) {
+    uint8_t fingerprint = hash_fingerprint(keyHash);
+    uint32_t tag = hash_tag(keyHash, keyLength);
+    size_t group = hash_group(keyHash) & table->groupMask;
+
+    // Triangular probing visits every group, since the group count is a power of two.
+    for (size_t probe = 1;; probe++) {
+        const uint8_t *groupCtrl = table->ctrl + group * GROUP_SIZE;
+
+        GroupMask matches = group_match(groupCtrl, fingerprint);
+        while (matches) {
+            size_t slot = group * GROUP_SIZE + group_mask_next(matches);
+            if (entry_equals(table, &table->entries[slot], tag, key, keyLength)) {
+                *outFound = true;
+                return slot;
+            }
+            matches &= matches - 1;
+        }
+
+        GroupMask empty = group_match_empty(groupCtrl);
+        if (empty) {
+            *outFound = false;
+            return group * GROUP_SIZE + group_mask_next(empty);
         }
-        entry = entry->next;
+
+        group = (group + probe) & table->groupMask;
     }
-    return false;
 }
 
 bool htable_search(const HTable *table, const char *key, size_t keyLength, size_t *outValue) {
     if (table == NULL) {
         return false;
     }
+    return htable_search_hashed(table, key, keyLength, htable_hash(key, keyLength), outValue);
+}
+
+bool htable_search_hashed(const HTable *table, const char *key, size_t keyLength, uint64_t keyHash, size_t *outValue) {
+    if (table == NULL) {
+        return false;
+    }
 
-    size_t index = hash(table->size, key, keyLength);
-    return search_internal(table, key, keyLength, index, outValue);
+    bool found;
+    size_t slot = find_slot(table, key, keyLength, keyHash, &found);
+    if (found) {
+        *outValue = (size_t)table->entries[slot].value;
+    }
+    return found;
 }
 
 void htable_insert_if_not_exists(HTable *table, const char *key, size_t keyLength, size_t value) {
-    size_t index = hash(table->size, key, keyLength);
-    size_t existing_value;
-    if (search_internal(table, key, keyLength, index, &existing_value)) {
+    htable_insert_if_not_exists_hashed(table, key, keyLength, htable_hash(key, keyLength), value);
+}
+
+void htable_insert_if_not_exists_hashed(HTable *table, const char *key, size_t keyLength, uint64_t keyHash, size_t value) {
+    bool found;
+    size_t slot = find_slot(table, key, keyLength, keyHash, &found);
+    if (found) {
         return;
     }
 
-    // In our scenario, we'll never add more items than the initially size passed during table creation.
-    // So, we're sure that we won't run out of space. No need to malloc again.
-    assert(table->blockEntriesIndex < table->blockEntriesCount);
+    // The table is sized upfront for all the keys, or grown by htable_reserve before the insert.
+    // So we're sure there is always an empty slot.
+    assert(table->count + 1 < table->size);
+
+    assert(keyLength <= 0xFF && value <= UINT32_MAX);
+    assert(table->keyLength == HTABLE_MIXED_KEY_LENGTH || keyLength == table->keyLength);
+    assert(key >= table->keyBase && (size_t)(key - table->keyBase) <= UINT32_MAX);
+
+    Entry *entry = &table->entries[slot];
+    entry->keyOffset = (uint32_t)(key - table->keyBase);
+    entry->value = (uint32_t)value;
+    entry->tag = hash_tag(keyHash, keyLength);
+    table->ctrl[slot] = hash_fingerprint(keyHash);
+    table->count++;
+}
 
-    Entry *new_entry = &table->blockEntries[table->blockEntriesIndex++];
-    new_entry->key = key;
-    new_entry->value = value;
-    new_entry->next = table->buckets[index];
-    table->buckets[index] = new_entry;
+bool htable_replace_hashed(HTable *table, const char *key, size_t keyLength, uint64_t keyHash, size_t value) {
+    bool found;
+    size_t slot = find_slot(table, key, keyLength, keyHash, &found);
+    if (found) {
+        assert(value <= UINT32_MAX);
+        table->entries[slot].value = (uint32_t)value;
+    }
+    return found;
+}
+
+// The first empty slot in the probe sequence of the hash. Used while rehashing, when the key is known to be absent.
+static size_t find_empty_slot(const HTable *table, uint64_t keyHash) {
+    size_t group = hash_group(keyHash) & table->groupMask;
+    for (size_t probe = 1;; probe++) {
+        GroupMask empty = group_match_empty(table->ctrl + group * GROUP_SIZE);
+        if (empty) {
+            return group * GROUP_SIZE + group_mask_next(empty);
+        }
+        group = (group + probe) & table->groupMask;
+    }
+}
+
+void htable_reserve(HTable *table, size_t count) {
+    size_t tableSize = table_size_for(count);
+    if (tableSize <= table->size) {
+        return;
+    }
+
+    // The old arrays may be in a mapped index, or in the arena. Either way they're left as they are.
+    HTable old = *table;
+    allocate_slots(table, tableSize);
+    for (size_t slot = 0; slot < old.size; slot++) {
+        if (old.ctrl[slot] == CTRL_EMPTY) {
+            continue;
+        }
+        const Entry *entry = &old.entries[slot];
+        uint64_t keyHash = htable_hash(table->keyBase + entry->keyOffset, tag_key_length(entry->tag));
+        size_t newSlot = find_empty_slot(table, keyHash);
+        table->entries[newSlot] = *entry;
+        table->ctrl[newSlot] = hash_fingerprint(keyHash);
+    }
+}
+
+void htable_prefetch(const HTable *table, uint64_t keyHash) {
+    if (table == NULL) {
+        return;
+    }
+    size_t group = hash_group(keyHash) & table->groupMask;
+    PREFETCH(table->ctrl + group * GROUP_SIZE);
+
+    // The entries of a group span a few cache lines, the key may be in any of them.
+    const char *entries = (const char *)(table->entries + group * GROUP_SIZE);
+    for (size_t offset = 0; offset < GROUP_SIZE * sizeof(Entry); offset += CACHE_LINE_SIZE) {
+        PREFETCH(entries + offset);
+    }
 }
 
 void htable_free(HTable *table) {
     if (table) {
-        free(table->blockEntries);
-        free(table->buckets);
+        free(table->entries);
+        free(table->ctrl);
         free(table);
     }
 }
+
+void htable_stats(const HTable *table, HTableStats *outStats) {
+    size_t maxProbeLength = 0;
+    size_t totalProbeLength = 0;
+
+    for (size_t slot = 0; slot < table->size; slot++) {
+        if (table->ctrl[slot] == CTRL_EMPTY) {
+            continue;
+        }
+        const Entry *entry = &table->entries[slot];
+        uint64_t keyHash = htable_hash(table->keyBase + entry->keyOffset, tag_key_length(entry->tag));
+
+        // Same probe sequence as find_slot, until it reaches the group of the slot.
+        size_t slotGroup = slot / GROUP_SIZE;
+        size_t group = hash_group(keyHash) & table->groupMask;
+        size_t probe = 1;
+        while (group != slotGroup) {
+            group = (group + probe) & table->groupMask;
+            probe++;
+        }
+
+        totalProbeLength += probe;
+        if (probe > maxProbeLength) {
+            maxProbeLength = probe;
+        }
+    }
+
+    outStats->size = table->size;
+    outStats->count = table->count;
+    outStats->maxProbeLength = maxProbeLength;
+    outStats->meanProbeLength = table->count > 0 ? (double)totalProbeLength / (double)table->count : 0.0;
+}
+
+/* Serialized layout, all sections are 64-byte aligned relative to the start:
+*   SerializedHeader
+*   ctrl[size]
+*   entries[size]
+*/
+typedef struct SerializedHeader {
+    uint64_t size;
+    uint64_t count;
+    uint64_t groupSize;                 // The probe sequence depends on it, so both sides must agree.
+    uint64_t entrySize;
+    uint64_t reserved[4];
+} SerializedHeader;
+
+#define SERIALIZED_ALIGNMENT ((size_t)64)
+
+static inline size_t align_serialized(size_t size) {
+    return (size + SERIALIZED_ALIGNMENT - 1) & ~(SERIALIZED_ALIGNMENT - 1);
+}
+
+static size_t serialized_size(size_t tableSize) {
+    return sizeof(SerializedHeader)
+        + align_serialized(tableSize * sizeof(uint8_t))
+        + align_serialized(tableSize * sizeof(Entry));
+}
+
+size_t htable_serialized_size(const HTable *table) {
+    return serialized_size(table->size);
+}
+
+bool htable_write(const HTable *table, FILE *file) {
+    static const char padding[SERIALIZED_ALIGNMENT] = { 0 };
+    SerializedHeader header = { .size = table->size, .count = table->count, .groupSize = GROUP_SIZE, .entrySize = sizeof(Entry) };
+    size_t ctrlSize = table->size * sizeof(*table->ctrl);
+    size_t entriesSize = table->size * sizeof(*table->entries);
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1
+        || fwrite(table->ctrl, 1, ctrlSize, file) != ctrlSize
+        || fwrite(padding, 1, align_serialized(ctrlSize) - ctrlSize, file) != align_serialized(ctrlSize) - ctrlSize) {
+        return false;
+    }
+
+    // The entries of empty slots were never written. They're zeroed in a copy, so the output doesn't depend on stale memory.
+    Entry buffer[512];
+    for (size_t i = 0; i < table->size; i += 512) {
+        size_t count = table->size - i < 512 ? table->size - i : 512;
+        for (size_t j = 0; j < count; j++) {
+            if (table->ctrl[i + j] == CTRL_EMPTY) {
+                memset(&buffer[j], 0, sizeof(buffer[j]));
+            }
+            else {
+                buffer[j] = table->entries[i + j];
+            }
+        }
+        if (fwrite(buffer, sizeof(*buffer), count, file) != count) {
+            return false;
+        }
+    }
+    return fwrite(padding, 1, align_serialized(entriesSize) - entriesSize, file) == align_serialized(entriesSize) - entriesSize;
+}
+
+HTable *htable_view(const void *source, size_t sourceSize, const char *keyBase, size_t keyLength) {
+    if (sourceSize < sizeof(SerializedHeader)) {
+        return NULL;
+    }
+    const SerializedHeader *header = (const SerializedHeader *)source;
+    size_t tableSize = (size_t)header->size;
+
+    // The size must be a power of two of at least one group, and the whole table must fit in the source.
+    if (header->groupSize != GROUP_SIZE || header->entrySize != sizeof(Entry)) {
+        return NULL;
+    }
+    if (tableSize < GROUP_SIZE || (tableSize & (tableSize - 1)) != 0 || header->count >= tableSize) {
+        return NULL;
+    }
+    if (tableSize > sourceSize / (sizeof(uint8_t) + sizeof(Entry)) || serialized_size(tableSize) > sourceSize) {
+        return NULL;
+    }
+
+    HTable *table = allocator_alloc(sizeof(*table));
+    CHECK_ALLOC(table);
+    table->keyBase = keyBase;
+    table->keysEqual = select_keys_equal(keyLength);
+    table->keyLength = keyLength;
+    table->size = tableSize;
+    table->groupMask = tableSize / GROUP_SIZE - 1;
+    table->count = (size_t)header->count;
+    table->ctrl = (uint8_t *)source + sizeof(SerializedHeader);
+    table->entries = (Entry *)(table->ctrl + align_serialized(tableSize * sizeof(uint8_t)));
+    return table;
+}
+
+bool htable_validate(const HTable *table, size_t keysSize, size_t valueLimit) {
+    size_t count = 0;
+    for (size_t slot = 0; slot < table->size; slot++) {
+        if (table->ctrl[slot] == CTRL_EMPTY) {
+            continue;
+        }
+        const Entry *entry = &table->entries[slot];
+        if ((table->ctrl[slot] & CTRL_EMPTY) != 0
+            || entry->keyOffset > keysSize
+            || tag_key_length(entry->tag) > keysSize - entry->keyOffset
+            || (table->keyLength != HTABLE_MIXED_KEY_LENGTH && tag_key_length(entry->tag) != table->keyLength)
+            || (entry->value >= valueLimit && entry->value != UINT32_MAX)) {
+            return false;
+        }
+        count++;
+    }
+    return count == table->count;
+}
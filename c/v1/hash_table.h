@@ -2,25 +2,92 @@
 #define HASH_TABLE_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
 
+// Fixed-width fields, the entries are persisted as they are. 12 bytes per slot, plus the control byte.
 typedef struct Entry {
-    const char *key;
-    size_t value;
-    struct Entry *next;
+    uint32_t keyOffset;                 // Offset of the key from the keyBase of the table
+    uint32_t value;
+    uint32_t tag;                       // 24 bits of the full hash and the 8-bit key length, checked before comparing keys
 } Entry;
 
-typedef struct HTable {
-    Entry **buckets;
-    size_t size;
+// Open addressing table. The slots are probed in groups, and each slot has one control byte.
+// The control byte is either empty or holds a 7-bit fingerprint of the hash.
+// The keys are stored as offsets from keyBase, so the table has no pointers into the key storage.
+// That makes it position independent, it can be written to a file and mapped back at any address.
+// Compares two keys of the given length. The tables with keys of a single length get one specialized for it.
+typedef bool (*HTableKeysEqual)(const char *a, const char *b, size_t length);
 
-    Entry *blockEntries;
-    size_t blockEntriesCount;
-    size_t blockEntriesIndex;
+typedef struct HTable {
+    const char *keyBase;
+    HTableKeysEqual keysEqual;
+    size_t keyLength;                   // Length of all keys, or HTABLE_MIXED_KEY_LENGTH.
+    uint8_t *ctrl;
+    Entry *entries;
+    size_t size;                        // Number of slots, power of two.
+    size_t groupMask;
+    size_t count;
 } HTable;
 
-HTable *htable_create(size_t size);
+#define HTABLE_MIXED_KEY_LENGTH ((size_t)0)
+
+// The keys passed to insert must point into the storage that starts at keyBase, within 4 GB of it.
+// The keys are shorter than 256 chars and the values fit in 32 bits.
+// A table for keys of a single length takes it as keyLength, and the compare is chosen for it here. Otherwise HTABLE_MIXED_KEY_LENGTH.
+HTable *htable_create(size_t size, const char *keyBase, size_t keyLength);
 bool htable_search(const HTable *table, const char *key, size_t keyLength, size_t *outValue);
 void htable_insert_if_not_exists(HTable *table, const char *key, size_t keyLength, size_t value);
+
+// The hashed variants take a hash precomputed with htable_hash or htable_hash_suffixes.
+bool htable_search_hashed(const HTable *table, const char *key, size_t keyLength, uint64_t keyHash, size_t *outValue);
+void htable_insert_if_not_exists_hashed(HTable *table, const char *key, size_t keyLength, uint64_t keyHash, size_t value);
+
+// Prefetches the first group the key is probed in, its control bytes and entries. Does nothing for a NULL table.
+// For the batched lookups, which hash a group of keys and prefetch them all before searching any of them.
+void htable_prefetch(const HTable *table, uint64_t keyHash);
+
+// Replaces the value of a key that is already in the table. Returns false if the key is not in the table.
+bool htable_replace_hashed(HTable *table, const char *key, size_t keyLength, uint64_t keyHash, size_t value);
+
+// The tables built from the files are sized upfront. The delta updates grow them before inserting, see delta_update.h.
+// If the table can't take count keys within the max load, it's at least doubled and all entries are rehashed into new arrays.
+void htable_reserve(HTable *table, size_t count);
+
+uint64_t htable_hash(const char *key, size_t keyLength);
+
+// Computes the hashes of all suffixes of the key in one backward pass.
+// outHashes[length] is the hash of the suffix with that length, for length in [1, keyLength].
+// It's equal to htable_hash(key + keyLength - length, length).
+void htable_hash_suffixes(const char *key, size_t keyLength, uint64_t *outHashes);
 void htable_free(HTable *table);
 
+// The probe length of a key is the number of groups visited to find it, 1 if it's in its home group.
+typedef struct HTableStats {
+    size_t size;
+    size_t count;
+    size_t maxProbeLength;
+    double meanProbeLength;
+} HTableStats;
+
+// Walks all entries and rehashes their keys, so it's O(count). Meant for reporting only.
+void htable_stats(const HTable *table, HTableStats *outStats);
+
+// Persistence. The serialized table is a small header followed by the control bytes and the entries.
+// The size is a multiple of 64, so consecutive tables in a file keep the alignment of the groups.
+size_t htable_serialized_size(const HTable *table);
+bool htable_write(const HTable *table, FILE *file);
+
+// Creates a read-only table over a serialized one, without copying. The source must be 64-byte aligned and outlive the table.
+// The keyLength is the same as for htable_create, htable_validate checks that the keys have it.
+// Returns NULL if the serialized table doesn't fit in sourceSize bytes, or it was written by a build with a different group size or entry layout.
+HTable *htable_view(const void *source, size_t sourceSize, const char *keyBase, size_t keyLength);
+
+// Checks the slots of a viewed table, a lookup trusts them. The keys must be within keysSize bytes from keyBase.
+// The values must be below valueLimit, or UINT32_MAX, the value the delta updates leave on a key without a match.
+// A table of a single key length must have only keys of that length.
+// The table must have as many used slots as its count, so it has an empty one that ends the probes. O(size), it reads all slots.
+bool htable_validate(const HTable *table, size_t keysSize, size_t valueLimit);
+
 #endif
@@ -0,0 +1,387 @@
+#include <string.h>
+#include "allocator.h"
+#include "common.h"
+#include "file_utils.h"
+#include "thread_utils.h"
+#include "index_file.h"
+#include "delta_update.h"
+#include "stats.h"
+
+/* Layout of the index file, each section is 64-byte aligned:
+*   IndexHeader
+*   uint32_t[recordCount]       Offsets of the original master parts into the source copy
+*   uint8_t[recordCount]        Lengths of the original master parts
+*   uint32_t[recordCount]       The next master part with the same code without hyphens, see MasterPartsTables.mpNhNext
+*   source[sourceSize]          Copy of the master parts file, with the added master parts appended by the delta updates
+*   keys[keysSize]              Uppercased master parts, with and without hyphens. The keys of the tables point into it.
+*   tables                      mpTable, then the suffix tables by length
+*   filters                     The filter of each table, in the same order
+* All offsets are from the start of the file and the tables store keys as offsets, so the file can be mapped at any address.
+* The original records have the same layout as in memory, so they're used in place. The load only validates them.
+* The removed master parts stay in the records and in the source copy, no table points to them anymore.
+*/
+#define INDEX_MAGIC "SUFXIDX"
+#define INDEX_ALIGNMENT ((size_t)64)
+
+typedef struct IndexHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t maxStringLength;           // The tables are per length, so the layout depends on it
+    uint64_t fileSize;
+    uint64_t sourceSize;
+    uint64_t sourceChecksum;
+    uint64_t deltaCount;                // Delta updates applied since the build. The source copy then matches no master parts file.
+    uint64_t recordCount;
+    uint64_t recordOffsetsOffset;
+    uint64_t recordLengthsOffset;
+    uint64_t recordNhNextOffset;
+    uint64_t sourceOffset;
+    uint64_t keysOffset;
+    uint64_t keysSize;
+    uint64_t keyBytes[MP_KEY_BYTES_WORDS];      // See MasterPartsTables.mpKeyBytes
+    uint64_t mpTableOffset;
+    uint64_t mpSuffixesTablesOffset[MAX_STRING_LENGTH];     // 0 when there is no table for that length
+    uint64_t mpNhSuffixesTablesOffset[MAX_STRING_LENGTH];
+    uint64_t mpTableFilterOffset;
+    uint64_t mpSuffixesFiltersOffset[MAX_STRING_LENGTH];    // Set exactly for the lengths that have a table
+    uint64_t mpNhSuffixesFiltersOffset[MAX_STRING_LENGTH];
+} IndexHeader;
+
+static inline size_t align_index(size_t size) {
+    return (size + INDEX_ALIGNMENT - 1) & ~(INDEX_ALIGNMENT - 1);
+}
+
+static bool write_padding(FILE *file, size_t size) {
+    static const char padding[INDEX_ALIGNMENT] = { 0 };
+    size_t paddingSize = align_index(size) - size;
+    return fwrite(padding, 1, paddingSize, file) == paddingSize;
+}
+
+// The offsets of the original records are from the start of the master parts file, so they're valid for the source copy as well.
+static bool write_records(FILE *file, const SourceData *data, const uint32_t *nhNext) {
+    const Records *records = &data->masterPartsOriginal;
+    size_t offsetsSize = records->count * sizeof(*records->offsets);
+    size_t lengthsSize = records->count * sizeof(*records->lengths);
+    size_t nhNextSize = records->count * sizeof(*nhNext);
+
+    return fwrite(records->offsets, 1, offsetsSize, file) == offsetsSize && write_padding(file, offsetsSize)
+        && fwrite(records->lengths, 1, lengthsSize, file) == lengthsSize && write_padding(file, lengthsSize)
+        && fwrite(nhNext, 1, nhNextSize, file) == nhNextSize && write_padding(file, nhNextSize);
+}
+
+static bool write_index(FILE *file, const IndexHeader *header, const SourceData *data, const MasterPartsTables *tables, const uint32_t *nhNext) {
+    const char *source = data->masterPartsOriginal.base;
+
+    if (fwrite(header, sizeof(*header), 1, file) != 1 || !write_padding(file, sizeof(*header))) return false;
+    if (!write_records(file, data, nhNext)) return false;
+    if (fwrite(source, 1, header->sourceSize, file) != header->sourceSize || !write_padding(file, header->sourceSize)) return false;
+    if (fwrite(data->stringBlock.blockMasterParts, 1, header->keysSize, file) != header->keysSize || !write_padding(file, header->keysSize)) return false;
+
+    if (!htable_write(tables->mpTable, file)) return false;
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        if (tables->mpSuffixesTables[length] && !htable_write(tables->mpSuffixesTables[length], file)) return false;
+    }
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        if (tables->mpNhSuffixesTables[length] && !htable_write(tables->mpNhSuffixesTables[length], file)) return false;
+    }
+
+    if (!bloom_write(tables->mpTableFilter, file)) return false;
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        if (tables->mpSuffixesFilters[length] && !bloom_write(tables->mpSuffixesFilters[length], file)) return false;
+    }
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        if (tables->mpNhSuffixesFilters[length] && !bloom_write(tables->mpNhSuffixesFilters[length], file)) return false;
+    }
+    return true;
+}
+
+// The index is written next to the target and renamed over it, so processes that have the old index mapped are not affected.
+// Except on Windows, where a mapped file can't be replaced. The update itself holds no mapping of it (FILE_ACCESS_COPY_ON_WRITE),
+// but the rename fails while another process has it mapped, e.g. a server started with --serve-index.
+static bool replace_file(const char *tempPath, const char *path) {
+#if defined(_WIN32) || defined(_WIN64)
+    return MoveFileExA(tempPath, path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(tempPath, path) == 0;
+#endif
+}
+
+bool index_file_write(const char *indexPath, const SourceData *data, const MasterPartsTables *tables) {
+    const char *source = data->masterPartsOriginal.base;
+    size_t sourceSize = data->stringBlock.masterPartsSourceSize;
+
+    // Linked here the first time, the index is the only way the delta updates get the tables.
+    const uint32_t *nhNext = tables->mpNhNext ? tables->mpNhNext : delta_update_link_nh_codes(data, tables);
+
+    IndexHeader header = { 0 };
+    if (tables->mpNhNext) {
+        memcpy(header.keyBytes, tables->mpKeyBytes, sizeof(header.keyBytes));
+    }
+    else {
+        delta_update_collect_key_bytes(data, header.keyBytes);
+    }
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_FILE_VERSION;
+    header.maxStringLength = (uint32_t)MAX_STRING_LENGTH;
+    header.sourceSize = sourceSize;
+    header.sourceChecksum = file_checksum(source, sourceSize);
+    header.deltaCount = data->masterPartsDeltaCount;
+    header.recordCount = data->masterPartsOriginal.count;
+    header.keysSize = data->stringBlock.blockMasterPartsSize;
+
+    size_t offset = align_index(sizeof(header));
+    header.recordOffsetsOffset = offset;
+    offset = align_index(offset + header.recordCount * sizeof(uint32_t));
+    header.recordLengthsOffset = offset;
+    offset = align_index(offset + header.recordCount * sizeof(uint8_t));
+    header.recordNhNextOffset = offset;
+    offset = align_index(offset + header.recordCount * sizeof(uint32_t));
+    header.sourceOffset = offset;
+    offset = align_index(offset + sourceSize);
+    header.keysOffset = offset;
+    offset = align_index(offset + header.keysSize);
+
+    header.mpTableOffset = offset;
+    offset += htable_serialized_size(tables->mpTable);
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        if (tables->mpSuffixesTables[length]) {
+            header.mpSuffixesTablesOffset[length] = offset;
+            offset += htable_serialized_size(tables->mpSuffixesTables[length]);
+        }
+    }
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        if (tables->mpNhSuffixesTables[length]) {
+            header.mpNhSuffixesTablesOffset[length] = offset;
+            offset += htable_serialized_size(tables->mpNhSuffixesTables[length]);
+        }
+    }
+
+    header.mpTableFilterOffset = offset;
+    offset += bloom_serialized_size(tables->mpTableFilter);
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        if (tables->mpSuffixesFilters[length]) {
+            header.mpSuffixesFiltersOffset[length] = offset;
+            offset += bloom_serialized_size(tables->mpSuffixesFilters[length]);
+        }
+    }
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        if (tables->mpNhSuffixesFilters[length]) {
+            header.mpNhSuffixesFiltersOffset[length] = offset;
+            offset += bloom_serialized_size(tables->mpNhSuffixesFilters[length]);
+        }
+    }
+    header.fileSize = offset;
+
+    size_t tempPathLength = strlen(indexPath) + sizeof(".tmp");
+    char *tempPath = allocator_alloc(tempPathLength);
+    CHECK_ALLOC(tempPath);
+    snprintf(tempPath, tempPathLength, "%s.tmp", indexPath);
+
+    FILE *file = fopen(tempPath, "wb");
+    if (!file) {
+        return false;
+    }
+    bool written = write_index(file, &header, data, tables, nhNext);
+    written = fclose(file) == 0 && written;
+    if (!written || !replace_file(tempPath, indexPath)) {
+        remove(tempPath);
+        return false;
+    }
+    return true;
+}
+
+static inline bool section_fits(uint64_t offset, uint64_t size, uint64_t fileSize) {
+    return offset <= fileSize && size <= fileSize - offset;
+}
+
+static bool header_is_valid(const IndexHeader *header, size_t fileSize) {
+    if (fileSize < sizeof(*header)) {
+        return false;
+    }
+    if (memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0
+        || header->version != INDEX_FILE_VERSION
+        || header->maxStringLength != MAX_STRING_LENGTH
+        || header->fileSize != fileSize) {
+        return false;
+    }
+    if (header->recordCount > fileSize / sizeof(uint32_t) || header->sourceSize > MAX_FILE_SIZE) {
+        return false;
+    }
+    return header->recordOffsetsOffset % INDEX_ALIGNMENT == 0
+        && section_fits(header->recordOffsetsOffset, header->recordCount * sizeof(uint32_t), fileSize)
+        && section_fits(header->recordLengthsOffset, header->recordCount * sizeof(uint8_t), fileSize)
+        && header->recordNhNextOffset % INDEX_ALIGNMENT == 0
+        && section_fits(header->recordNhNextOffset, header->recordCount * sizeof(uint32_t), fileSize)
+        && section_fits(header->sourceOffset, header->sourceSize, fileSize)
+        && section_fits(header->keysOffset, header->keysSize, fileSize)
+        && header->mpTableOffset != 0
+        && header->mpTableFilterOffset != 0;
+}
+
+static HTable *view_table(const MappedFile *file, uint64_t offset, const char *keys, size_t keyLength) {
+    if (offset == 0) {
+        return NULL;
+    }
+    if (offset >= file->size || offset % INDEX_ALIGNMENT != 0) {
+        return NULL;
+    }
+    return htable_view(file->data + offset, file->size - (size_t)offset, keys, keyLength);
+}
+
+typedef struct ValidateArgs {
+    const HTable *table;
+    const IndexHeader *header;
+    bool valid;
+} ValidateArgs;
+
+static thread_ret_t validate_table(thread_arg_t arg) {
+    ValidateArgs *args = (ValidateArgs *)arg;
+    args->valid = htable_validate(args->table, (size_t)args->header->keysSize, (size_t)args->header->recordCount);
+    return 0;
+}
+
+/* A lookup reads the keys and the records the entries point to without bounds checks, so all entries are checked upfront.
+* It reads every slot, most of the load time goes there. The tables are checked in parallel, one task per table.
+*/
+static bool validate_tables(const MasterPartsTables *tables, const IndexHeader *header) {
+    ValidateArgs args[1 + 2 * MAX_STRING_LENGTH];
+    size_t count = 0;
+    args[count++] = (ValidateArgs){ .table = tables->mpTable, .header = header };
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        if (tables->mpSuffixesTables[length]) {
+            args[count++] = (ValidateArgs){ .table = tables->mpSuffixesTables[length], .header = header };
+        }
+        if (tables->mpNhSuffixesTables[length]) {
+            args[count++] = (ValidateArgs){ .table = tables->mpNhSuffixesTables[length], .header = header };
+        }
+    }
+
+    TaskGroup group = { 0 };
+    for (size_t i = 0; i < count; i++) {
+        thread_pool_submit(&group, validate_table, &args[i]);
+    }
+    thread_pool_wait(&group);
+
+    for (size_t i = 0; i < count; i++) {
+        if (!args[i].valid) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static BloomFilter *view_filter(const MappedFile *file, uint64_t offset) {
+    if (offset == 0) {
+        return NULL;
+    }
+    if (offset >= file->size || offset % INDEX_ALIGNMENT != 0) {
+        return NULL;
+    }
+    return bloom_view(file->data + offset, file->size - (size_t)offset);
+}
+
+static void fail_invalid(MappedFile *file, const char *indexPath) {
+    file_unmap(file);
+    fprintf(stderr, "Invalid or incompatible index file: %s\n", indexPath);
+    exit(EXIT_FAILURE);
+}
+
+static void check_source(const IndexHeader *header, const char *masterPartsPath) {
+    if (header->deltaCount > 0) {
+        fprintf(stderr, "The index file was updated with deltas, it can't be checked against: %s\n", masterPartsPath);
+        exit(EXIT_FAILURE);
+    }
+
+    MappedFile source;
+    if (!file_map(masterPartsPath, FILE_ACCESS_SEQUENTIAL, &source)) {
+        fprintf(stderr, "Failed to open file: %s\n", masterPartsPath);
+        exit(EXIT_FAILURE);
+    }
+    bool matches = source.size == header->sourceSize
+        && file_checksum(source.data, source.size) == header->sourceChecksum;
+    file_unmap(&source);
+
+    if (!matches) {
+        fprintf(stderr, "The index file is out of date, rebuild it from: %s\n", masterPartsPath);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void load_index(const char *indexPath, const char *masterPartsPath, FileAccess access, SourceData *data, MasterPartsTables *outTables) {
+    assert(indexPath);
+    PhaseTimer timer = stats_phase_begin();
+
+    MappedFile file;
+    if (!file_map(indexPath, access, &file)) {
+        fprintf(stderr, "Failed to open file: %s\n", indexPath);
+        exit(EXIT_FAILURE);
+    }
+
+    const IndexHeader *header = (const IndexHeader *)file.data;
+    if (!header_is_valid(header, file.size)) {
+        fail_invalid(&file, indexPath);
+    }
+    if (masterPartsPath) {
+        check_source(header, masterPartsPath);
+    }
+
+    const char *source = file.data + header->sourceOffset;
+    const char *keys = file.data + header->keysOffset;
+    // The records are only read, the casts drop the const for the shared Records type.
+    Records mpOriginal = {
+        .base = source,
+        .offsets = (uint32_t *)(file.data + header->recordOffsetsOffset),
+        .lengths = (uint8_t *)(file.data + header->recordLengthsOffset),
+        .indices = NULL,
+        .count = (size_t)header->recordCount,
+    };
+    // The links only go forward, so they can't loop.
+    uint32_t *nhNext = (uint32_t *)(file.data + header->recordNhNextOffset);
+    for (size_t i = 0; i < mpOriginal.count; i++) {
+        if (!section_fits(mpOriginal.offsets[i], mpOriginal.lengths[i], header->sourceSize)
+            || (nhNext[i] != MP_INDEX_NONE && (nhNext[i] <= i || nhNext[i] >= mpOriginal.count))) {
+            fail_invalid(&file, indexPath);
+        }
+    }
+
+    MasterPartsTables tables = { .mpNhNext = nhNext };
+    memcpy(tables.mpKeyBytes, header->keyBytes, sizeof(tables.mpKeyBytes));
+    tables.mpTable = view_table(&file, header->mpTableOffset, keys, HTABLE_MIXED_KEY_LENGTH);
+    tables.mpTableFilter = view_filter(&file, header->mpTableFilterOffset);
+    if (tables.mpTable == NULL || tables.mpTableFilter == NULL) {
+        fail_invalid(&file, indexPath);
+    }
+    // A table without its filter is rejected as well, a lookup would then miss every key.
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        tables.mpSuffixesTables[length] = view_table(&file, header->mpSuffixesTablesOffset[length], keys, length);
+        tables.mpNhSuffixesTables[length] = view_table(&file, header->mpNhSuffixesTablesOffset[length], keys, length);
+        tables.mpSuffixesFilters[length] = view_filter(&file, header->mpSuffixesFiltersOffset[length]);
+        tables.mpNhSuffixesFilters[length] = view_filter(&file, header->mpNhSuffixesFiltersOffset[length]);
+        if ((tables.mpSuffixesTables[length] == NULL) != (header->mpSuffixesTablesOffset[length] == 0)
+            || (tables.mpNhSuffixesTables[length] == NULL) != (header->mpNhSuffixesTablesOffset[length] == 0)
+            || (tables.mpSuffixesFilters[length] == NULL) != (tables.mpSuffixesTables[length] == NULL)
+            || (tables.mpNhSuffixesFilters[length] == NULL) != (tables.mpNhSuffixesTables[length] == NULL)) {
+            fail_invalid(&file, indexPath);
+        }
+    }
+    if (!validate_tables(&tables, header)) {
+        fail_invalid(&file, indexPath);
+    }
+
+    data->masterPartsOriginal = mpOriginal;
+    data->masterPartsDeltaCount = (size_t)header->deltaCount;
+    data->stringBlock.blockMasterParts = keys;
+    data->stringBlock.blockMasterPartsSize = (size_t)header->keysSize;
+    data->stringBlock.masterPartsSourceSize = (size_t)header->sourceSize;
+    data->stringBlock.masterPartsFile = file;
+    *outTables = tables;
+    stats_phase_end(STATS_PHASE_LOAD_INDEX, timer);
+}
+
+void index_file_load(const char *indexPath, const char *masterPartsPath, SourceData *data, MasterPartsTables *outTables) {
+    load_index(indexPath, masterPartsPath, FILE_ACCESS_RANDOM, data, outTables);
+}
+
+void index_file_load_for_update(const char *indexPath, SourceData *data, MasterPartsTables *outTables) {
+    load_index(indexPath, NULL, FILE_ACCESS_COPY_ON_WRITE, data, outTables);
+}
@@ -0,0 +1,25 @@
+#ifndef INDEX_FILE_H
+#define INDEX_FILE_H
+
+#include <stdbool.h>
+#include "source_data.h"
+#include "processor.h"
+
+// Bump it whenever the layout of the file, the tables, the filters or the hash function changes.
+#define INDEX_FILE_VERSION ((uint32_t)4)
+
+// Writes the master parts and their tables into a position independent index file.
+// The data is loaded from the master parts file, or from an index and updated with deltas.
+// The size and checksum of the source are stored in the index, to check it against the master parts file later.
+bool index_file_write(const char *indexPath, const SourceData *data, const MasterPartsTables *tables);
+
+// Maps the index file and fills the master parts records and the tables. The tables are used in place, nothing is rebuilt.
+// If masterPartsPath is not NULL, the index is rejected when it wasn't built from that file, or it was updated with deltas since.
+// Exits on failure, same as loading the source files.
+void index_file_load(const char *indexPath, const char *masterPartsPath, SourceData *data, MasterPartsTables *outTables);
+
+// Same, but the file is mapped copy-on-write, so the delta updates can patch the tables in place.
+// Only the touched pages are copied and the file is never modified, the updated index is written with index_file_write.
+void index_file_load_for_update(const char *indexPath, SourceData *data, MasterPartsTables *outTables);
+
+#endif
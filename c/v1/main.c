@@ -1,49 +1,126 @@
 #include <string.h>
 #include "allocator.h"
+#include "thread_utils.h"
+#include "string_utils.h"
 #include "common.h"
 #include "source_data.h"
 #include "processor.h"
+#include "index_file.h"
+#include "delta_update.h"
+#include "server.h"
+#include "stream.h"
+#include "stats.h"
 
-static size_t run(const char *partsFile, const char *masterPartsFile, const char *resultsFile) {
-    allocator_init();
+// Each line is the part, the master part (max 49 chars), a separator and LF. The parts may be over-long, so they're counted apart.
+#define RESULT_LINE_OVERHEAD (MAX_STRING_LENGTH + 1)
 
-    SourceData data = { 0 };
-    source_data_load(&data, partsFile, masterPartsFile);
-    processor_initialize(&data);
+// Below this many parts per chunk, the thread overhead outweighs the lookup work.
+#define MIN_PARTS_PER_CHUNK ((size_t)4096)
 
-    // Two records per line. Each record is max 49 chars + CR + LC + separator
-    char *resultsBlock = allocator_alloc((MAX_STRING_LENGTH * 2 + 3) * data.partsOriginalCount);
+// More chunks than threads, so a slow chunk doesn't leave the other threads idle.
+#define CHUNKS_PER_THREAD ((size_t)4)
+
+typedef struct LookupChunk {
+    const SourceData *data;
+    size_t startIndex;
+    size_t endIndex;
+    char *resultsBlock;                 // Output slice for this chunk only
+    size_t resultsBlockLength;
+    size_t matchCount;
+} LookupChunk;
+
+static thread_ret_t find_matches_for_chunk(thread_arg_t arg) {
+    LookupChunk *chunk = (LookupChunk *)arg;
+    PhaseTimer timer = stats_phase_begin();
+    const SourceData *data = chunk->data;
+    char *resultsBlock = chunk->resultsBlock;
     size_t resultsBlockIndex = 0;
-    size_t matchCount = 0;
+    size_t countByRule[MATCH_RULE_COUNT] = { 0 };
 
-    for (size_t i = 0; i < data.partsOriginalCount; i++) {
-        const Part partOriginal = data.partsOriginal[i];
-        size_t mpIndex = processor_find_mp_index(partOriginal.code, partOriginal.codeLength);
+    for (size_t i = chunk->startIndex; i < chunk->endIndex; i++) {
+        MatchRule rule;
+        resultsBlockIndex += processor_write_part_match(data, i, resultsBlock + resultsBlockIndex, &rule);
+        countByRule[rule]++;
+    };
 
-        memcpy(resultsBlock + resultsBlockIndex, partOriginal.code, partOriginal.codeLength);
-        resultsBlockIndex += partOriginal.codeLength;
-        resultsBlock[resultsBlockIndex++] = CHAR_SEMICOLON;
+    chunk->resultsBlockLength = resultsBlockIndex;
+    chunk->matchCount = chunk->endIndex - chunk->startIndex - countByRule[MATCH_NONE];
+    stats_add_rule_hits(countByRule);
+    stats_phase_end(STATS_PHASE_LOOKUP, timer);
+    return 0;
+}
 
-        if (mpIndex != MAX_SIZE_T_VALUE) {
-            const Part mpOriginal = data.masterPartsOriginal[mpIndex];
-            memcpy(resultsBlock + resultsBlockIndex, mpOriginal.code, mpOriginal.codeLength);
-            resultsBlockIndex += mpOriginal.codeLength;
-            matchCount++;
-        }
+// Where the results of the part start in the results block. The parts before it are at most as long as its offset in the file.
+static inline size_t results_offset(const SourceData *data, size_t partIndex) {
+    size_t partsSize = partIndex < data->partsOriginal.count ? data->partsOriginal.offsets[partIndex] : data->stringBlock.partsFile.size;
+    return partsSize + RESULT_LINE_OVERHEAD * partIndex;
+}
 
-        resultsBlock[resultsBlockIndex++] = '\n';
-    };
+// Finds the matches for all parts and writes them in input order.
+static size_t match_and_write(const SourceData *data, const char *resultsFile) {
+    size_t partsCount = data->partsOriginal.count;
+    size_t chunkCount = thread_pool_concurrency() * CHUNKS_PER_THREAD;
+    if (chunkCount > partsCount / MIN_PARTS_PER_CHUNK) {
+        chunkCount = partsCount / MIN_PARTS_PER_CHUNK;
+    }
+    if (chunkCount == 0) {
+        chunkCount = 1;
+    }
+    size_t partsPerChunk = partsCount / chunkCount;
+
+    // Each chunk writes to its own slice, so the workers never share output state.
+    char *resultsBlock = allocator_alloc(results_offset(data, partsCount) + 1);
+    CHECK_ALLOC(resultsBlock);
+    LookupChunk *chunks = allocator_alloc(chunkCount * sizeof(*chunks));
+    CHECK_ALLOC(chunks);
+
+    for (size_t i = 0; i < chunkCount; i++) {
+        chunks[i].data = data;
+        chunks[i].startIndex = i * partsPerChunk;
+        chunks[i].endIndex = i == chunkCount - 1 ? partsCount : (i + 1) * partsPerChunk;
+        chunks[i].resultsBlock = resultsBlock + results_offset(data, chunks[i].startIndex);
+        chunks[i].resultsBlockLength = 0;
+        chunks[i].matchCount = 0;
+    }
+
+    TaskGroup group = { 0 };
+    for (size_t i = 0; i < chunkCount; i++) {
+        thread_pool_submit(&group, find_matches_for_chunk, &chunks[i]);
+    }
+    thread_pool_wait(&group);
 
+    PhaseTimer timer = stats_phase_begin();
     FILE *file = fopen(resultsFile, "w");
     if (!file) {
         perror("Failed to open file");
         return 0;
     }
-    fwrite(resultsBlock, 1, resultsBlockIndex, file);
+
+    // Join the slices in input order.
+    size_t matchCount = 0;
+    for (size_t i = 0; i < chunkCount; i++) {
+        fwrite(chunks[i].resultsBlock, 1, chunks[i].resultsBlockLength, file);
+        matchCount += chunks[i].matchCount;
+    }
     fclose(file);
+    stats_phase_end(STATS_PHASE_WRITE, timer);
+    return matchCount;
+}
+
+static size_t run(const char *partsFile, const char *masterPartsFile, const char *resultsFile, SuffixBackend backend) {
+    allocator_init();
+    string_kernels_init();
+    thread_pool_init(0);
+
+    SourceData data = { 0 };
+    source_data_load(&data, partsFile, masterPartsFile);
+    processor_initialize(&data, backend);
+    size_t matchCount = match_and_write(&data, resultsFile);
+
+    stats_report();
+    thread_pool_destroy();
 
     // We switched to allocator
-    //free(resultsBlock);
     //processor_clean();
     //source_data_clean(&data);
 
@@ -51,20 +128,201 @@ static size_t run(const char *partsFile, const char *masterPartsFile, const char
     return matchCount;
 }
 
+// Builds the master parts tables once and persists them. Returns the number of indexed master parts.
+static size_t run_build_index(const char *masterPartsFile, const char *indexFile) {
+    allocator_init();
+    string_kernels_init();
+    thread_pool_init(0);
+
+    SourceData data = { 0 };
+    source_data_load(&data, NULL, masterPartsFile);
+    processor_initialize(&data, SUFFIX_BACKEND_TABLES);
+
+    PhaseTimer timer = stats_phase_begin();
+    if (!index_file_write(indexFile, &data, processor_master_parts_tables())) {
+        fprintf(stderr, "Failed to write index file: %s\n", indexFile);
+        exit(EXIT_FAILURE);
+    }
+    stats_phase_end(STATS_PHASE_WRITE, timer);
+
+    stats_report();
+    thread_pool_destroy();
+
+    size_t count = data.masterPartsOriginal.count;
+    allocator_destroy();
+    return count;
+}
+
+// Same as run, but the master parts tables are mapped from the index instead of being built.
+static size_t run_with_index(const char *partsFile, const char *indexFile, const char *masterPartsFile, const char *resultsFile) {
+    allocator_init();
+    string_kernels_init();
+    thread_pool_init(0);
+
+    SourceData data = { 0 };
+    MasterPartsTables tables;
+    source_data_load(&data, partsFile, NULL);
+    index_file_load(indexFile, masterPartsFile, &data, &tables);
+    processor_initialize_with_tables(&data, &tables);
+    size_t matchCount = match_and_write(&data, resultsFile);
+
+    stats_report();
+    thread_pool_destroy();
+    allocator_destroy();
+    return matchCount;
+}
+
+// Patches the tables of the index with the delta and writes the updated index. Returns the number of applied changes.
+static size_t run_update_index(const char *indexFile, const char *deltaFile, const char *outputIndexFile) {
+    allocator_init();
+    string_kernels_init();
+    thread_pool_init(0);
+
+    SourceData data = { 0 };
+    MasterPartsTables tables;
+    DeltaUpdateResult result;
+    index_file_load_for_update(indexFile, &data, &tables);
+    delta_update_apply(deltaFile, &data, &tables, &result);
+
+    PhaseTimer timer = stats_phase_begin();
+    if (!index_file_write(outputIndexFile, &data, &tables)) {
+        fprintf(stderr, "Failed to write index file: %s\n", outputIndexFile);
+        exit(EXIT_FAILURE);
+    }
+    stats_phase_end(STATS_PHASE_WRITE, timer);
+    if (result.missingCount > 0) {
+        fprintf(stderr, "%zu removed codes were not in the master parts.\n", result.missingCount);
+    }
+
+    stats_report();
+    thread_pool_destroy();
+    allocator_destroy();
+    return result.addedCount + result.removedCount;
+}
+
+// Streams the parts in batches, the parts file isn't loaded upfront. Use "-" for stdin/stdout.
+static size_t run_stream(const char *partsFile, const char *masterPartsFile, const char *resultsFile, SuffixBackend backend) {
+    allocator_init();
+    string_kernels_init();
+    thread_pool_init(0);
+
+    SourceData data = { 0 };
+    source_data_load(&data, NULL, masterPartsFile);
+    processor_initialize(&data, backend);
+    size_t matchCount = stream_run(partsFile, resultsFile, &data);
+
+    stats_report();
+    thread_pool_destroy();
+    allocator_destroy();
+    return matchCount;
+}
+
+// Loads the master parts once, from the source file or from an index, and answers lookups until terminated.
+static bool run_server(const char *socketPath, const char *masterPartsFile, const char *indexFile, SuffixBackend backend) {
+    allocator_init();
+    string_kernels_init();
+    thread_pool_init(0);
+
+    SourceData data = { 0 };
+    if (indexFile) {
+        MasterPartsTables tables;
+        index_file_load(indexFile, NULL, &data, &tables);
+        processor_initialize_with_tables(&data, &tables);
+    }
+    else {
+        source_data_load(&data, NULL, masterPartsFile);
+        processor_initialize(&data, backend);
+    }
+    thread_pool_destroy();
+
+    return server_run(socketPath, &data);
+}
+
+static void print_usage(const char *app) {
+    printf("\nInvalid arguments!\n\n");
+    printf("Usage: %s <parts file> <master parts file> <results file>\n", app);
+    printf("       %s --build-index <master parts file> <index file>\n", app);
+    printf("       %s --use-index <parts file> <index file> <results file> [<master parts file>]\n", app);
+    printf("       %s --update-index <index file> <delta file> [<output index file>]\n", app);
+    printf("       %s --stream <parts file | -> <master parts file> <results file | ->\n", app);
+    printf("       %s --serve <socket path> <master parts file>\n", app);
+    printf("       %s --serve-index <socket path> <index file>\n\n", app);
+    printf("The optional master parts file in --use-index is used to check that the index is up to date.\n");
+    printf("The delta file has one change per line, \"+<code>\" adds a master part and \"-<code>\" removes it.\n");
+    printf("The index is updated in place, unless an output index file is given. On Windows, not while a server has it loaded.\n");
+    printf("Add --suffix-backend=sorted to the modes that load the master parts file, to find the rule 1 and 2 matches in a sorted index\n");
+    printf("of the reversed codes instead of the suffix tables. It takes a fraction of the memory, the lookups are slower.\n");
+    printf("Or add --suffix-backend=fused to these modes, to find the matches of all rules in a single table per length.\n");
+    printf("Add --stats or --stats=json to any mode except the server ones, to report timings and table statistics to stderr.\n\n");
+}
+
 int main(int argc, char *argv[]) {
 
 #if _DEBUG
-    run("../../data/parts.txt", "../../data/master-parts.txt", "results.txt");
+    run("../../data/parts.txt", "../../data/master-parts.txt", "results.txt", SUFFIX_BACKEND_TABLES);
     return 0;
 #endif
 
-    if (argc < 4) {
-        printf("\nInvalid arguments!\n\n");
-        printf("Usage: %s <parts file> <master parts file> <results file>\n\n", argv[0]);
+    // The stats and backend options can be anywhere, they're taken out before matching the modes.
+    StatsFormat statsFormat = STATS_OFF;
+    SuffixBackend backend = SUFFIX_BACKEND_TABLES;
+    int argCount = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--stats") == 0) {
+            statsFormat = STATS_TEXT;
+        }
+        else if (strcmp(argv[i], "--stats=json") == 0) {
+            statsFormat = STATS_JSON;
+        }
+        else if (strcmp(argv[i], "--suffix-backend=tables") == 0) {
+            backend = SUFFIX_BACKEND_TABLES;
+        }
+        else if (strcmp(argv[i], "--suffix-backend=sorted") == 0) {
+            backend = SUFFIX_BACKEND_SORTED;
+        }
+        else if (strcmp(argv[i], "--suffix-backend=fused") == 0) {
+            backend = SUFFIX_BACKEND_FUSED;
+        }
+        else {
+            argv[argCount++] = argv[i];
+        }
+    }
+    argc = argCount;
+    stats_init(statsFormat);
+
+    // The index files hold the suffix tables, the index modes take only the default backend.
+    bool tablesBackend = backend == SUFFIX_BACKEND_TABLES;
+
+    size_t output;
+    if (argc == 4 && tablesBackend && strcmp(argv[1], "--build-index") == 0) {
+        output = run_build_index(argv[2], argv[3]);
+    }
+    else if ((argc == 5 || argc == 6) && tablesBackend && strcmp(argv[1], "--use-index") == 0) {
+        output = run_with_index(argv[2], argv[3], argc == 6 ? argv[5] : NULL, argv[4]);
+    }
+    else if ((argc == 4 || argc == 5) && tablesBackend && strcmp(argv[1], "--update-index") == 0) {
+        output = run_update_index(argv[2], argv[3], argc == 5 ? argv[4] : argv[2]);
+    }
+    else if (argc == 5 && strcmp(argv[1], "--stream") == 0) {
+        output = run_stream(argv[2], argv[3], argv[4], backend);
+        // The results may go to stdout, so the count goes to stderr.
+        fprintf(stderr, "%zu\n", output);
+        return 0;
+    }
+    else if (argc == 4 && strcmp(argv[1], "--serve") == 0) {
+        return run_server(argv[2], argv[3], NULL, backend) ? 0 : 1;
+    }
+    else if (argc == 4 && tablesBackend && strcmp(argv[1], "--serve-index") == 0) {
+        return run_server(argv[2], NULL, argv[3], backend) ? 0 : 1;
+    }
+    else if (argc >= 4 && strncmp(argv[1], "--", 2) != 0) {
+        output = run(argv[1], argv[2], argv[3], backend);
+    }
+    else {
+        print_usage(argv[0]);
         return 1;
     }
 
-    size_t output = run(argv[1], argv[2], argv[3]);
     printf("%zu\n", output);
     return 0;
 }
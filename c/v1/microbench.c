@@ -0,0 +1,550 @@
+/* Microbenchmarks of the hash table, the Bloom filter and the string kernels, a separate build target from the app.
+* Build: bash build.sh microbench (build.bat microbench on Windows), then run publish/microbench [filter].
+*
+* Each benchmark runs an operation over a batch of inputs. A sample is one timed batch, repeated until it lasts
+* at least MIN_SAMPLE_SECONDS, so the timer resolution doesn't matter. After the warmup samples, the per-operation
+* times of all samples are sorted and reported as percentiles. Compare the p50 between builds, and use the spread
+* between p50 and p99 to judge whether a difference is noise.
+*/
+
+#include <stdint.h>
+#include <string.h>
+#include "allocator.h"
+#include "common.h"
+#include "cross_platform_time.h"
+#include "hash_table.h"
+#include "bloom_filter.h"
+#include "source_data.h"
+
+#define MIN_SAMPLE_SECONDS 0.002
+#define DEFAULT_SAMPLES ((size_t)30)
+#define DEFAULT_WARMUP ((size_t)5)
+
+// More slots than the biggest tables in a typical run, so the table doesn't fit in the L2 cache.
+#define TABLE_SLOTS ((size_t)1 << 18)
+#define LOOKUP_BATCH ((size_t)1 << 16)
+#define KERNEL_INPUTS ((size_t)256)
+
+// Same as LOOKUP_GROUP_SIZE in the processor. LOOKUP_BATCH is a multiple of it.
+#define BATCH_GROUP_SIZE ((size_t)16)
+
+static const size_t KEY_LENGTHS[] = { 4, 8, 16, 32, 48 };
+static const double LOAD_FACTORS[] = { 0.25, 0.5, 0.75, 0.875 };
+static const size_t KERNEL_LENGTHS[] = { 8, 16, 32, 48, 1024 };
+
+typedef struct Options {
+    const char *filter;
+    size_t samples;
+    size_t warmup;
+} Options;
+
+typedef struct Benchmark {
+    char name[64];
+    void (*run)(void *state);           // Runs one batch
+    void (*reset)(void *state);         // Optional, runs before each batch, untimed
+    void *state;
+    size_t opsPerBatch;
+    size_t bytesPerBatch;               // 0 if a per-byte cost doesn't apply
+} Benchmark;
+
+static volatile uint64_t sink;
+static Options options;
+static const char *pendingHeader;       // Printed before the first benchmark of the group that passes the filter
+
+/* SplitMix64, deterministic inputs for every run. */
+static uint64_t rngState = 1;
+
+static inline uint64_t rng_next(void) {
+    uint64_t z = (rngState += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static void random_upper(char *buffer, size_t length) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+    for (size_t i = 0; i < length; i++) {
+        buffer[i] = alphabet[rng_next() % (sizeof(alphabet) - 1)];
+    }
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static inline double percentile(const double *sorted, size_t count, double p) {
+    size_t index = (size_t)(p * (double)(count - 1) + 0.5);
+    return sorted[index];
+}
+
+static double run_sample(const Benchmark *benchmark, size_t repeats) {
+    double elapsed = 0;
+    for (size_t i = 0; i < repeats; i++) {
+        if (benchmark->reset) {
+            benchmark->reset(benchmark->state);
+        }
+        double start = time_get_seconds();
+        benchmark->run(benchmark->state);
+        elapsed += time_get_seconds() - start;
+    }
+    return elapsed;
+}
+
+static void run_benchmark(const Benchmark *benchmark) {
+    if (options.filter && strstr(benchmark->name, options.filter) == NULL) {
+        return;
+    }
+    if (pendingHeader) {
+        printf("\n%-40s %9s %9s %9s %9s %9s %9s %9s\n", pendingHeader, "min ns", "p50 ns", "p90 ns", "p99 ns", "max ns", "Mops/s", "ns/byte");
+        pendingHeader = NULL;
+    }
+
+    // Calibrate the batches per sample. It doubles as the first warmup.
+    size_t repeats = 1;
+    while (run_sample(benchmark, repeats) < MIN_SAMPLE_SECONDS) {
+        repeats *= 2;
+    }
+    for (size_t i = 0; i < options.warmup; i++) {
+        run_sample(benchmark, repeats);
+    }
+
+    double *nsPerOp = malloc(options.samples * sizeof(*nsPerOp));
+    CHECK_ALLOC(nsPerOp);
+    for (size_t i = 0; i < options.samples; i++) {
+        double seconds = run_sample(benchmark, repeats);
+        nsPerOp[i] = seconds * 1e9 / (double)(repeats * benchmark->opsPerBatch);
+    }
+    qsort(nsPerOp, options.samples, sizeof(*nsPerOp), compare_doubles);
+
+    double p50 = percentile(nsPerOp, options.samples, 0.50);
+    double nsPerByte = benchmark->bytesPerBatch > 0
+        ? p50 * (double)benchmark->opsPerBatch / (double)benchmark->bytesPerBatch
+        : 0.0;
+    printf("%-40s %9.2f %9.2f %9.2f %9.2f %9.2f %9.1f", benchmark->name, nsPerOp[0], p50,
+        percentile(nsPerOp, options.samples, 0.90), percentile(nsPerOp, options.samples, 0.99),
+        nsPerOp[options.samples - 1], 1e3 / p50);
+    if (benchmark->bytesPerBatch > 0) {
+        printf(" %9.3f", nsPerByte);
+    }
+    printf("\n");
+    free(nsPerOp);
+}
+
+static void print_header(const char *title) {
+    pendingHeader = title;
+}
+
+/*
+* Hash table
+*/
+
+typedef struct TableState {
+    char *keys;                         // count keys of keyLength chars, back to back
+    char *missKeys;                     // Same shape, none of them is in the table
+    size_t *order;                      // Shuffled lookup order
+    size_t keyLength;
+    size_t count;
+    HTable *table;
+    BloomFilter *filter;                // Over the keys of the table, for the filtered lookups
+} TableState;
+
+static HTable *create_table(const TableState *state) {
+    // Sized so htable_create picks exactly TABLE_SLOTS slots, then the count gives the load factor.
+    HTable *table = htable_create(TABLE_SLOTS * 7 / 8 - 1, state->keys, state->keyLength);
+    assert(table->size == TABLE_SLOTS);
+
+    // Touch the entries upfront, so page faults don't show up in the insert timings.
+    memset(table->entries, 0, table->size * sizeof(*table->entries));
+    return table;
+}
+
+static void fill_table(HTable *table, const TableState *state) {
+    for (size_t i = 0; i < state->count; i++) {
+        htable_insert_if_not_exists(table, state->keys + i * state->keyLength, state->keyLength, i);
+    }
+}
+
+static void insert_reset(void *arg) {
+    TableState *state = (TableState *)arg;
+    state->table = create_table(state);
+}
+
+static void insert_run(void *arg) {
+    TableState *state = (TableState *)arg;
+    fill_table(state->table, state);
+}
+
+static void search_run(const TableState *state, const char *keys) {
+    uint64_t found = 0;
+    for (size_t i = 0; i < LOOKUP_BATCH; i++) {
+        size_t value;
+        const char *key = keys + state->order[i] * state->keyLength;
+        found += htable_search(state->table, key, state->keyLength, &value);
+    }
+    sink += found;
+}
+
+// Same as the lookups in the processor, the hash is computed once for the filter and the table.
+static void search_filtered_run(const TableState *state, const char *keys) {
+    uint64_t found = 0;
+    for (size_t i = 0; i < LOOKUP_BATCH; i++) {
+        size_t value;
+        const char *key = keys + state->order[i] * state->keyLength;
+        uint64_t hash = htable_hash(key, state->keyLength);
+        found += bloom_may_contain(state->filter, hash) && htable_search_hashed(state->table, key, state->keyLength, hash, &value);
+    }
+    sink += found;
+}
+
+// Same lookups in groups, the way the processor batches them. A group is hashed and its filter blocks prefetched,
+// then the table groups of the keys that pass, and only then searched.
+static void search_batched_run(const TableState *state, const char *keys) {
+    uint64_t found = 0;
+    uint64_t hashes[BATCH_GROUP_SIZE];
+    for (size_t groupStart = 0; groupStart < LOOKUP_BATCH; groupStart += BATCH_GROUP_SIZE) {
+        for (size_t i = 0; i < BATCH_GROUP_SIZE; i++) {
+            hashes[i] = htable_hash(keys + state->order[groupStart + i] * state->keyLength, state->keyLength);
+            bloom_prefetch(state->filter, hashes[i]);
+        }
+        for (size_t i = 0; i < BATCH_GROUP_SIZE; i++) {
+            if (bloom_may_contain(state->filter, hashes[i])) {
+                htable_prefetch(state->table, hashes[i]);
+            }
+        }
+        for (size_t i = 0; i < BATCH_GROUP_SIZE; i++) {
+            size_t value;
+            const char *key = keys + state->order[groupStart + i] * state->keyLength;
+            found += bloom_may_contain(state->filter, hashes[i]) && htable_search_hashed(state->table, key, state->keyLength, hashes[i], &value);
+        }
+    }
+    sink += found;
+}
+
+static void search_batched_hit_run(void *arg) {
+    TableState *state = (TableState *)arg;
+    search_batched_run(state, state->keys);
+}
+
+static void search_batched_miss_run(void *arg) {
+    TableState *state = (TableState *)arg;
+    search_batched_run(state, state->missKeys);
+}
+
+static void search_filtered_hit_run(void *arg) {
+    TableState *state = (TableState *)arg;
+    search_filtered_run(state, state->keys);
+}
+
+static void search_filtered_miss_run(void *arg) {
+    TableState *state = (TableState *)arg;
+    search_filtered_run(state, state->missKeys);
+}
+
+static void search_hit_run(void *arg) {
+    TableState *state = (TableState *)arg;
+    search_run(state, state->keys);
+}
+
+static void search_miss_run(void *arg) {
+    TableState *state = (TableState *)arg;
+    search_run(state, state->missKeys);
+}
+
+static void init_table_state(TableState *state, size_t keyLength, double loadFactor) {
+    state->keyLength = keyLength;
+    state->count = (size_t)(loadFactor * (double)TABLE_SLOTS);
+
+    state->keys = allocator_alloc(state->count * keyLength);
+    state->missKeys = allocator_alloc(state->count * keyLength);
+    state->order = allocator_alloc(LOOKUP_BATCH * sizeof(*state->order));
+    CHECK_ALLOC(state->keys);
+    CHECK_ALLOC(state->missKeys);
+    CHECK_ALLOC(state->order);
+
+    // The first 4 chars of a key are a permutation of its index in base 36 (36^4 > count), so the keys are distinct.
+    // The miss keys are lowercase, the table holds only uppercase keys.
+    random_upper(state->keys, state->count * keyLength);
+    for (size_t i = 0; i < state->count; i++) {
+        static const char digits[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+        size_t n = (i * 7919) % (36 * 36 * 36 * 36);
+        for (size_t d = 0; d < 4; d++, n /= 36) {
+            state->keys[i * keyLength + d] = digits[n % 36];
+        }
+    }
+    for (size_t i = 0; i < state->count * keyLength; i++) {
+        char c = state->keys[i];
+        state->missKeys[i] = c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : 'x';
+    }
+    for (size_t i = 0; i < LOOKUP_BATCH; i++) {
+        state->order[i] = (size_t)(rng_next() % state->count);
+    }
+}
+
+static void bench_htable(void) {
+    print_header("htable");
+    for (size_t k = 0; k < sizeof(KEY_LENGTHS) / sizeof(KEY_LENGTHS[0]); k++) {
+        for (size_t f = 0; f < sizeof(LOAD_FACTORS) / sizeof(LOAD_FACTORS[0]); f++) {
+            // Each configuration gets a fresh default arena, the insert benchmark creates a table per batch.
+            allocator_init();
+
+            TableState state = { 0 };
+            init_table_state(&state, KEY_LENGTHS[k], LOAD_FACTORS[f]);
+            size_t keyBytes = state.count * state.keyLength;
+            size_t lookupBytes = LOOKUP_BATCH * state.keyLength;
+
+            Benchmark benchmark = { .run = insert_run, .reset = insert_reset, .state = &state, .opsPerBatch = state.count, .bytesPerBatch = keyBytes };
+            snprintf(benchmark.name, sizeof(benchmark.name), "htable/insert/len=%zu/load=%.3f", state.keyLength, LOAD_FACTORS[f]);
+            run_benchmark(&benchmark);
+
+            state.table = create_table(&state);
+            fill_table(state.table, &state);
+
+            benchmark = (Benchmark){ .run = search_hit_run, .state = &state, .opsPerBatch = LOOKUP_BATCH, .bytesPerBatch = lookupBytes };
+            snprintf(benchmark.name, sizeof(benchmark.name), "htable/hit/len=%zu/load=%.3f", state.keyLength, LOAD_FACTORS[f]);
+            run_benchmark(&benchmark);
+
+            benchmark = (Benchmark){ .run = search_miss_run, .state = &state, .opsPerBatch = LOOKUP_BATCH, .bytesPerBatch = lookupBytes };
+            snprintf(benchmark.name, sizeof(benchmark.name), "htable/miss/len=%zu/load=%.3f", state.keyLength, LOAD_FACTORS[f]);
+            run_benchmark(&benchmark);
+
+            state.filter = bloom_create(state.count);
+            for (size_t i = 0; i < state.count; i++) {
+                bloom_add(state.filter, htable_hash(state.keys + i * state.keyLength, state.keyLength));
+            }
+
+            benchmark = (Benchmark){ .run = search_filtered_hit_run, .state = &state, .opsPerBatch = LOOKUP_BATCH, .bytesPerBatch = lookupBytes };
+            snprintf(benchmark.name, sizeof(benchmark.name), "htable/filtered_hit/len=%zu/load=%.3f", state.keyLength, LOAD_FACTORS[f]);
+            run_benchmark(&benchmark);
+
+            benchmark = (Benchmark){ .run = search_filtered_miss_run, .state = &state, .opsPerBatch = LOOKUP_BATCH, .bytesPerBatch = lookupBytes };
+            snprintf(benchmark.name, sizeof(benchmark.name), "htable/filtered_miss/len=%zu/load=%.3f", state.keyLength, LOAD_FACTORS[f]);
+            run_benchmark(&benchmark);
+
+            benchmark = (Benchmark){ .run = search_batched_hit_run, .state = &state, .opsPerBatch = LOOKUP_BATCH, .bytesPerBatch = lookupBytes };
+            snprintf(benchmark.name, sizeof(benchmark.name), "htable/batched_hit/len=%zu/load=%.3f", state.keyLength, LOAD_FACTORS[f]);
+            run_benchmark(&benchmark);
+
+            benchmark = (Benchmark){ .run = search_batched_miss_run, .state = &state, .opsPerBatch = LOOKUP_BATCH, .bytesPerBatch = lookupBytes };
+            snprintf(benchmark.name, sizeof(benchmark.name), "htable/batched_miss/len=%zu/load=%.3f", state.keyLength, LOAD_FACTORS[f]);
+            run_benchmark(&benchmark);
+
+            allocator_destroy();
+        }
+    }
+}
+
+/*
+* Hash functions
+*/
+
+typedef struct HashState {
+    char *keys;
+    size_t keyLength;
+    size_t count;
+} HashState;
+
+static void hash_run(void *arg) {
+    HashState *state = (HashState *)arg;
+    uint64_t h = 0;
+    for (size_t i = 0; i < state->count; i++) {
+        h ^= htable_hash(state->keys + i * state->keyLength, state->keyLength);
+    }
+    sink += h;
+}
+
+static void hash_suffixes_run(void *arg) {
+    HashState *state = (HashState *)arg;
+    uint64_t hashes[MAX_STRING_LENGTH + 1];
+    uint64_t h = 0;
+    for (size_t i = 0; i < state->count; i++) {
+        htable_hash_suffixes(state->keys + i * state->keyLength, state->keyLength, hashes);
+        h ^= hashes[state->keyLength];
+    }
+    sink += h;
+}
+
+static void bench_hash(void) {
+    print_header("hash");
+    allocator_init();
+    for (size_t k = 0; k < sizeof(KEY_LENGTHS) / sizeof(KEY_LENGTHS[0]); k++) {
+        HashState state = { .keyLength = KEY_LENGTHS[k], .count = LOOKUP_BATCH };
+        state.keys = allocator_alloc(state.count * state.keyLength);
+        CHECK_ALLOC(state.keys);
+        random_upper(state.keys, state.count * state.keyLength);
+        size_t bytes = state.count * state.keyLength;
+
+        Benchmark benchmark = { .run = hash_run, .state = &state, .opsPerBatch = state.count, .bytesPerBatch = bytes };
+        snprintf(benchmark.name, sizeof(benchmark.name), "hash/htable_hash/len=%zu", state.keyLength);
+        run_benchmark(&benchmark);
+
+        benchmark = (Benchmark){ .run = hash_suffixes_run, .state = &state, .opsPerBatch = state.count, .bytesPerBatch = bytes };
+        snprintf(benchmark.name, sizeof(benchmark.name), "hash/htable_hash_suffixes/len=%zu", state.keyLength);
+        run_benchmark(&benchmark);
+    }
+    allocator_destroy();
+}
+
+/*
+* String kernels. The common.h helpers are measured through str_kernels, once with the scalar kernels
+* and once with the ones picked for this CPU.
+*/
+
+typedef struct KernelState {
+    char *inputs;                       // KERNEL_INPUTS records of length chars, mixed case with hyphens and padding
+    char *output;
+    size_t length;
+} KernelState;
+
+static void to_upper_run(void *arg) {
+    KernelState *state = (KernelState *)arg;
+    for (size_t i = 0; i < KERNEL_INPUTS; i++) {
+        str_to_upper(state->inputs + i * state->length, state->length, state->output);
+    }
+    sink += (uint8_t)state->output[0];
+}
+
+static void remove_hyphens_run(void *arg) {
+    KernelState *state = (KernelState *)arg;
+    size_t total = 0;
+    for (size_t i = 0; i < KERNEL_INPUTS; i++) {
+        size_t length;
+        str_remove_hyphens(state->inputs + i * state->length, state->length, state->output, &length);
+        total += length;
+    }
+    sink += total;
+}
+
+static void trim_run(void *arg) {
+    KernelState *state = (KernelState *)arg;
+    size_t total = 0;
+    for (size_t i = 0; i < KERNEL_INPUTS; i++) {
+        size_t length;
+        str_trim(state->inputs + i * state->length, state->length, &length);
+        total += length;
+    }
+    sink += total;
+}
+
+static void find_char_run(void *arg) {
+    KernelState *state = (KernelState *)arg;
+    size_t total = 0;
+    for (size_t i = 0; i < KERNEL_INPUTS; i++) {
+        const char *start = state->inputs + i * state->length;
+        const char *end = start + state->length;
+        // Not present, so it scans the whole record, like the newline search over a long line.
+        total += (size_t)(str_kernels.find_char(start, end, '\n') - start);
+    }
+    sink += total;
+}
+
+static void count_char_run(void *arg) {
+    KernelState *state = (KernelState *)arg;
+    size_t total = 0;
+    for (size_t i = 0; i < KERNEL_INPUTS; i++) {
+        const char *start = state->inputs + i * state->length;
+        total += str_kernels.count_char(start, start + state->length, CHAR_HYPHEN);
+    }
+    sink += total;
+}
+
+static void bench_kernels_with(StringKernels kernels) {
+    str_kernels = kernels;
+    allocator_init();
+
+    static const struct {
+        const char *name;
+        void (*run)(void *state);
+    } cases[] = {
+        { "to_upper", to_upper_run },
+        { "remove_hyphens", remove_hyphens_run },
+        { "trim", trim_run },
+        { "find_char", find_char_run },
+        { "count_char", count_char_run },
+    };
+
+    for (size_t l = 0; l < sizeof(KERNEL_LENGTHS) / sizeof(KERNEL_LENGTHS[0]); l++) {
+        KernelState state = { .length = KERNEL_LENGTHS[l] };
+        state.inputs = allocator_alloc(KERNEL_INPUTS * state.length);
+        state.output = allocator_alloc(state.length + 1);
+        CHECK_ALLOC(state.inputs);
+        CHECK_ALLOC(state.output);
+
+        // Lowercase letters, about 1 in 8 chars a hyphen, and two spaces on both ends to trim.
+        random_upper(state.inputs, KERNEL_INPUTS * state.length);
+        for (size_t i = 0; i < KERNEL_INPUTS * state.length; i++) {
+            uint64_t r = rng_next();
+            if ((r & 7) == 0) {
+                state.inputs[i] = CHAR_HYPHEN;
+            }
+            else if ((r & 8) && state.inputs[i] >= 'A' && state.inputs[i] <= 'Z') {
+                state.inputs[i] = (char)(state.inputs[i] - 'A' + 'a');
+            }
+        }
+        for (size_t i = 0; i < KERNEL_INPUTS; i++) {
+            char *record = state.inputs + i * state.length;
+            record[0] = record[1] = CHAR_SPACE;
+            record[state.length - 1] = record[state.length - 2] = CHAR_SPACE;
+        }
+
+        for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+            Benchmark benchmark = { .run = cases[c].run, .state = &state, .opsPerBatch = KERNEL_INPUTS, .bytesPerBatch = KERNEL_INPUTS * state.length };
+            snprintf(benchmark.name, sizeof(benchmark.name), "kernels/%s/%s/len=%zu", kernels.name, cases[c].name, state.length);
+            run_benchmark(&benchmark);
+        }
+    }
+    allocator_destroy();
+}
+
+static void bench_kernels(void) {
+    print_header("kernels");
+
+    // The scalar kernels are the default until string_kernels_init runs.
+    StringKernels scalar = str_kernels;
+    string_kernels_init();
+    StringKernels best = str_kernels;
+
+    bench_kernels_with(scalar);
+    if (strcmp(best.name, scalar.name) != 0) {
+        bench_kernels_with(best);
+    }
+    str_kernels = best;
+}
+
+static void print_usage(const char *programName) {
+    printf("Usage: %s [filter] [--samples <n>] [--warmup <n>]\n", programName);
+    printf("The filter is matched as a substring of the benchmark names, e.g. htable/hit, hash/, kernels/avx2/to_upper.\n\n");
+}
+
+int main(int argc, char *argv[]) {
+    options = (Options){ .samples = DEFAULT_SAMPLES, .warmup = DEFAULT_WARMUP };
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "--samples") == 0 || strcmp(argv[i], "--warmup") == 0) && i + 1 < argc) {
+            size_t value = (size_t)strtoull(argv[i + 1], NULL, 10);
+            if (argv[i][2] == 's') {
+                options.samples = value;
+            }
+            else {
+                options.warmup = value;
+            }
+            i++;
+        }
+        else if (argv[i][0] == '-') {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        else {
+            options.filter = argv[i];
+        }
+    }
+    if (options.samples == 0) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    bench_hash();
+    bench_htable();
+    bench_kernels();
+    return EXIT_SUCCESS;
+}
@@ -1,14 +1,60 @@
+#include <string.h>
+#include "allocator.h"
 #include "common.h"
 #include "thread_utils.h"
 #include "hash_table.h"
+#include "bloom_filter.h"
+#include "suffix_index.h"
+#include "suffix_trie.h"
 #include "source_data.h"
+#include "processor.h"
+#include "stats.h"
+
+// Below this many records per chunk, the task overhead outweighs the hashing work.
+#define MIN_RECORDS_PER_HASH_CHUNK ((size_t)8192)
+
+/* The lookups are resolved in groups. The whole group is hashed and its filters prefetched, then the tables that the filters
+* let through, and only then is each code resolved. So the cache misses within a group overlap, instead of one waiting for the other.
+* Big enough to cover the memory latency, small enough that the prefetched lines are still cached when they're read.
+*/
+#define LOOKUP_GROUP_SIZE ((size_t)16)
+
+/* Suffix hashes for sorted records, precomputed once and shared by all per-length tables.
+* hashes[length][i - startIndexByLength[length]] is the hash of the suffix with that length for record i.
+* The records are sorted by length, so all records from startIndexByLength[length] onward have such a suffix.
+*/
+typedef struct SuffixHashes {
+    uint64_t *hashes[MAX_STRING_LENGTH];
+    const size_t *startIndexByLength;
+} SuffixHashes;
+
+/* Rule 3 results of the on-demand lookups, the same codes keep coming in the streams and the server requests.
+* Direct-mapped, a code replaces the one in its slot, so the memory is fixed. Sharded by hash, each shard has its own lock.
+*/
+#define SUFFIX_MEMO_SHARDS ((size_t)64)
+#define SUFFIX_MEMO_SLOTS_PER_SHARD ((size_t)256)
+
+typedef struct SuffixMemoSlot {
+    uint32_t packedMatch;
+    uint8_t codeLength;                 // 0 for an empty slot
+    char code[MAX_STRING_LENGTH];
+} SuffixMemoSlot;
+
+typedef struct SuffixMemoShard {
+    thread_mutex_t mutex;
+    SuffixMemoSlot slots[SUFFIX_MEMO_SLOTS_PER_SHARD];
+} SuffixMemoShard;
 
 typedef struct Context {
     const SourceData *data;
-    HTable *mpTable;
-    HTable *mpSuffixesTables[MAX_STRING_LENGTH];
-    HTable *mpNhSuffixesTables[MAX_STRING_LENGTH];
-    HTable *partTables[MAX_STRING_LENGTH];
+    MasterPartsTables mp;
+    HTable *partTables[MAX_STRING_LENGTH];  // Each distinct part code (uppercased) with its packed match, by length
+    uint32_t *partMatches;              // The packed match of each original part, copied from its entry in partTables
+    bool resolveSuffixesOnDemand;       // No parts were loaded upfront (server mode), so rule 3 is resolved per lookup.
+    SuffixMemoShard *suffixMemo;        // Only when resolving on demand, the loaded parts are memoized in partTables
+    SuffixHashes mpSuffixHashes;
+    SuffixHashes mpNhSuffixHashes;
+    SuffixBackend backend;
 } Context;
 
 typedef struct ThreadArgs {
@@ -17,172 +63,723 @@ typedef struct ThreadArgs {
     size_t length;
 } ThreadArgs;
 
+typedef struct HashChunkArgs {
+    const Records *records;
+    size_t startIndex;
+    size_t endIndex;
+    SuffixHashes *suffixHashes;
+} HashChunkArgs;
+
 static Context ctx = { 0 };
 
-static void create_tables_in_parallel(Context *ctx, const Part *parts, size_t count, thread_func_t func, bool create_mp_table);
+static void submit_suffix_hashes_tasks(TaskGroup *group, Arena *arena, const Records *records, const size_t *startIndexByLength, SuffixHashes *suffixHashes);
+static void submit_tables_tasks(TaskGroup *group, const size_t *startIndexByLength, thread_func_t func, ThreadArgs *threadArgs);
+static thread_ret_t create_suffix_hashes(thread_arg_t arg);
 static thread_ret_t create_table_for_masterParts(thread_arg_t arg);
 static thread_ret_t create_suffix_tables_for_masterParts(thread_arg_t arg);
 static thread_ret_t create_suffix_tables_for_masterPartsNh(thread_arg_t arg);
+static thread_ret_t create_suffix_index_for_masterParts(thread_arg_t arg);
+static thread_ret_t create_suffix_index_for_masterPartsNh(thread_arg_t arg);
+static thread_ret_t create_match_tables_for_masterParts(thread_arg_t arg);
+static thread_ret_t create_table_filter_for_masterParts(thread_arg_t arg);
 static thread_ret_t create_tables_for_parts(thread_arg_t arg);
+static void resolve_parts(TaskGroup *group, ThreadArgs *threadArgs);
+static void suffix_memo_init();
 
-size_t processor_find_mp_index(const char *partCode, size_t partCodeLength) {
-    if (partCodeLength < MIN_STRING_LENGTH) {
+/* A match packed in a 32-bit table value, the master part index above the rule. MATCH_NONE packs to 0.
+* A master part has at least MIN_STRING_LENGTH chars and a newline, so with MAX_FILE_SIZE the index fits in 30 bits.
+*/
+#define MATCH_RULE_BITS 2
+#define MATCH_RULE_MASK ((size_t)((1 << MATCH_RULE_BITS) - 1))
+
+static inline size_t pack_match(size_t mpIndex, MatchRule rule) {
+    return rule == MATCH_NONE ? 0 : (mpIndex << MATCH_RULE_BITS) | (size_t)rule;
+}
+
+static inline size_t unpack_match(size_t packedMatch, MatchRule *outRule) {
+    *outRule = (MatchRule)(packedMatch & MATCH_RULE_MASK);
+    return *outRule == MATCH_NONE ? MAX_SIZE_T_VALUE : packedMatch >> MATCH_RULE_BITS;
+}
+
+// Rule 3, the longest master part that is a suffix of the part. The hashes are the suffix hashes of the code.
+static inline bool find_mp_index_by_suffixes(const HTable *mpTable, const BloomFilter *mpFilter, const char *code, size_t codeLength, const uint64_t *hashes, size_t *outMpIndex) {
+    for (size_t suffixLength = codeLength - 1; suffixLength >= MIN_STRING_LENGTH; suffixLength--) {
+        const char *suffix = code + (codeLength - suffixLength);
+        if (bloom_may_contain(mpFilter, hashes[suffixLength])
+            && htable_search_hashed(mpTable, suffix, suffixLength, hashes[suffixLength], outMpIndex)
+            && *outMpIndex != MP_INDEX_NONE) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Rule 1 and rule 2 in a single probe with the fused backend, the packed match is of the rule that takes precedence.
+static inline bool find_packed_match(const char *code, size_t codeLength, uint64_t hash, size_t *outPackedMatch) {
+    return bloom_may_contain(ctx.mp.mpMatchFilters[codeLength], hash)
+        && htable_search_hashed(ctx.mp.mpMatchTables[codeLength], code, codeLength, hash, outPackedMatch);
+}
+
+// Rule 3 with the fused backend. A master part is the rule 1 match of its own code, no shorter code ends with it.
+// So a suffix is a master part if its match is a rule 1 match with the same length. mpTableFilter is built for this backend too.
+static inline bool find_mp_index_by_match_tables(const char *code, size_t codeLength, const uint64_t *hashes, size_t *outMpIndex) {
+    const Records *masterParts = &ctx.data->masterPartsOriginal;
+    for (size_t suffixLength = codeLength - 1; suffixLength >= MIN_STRING_LENGTH; suffixLength--) {
+        size_t packedMatch;
+        if (bloom_may_contain(ctx.mp.mpTableFilter, hashes[suffixLength])
+            && find_packed_match(code + (codeLength - suffixLength), suffixLength, hashes[suffixLength], &packedMatch)) {
+            MatchRule rule;
+            size_t mpIndex = unpack_match(packedMatch, &rule);
+            if (rule == MATCH_RULE_1 && records_length(masterParts, mpIndex) == suffixLength) {
+                *outMpIndex = mpIndex;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static inline SuffixMemoShard *suffix_memo_shard(uint64_t hash) {
+    return &ctx.suffixMemo[hash % SUFFIX_MEMO_SHARDS];
+}
+
+static inline SuffixMemoSlot *suffix_memo_slot(SuffixMemoShard *shard, uint64_t hash) {
+    return &shard->slots[(hash / SUFFIX_MEMO_SHARDS) % SUFFIX_MEMO_SLOTS_PER_SHARD];
+}
+
+static bool suffix_memo_find(const char *code, size_t codeLength, uint64_t hash, size_t *outPackedMatch) {
+    SuffixMemoShard *shard = suffix_memo_shard(hash);
+    const SuffixMemoSlot *slot = suffix_memo_slot(shard, hash);
+
+    thread_mutex_lock(&shard->mutex);
+    bool found = slot->codeLength == codeLength && memcmp(slot->code, code, codeLength) == 0;
+    if (found) {
+        *outPackedMatch = slot->packedMatch;
+    }
+    thread_mutex_unlock(&shard->mutex);
+    return found;
+}
+
+static void suffix_memo_store(const char *code, size_t codeLength, uint64_t hash, size_t packedMatch) {
+    SuffixMemoShard *shard = suffix_memo_shard(hash);
+    SuffixMemoSlot *slot = suffix_memo_slot(shard, hash);
+
+    thread_mutex_lock(&shard->mutex);
+    memcpy(slot->code, code, codeLength);
+    slot->codeLength = (uint8_t)codeLength;
+    slot->packedMatch = (uint32_t)packedMatch;
+    thread_mutex_unlock(&shard->mutex);
+}
+
+// Rule 3 costs a walk of the whole code with the sorted backend, or up to one probe per suffix length with the tables.
+// So it's tried last and, when resolving on demand, memoized.
+static inline size_t resolve_suffixes(const char *code, size_t codeLength, uint64_t hash, MatchRule *outRule) {
+    size_t packedMatch;
+    if (ctx.suffixMemo && suffix_memo_find(code, codeLength, hash, &packedMatch)) {
+        return unpack_match(packedMatch, outRule);
+    }
+
+    size_t mpIndex;
+    bool found;
+    if (ctx.mp.mpSuffixTrie) {
+        found = suffix_trie_find_longest(ctx.mp.mpSuffixTrie, code, codeLength, &mpIndex);
+    }
+    else {
+        uint64_t hashes[MAX_STRING_LENGTH];
+        htable_hash_suffixes(code, codeLength, hashes);
+        found = ctx.backend == SUFFIX_BACKEND_FUSED
+            ? find_mp_index_by_match_tables(code, codeLength, hashes, &mpIndex)
+            : find_mp_index_by_suffixes(ctx.mp.mpTable, ctx.mp.mpTableFilter, code, codeLength, hashes, &mpIndex);
+    }
+    if (!found) {
+        mpIndex = MAX_SIZE_T_VALUE;
+    }
+    *outRule = mpIndex == MAX_SIZE_T_VALUE ? MATCH_NONE : MATCH_RULE_3;
+
+    if (ctx.suffixMemo) {
+        suffix_memo_store(code, codeLength, hash, pack_match(mpIndex, *outRule));
+    }
+    return mpIndex;
+}
+
+// Rule 1 and rule 2, the first master part that ends with the code. From the sorted index if there's one, otherwise from the suffix table of the code length.
+static inline bool find_mp_index_ending_with(const SuffixIndex *index, HTable *const *tables, BloomFilter *const *filters, const char *code, size_t codeLength, uint64_t hash, size_t *outMpIndex) {
+    if (index) {
+        return suffix_index_find(index, code, codeLength, outMpIndex);
+    }
+    // Most misses are rejected by the filters, without probing the tables.
+    return bloom_may_contain(filters[codeLength], hash)
+        && htable_search_hashed(tables[codeLength], code, codeLength, hash, outMpIndex)
+        && *outMpIndex != MP_INDEX_NONE;
+}
+
+// Tries the rules in order for an uppercased code. The hash is of the whole code.
+static inline size_t resolve_match(const char *code, size_t codeLength, uint64_t hash, MatchRule *outRule) {
+    // All three tables are keyed by the same string, so we hash it only once.
+    if (ctx.backend == SUFFIX_BACKEND_FUSED) {
+        size_t packedMatch;
+        if (find_packed_match(code, codeLength, hash, &packedMatch)) {
+            return unpack_match(packedMatch, outRule);
+        }
+        // The match tables have both rules 1 and 2, there's no suffix table or index for rule 2.
+        return resolve_suffixes(code, codeLength, hash, outRule);
+    }
+
+    size_t mpIndex;
+    if (find_mp_index_ending_with(ctx.mp.mpSuffixIndex, ctx.mp.mpSuffixesTables, ctx.mp.mpSuffixesFilters, code, codeLength, hash, &mpIndex)) {
+        *outRule = MATCH_RULE_1;
+        return mpIndex;
+    }
+    if (find_mp_index_ending_with(ctx.mp.mpNhSuffixIndex, ctx.mp.mpNhSuffixesTables, ctx.mp.mpNhSuffixesFilters, code, codeLength, hash, &mpIndex)) {
+        *outRule = MATCH_RULE_2;
+        return mpIndex;
+    }
+
+    return resolve_suffixes(code, codeLength, hash, outRule);
+}
+
+// The first misses of a lookup, the filters of the tables tried for rules 1 and 2.
+// The sorted backend does binary searches instead, they have no address to prefetch upfront.
+static inline void prefetch_filters(size_t codeLength, uint64_t hash) {
+    if (ctx.backend == SUFFIX_BACKEND_FUSED) {
+        bloom_prefetch(ctx.mp.mpMatchFilters[codeLength], hash);
+    }
+    else if (ctx.backend == SUFFIX_BACKEND_TABLES) {
+        bloom_prefetch(ctx.mp.mpSuffixesFilters[codeLength], hash);
+        bloom_prefetch(ctx.mp.mpNhSuffixesFilters[codeLength], hash);
+    }
+}
+
+// Once the filters are in, the first table that could hold the code. Rule 3 probes too many tables to prefetch them.
+static inline void prefetch_tables(size_t codeLength, uint64_t hash) {
+    if (ctx.backend == SUFFIX_BACKEND_FUSED) {
+        if (bloom_may_contain(ctx.mp.mpMatchFilters[codeLength], hash)) {
+            htable_prefetch(ctx.mp.mpMatchTables[codeLength], hash);
+        }
+    }
+    else if (ctx.backend == SUFFIX_BACKEND_TABLES) {
+        if (bloom_may_contain(ctx.mp.mpSuffixesFilters[codeLength], hash)) {
+            htable_prefetch(ctx.mp.mpSuffixesTables[codeLength], hash);
+        }
+        else if (bloom_may_contain(ctx.mp.mpNhSuffixesFilters[codeLength], hash)) {
+            htable_prefetch(ctx.mp.mpNhSuffixesTables[codeLength], hash);
+        }
+    }
+}
+
+// The loaded files never have longer codes, but the server gets arbitrary input.
+static inline bool is_matchable_length(size_t codeLength) {
+    return codeLength >= MIN_STRING_LENGTH && codeLength < MAX_STRING_LENGTH;
+}
+
+// Looks up an uppercased code. The hash is of the whole code.
+static inline size_t find_mp_index_hashed(const char *code, size_t codeLength, uint64_t hash, MatchRule *outRule) {
+    // The loaded parts are already resolved, any other code is resolved now.
+    size_t packedMatch;
+    if (!ctx.resolveSuffixesOnDemand && htable_search_hashed(ctx.partTables[codeLength], code, codeLength, hash, &packedMatch)) {
+        return unpack_match(packedMatch, outRule);
+    }
+    return resolve_match(code, codeLength, hash, outRule);
+}
+
+static inline size_t find_mp_index(const char *partCode, size_t partCodeLength, MatchRule *outRule) {
+    *outRule = MATCH_NONE;
+    if (!is_matchable_length(partCodeLength)) {
         return MAX_SIZE_T_VALUE;
     }
     char buffer[MAX_STRING_LENGTH];
     str_to_upper(partCode, partCodeLength, buffer);
+    return find_mp_index_hashed(buffer, partCodeLength, htable_hash(buffer, partCodeLength), outRule);
+}
 
-    size_t mpIndex;
-    if (htable_search(ctx.mpSuffixesTables[partCodeLength], buffer, partCodeLength, &mpIndex)) return mpIndex;
-    if (htable_search(ctx.mpNhSuffixesTables[partCodeLength], buffer, partCodeLength, &mpIndex)) return mpIndex;
-    if (htable_search(ctx.partTables[partCodeLength], buffer, partCodeLength, &mpIndex)) return mpIndex;
+size_t processor_find_mp_index(const char *partCode, size_t partCodeLength) {
+    MatchRule rule;
+    return find_mp_index(partCode, partCodeLength, &rule);
+}
+
+static inline size_t write_result_line(const SourceData *data, const char *partCode, size_t partCodeLength, size_t mpIndex, char *output) {
+    size_t outputIndex = 0;
+    memcpy(output, partCode, partCodeLength);
+    outputIndex += partCodeLength;
+    output[outputIndex++] = CHAR_SEMICOLON;
+
+    if (mpIndex != MAX_SIZE_T_VALUE) {
+        size_t mpLength = records_length(&data->masterPartsOriginal, mpIndex);
+        memcpy(output + outputIndex, records_code(&data->masterPartsOriginal, mpIndex), mpLength);
+        outputIndex += mpLength;
+    }
+
+    output[outputIndex++] = '\n';
+    return outputIndex;
+}
+
+size_t processor_write_match(const SourceData *data, const char *partCode, size_t partCodeLength, char *output, MatchRule *outRule) {
+    size_t mpIndex = find_mp_index(partCode, partCodeLength, outRule);
+    return write_result_line(data, partCode, partCodeLength, mpIndex, output);
+}
+
+size_t processor_write_matches(const SourceData *data, const char *const *codes, const size_t *codeLengths, size_t count, char *output, MatchRule *outRules) {
+    char buffers[LOOKUP_GROUP_SIZE][MAX_STRING_LENGTH];
+    uint64_t hashes[LOOKUP_GROUP_SIZE];
+    size_t outputLength = 0;
+
+    for (size_t groupStart = 0; groupStart < count; groupStart += LOOKUP_GROUP_SIZE) {
+        size_t groupCount = count - groupStart < LOOKUP_GROUP_SIZE ? count - groupStart : LOOKUP_GROUP_SIZE;
+        const char *const *groupCodes = codes + groupStart;
+        const size_t *groupLengths = codeLengths + groupStart;
+
+        for (size_t i = 0; i < groupCount; i++) {
+            if (is_matchable_length(groupLengths[i])) {
+                str_to_upper(groupCodes[i], groupLengths[i], buffers[i]);
+                hashes[i] = htable_hash(buffers[i], groupLengths[i]);
+                if (!ctx.resolveSuffixesOnDemand) {
+                    htable_prefetch(ctx.partTables[groupLengths[i]], hashes[i]);
+                }
+                prefetch_filters(groupLengths[i], hashes[i]);
+            }
+        }
+        for (size_t i = 0; i < groupCount; i++) {
+            if (is_matchable_length(groupLengths[i])) {
+                prefetch_tables(groupLengths[i], hashes[i]);
+            }
+        }
+        for (size_t i = 0; i < groupCount; i++) {
+            MatchRule *rule = &outRules[groupStart + i];
+            size_t mpIndex = MAX_SIZE_T_VALUE;
+            *rule = MATCH_NONE;
+            if (is_matchable_length(groupLengths[i])) {
+                mpIndex = find_mp_index_hashed(buffers[i], groupLengths[i], hashes[i], rule);
+            }
+            outputLength += write_result_line(data, groupCodes[i], groupLengths[i], mpIndex, output + outputLength);
+        }
+    }
+    return outputLength;
+}
+
+// The length of an over-long part didn't fit the records, so its line is read again from the mapped file. See RECORD_LENGTH_OVERLONG.
+static inline size_t part_length(const SourceData *data, size_t partIndex) {
+    size_t length = records_length(&data->partsOriginal, partIndex);
+    if (length == RECORD_LENGTH_OVERLONG) {
+        const MappedFile *file = &data->stringBlock.partsFile;
+        const char *record;
+        str_read_line(records_code(&data->partsOriginal, partIndex), file->data + file->size, &record, &length);
+    }
+    return length;
+}
+
+size_t processor_write_part_match(const SourceData *data, size_t partIndex, char *output, MatchRule *outRule) {
+    size_t mpIndex = unpack_match(ctx.partMatches[partIndex], outRule);
+    return write_result_line(data, records_code(&data->partsOriginal, partIndex), part_length(data, partIndex), mpIndex, output);
+}
+
+void processor_initialize(const SourceData *data, SuffixBackend backend) {
+    ctx.data = (SourceData *)data;
+    ctx.resolveSuffixesOnDemand = data->partsAsc.count == 0;
+    ctx.backend = backend;
+    suffix_memo_init();
+
+    ThreadArgs mpTableArgs = { .ctx = &ctx };
+    ThreadArgs mpArgs[MAX_STRING_LENGTH] = { 0 };
+    ThreadArgs mpNhArgs[MAX_STRING_LENGTH] = { 0 };
+    ThreadArgs partsArgs[MAX_STRING_LENGTH] = { 0 };
+
+    // The sorted indexes need no suffix hashes and no mpTable, the trie is built from the order of the plain index.
+    if (backend == SUFFIX_BACKEND_SORTED) {
+        TaskGroup group = { 0 };
+        thread_pool_submit(&group, create_suffix_index_for_masterParts, &mpTableArgs);
+        thread_pool_submit(&group, create_suffix_index_for_masterPartsNh, &mpTableArgs);
+        thread_pool_wait(&group);
+        resolve_parts(&group, partsArgs);
+        return;
+    }
+
+    // Each table only waits for the suffix hashes it consumes.
+    TaskGroup mpHashesGroup = { 0 };
+    TaskGroup mpNhHashesGroup = { 0 };
+    TaskGroup mpTableGroup = { 0 };
+    TaskGroup tablesGroup = { 0 };
+
+    // The suffix hashes are needed only while the tables are being built.
+    Arena *hashesArena = arena_create();
+    submit_suffix_hashes_tasks(&mpHashesGroup, hashesArena, &ctx.data->masterPartsAsc, ctx.data->masterPartsAscStartIndexByLength, &ctx.mpSuffixHashes);
+    submit_suffix_hashes_tasks(&mpNhHashesGroup, hashesArena, &ctx.data->masterPartsNhAsc, ctx.data->masterPartsNhAscStartIndexByLength, &ctx.mpNhSuffixHashes);
+
+    // The fused tables take the suffixes with and without hyphens of the same length together.
+    if (backend == SUFFIX_BACKEND_FUSED) {
+        thread_pool_wait(&mpHashesGroup);
+        thread_pool_submit(&mpTableGroup, create_table_filter_for_masterParts, &mpTableArgs);
+        thread_pool_wait(&mpNhHashesGroup);
+        submit_tables_tasks(&tablesGroup, ctx.mpSuffixHashes.startIndexByLength, create_match_tables_for_masterParts, mpArgs);
+    }
+    else {
+        thread_pool_wait(&mpHashesGroup);
+        thread_pool_submit(&mpTableGroup, create_table_for_masterParts, &mpTableArgs);
+        submit_tables_tasks(&tablesGroup, ctx.mpSuffixHashes.startIndexByLength, create_suffix_tables_for_masterParts, mpArgs);
+
+        thread_pool_wait(&mpNhHashesGroup);
+        submit_tables_tasks(&tablesGroup, ctx.mpNhSuffixHashes.startIndexByLength, create_suffix_tables_for_masterPartsNh, mpNhArgs);
+    }
+
+    thread_pool_wait(&mpTableGroup);
+    thread_pool_wait(&tablesGroup);
+    arena_destroy(hashesArena);
+    ctx.mpSuffixHashes = (SuffixHashes){ 0 };
+    ctx.mpNhSuffixHashes = (SuffixHashes){ 0 };
 
-    return MAX_SIZE_T_VALUE;
+    // The parts are resolved against all the master parts tables, so they go last.
+    resolve_parts(&tablesGroup, partsArgs);
 }
 
-void processor_initialize(const SourceData *data) {
+void processor_initialize_with_tables(const SourceData *data, const MasterPartsTables *tables) {
     ctx.data = (SourceData *)data;
-    create_tables_in_parallel(&ctx, ctx.data->masterPartsAsc, ctx.data->masterPartsAscCount, create_suffix_tables_for_masterParts, true);
-    create_tables_in_parallel(&ctx, ctx.data->masterPartsNhAsc, ctx.data->masterPartsNhAscCount, create_suffix_tables_for_masterPartsNh, false);
-    create_tables_in_parallel(&ctx, ctx.data->partsAsc, ctx.data->partsAscCount, create_tables_for_parts, false);
+    ctx.mp = *tables;
+    ctx.resolveSuffixesOnDemand = data->partsAsc.count == 0;
+    ctx.backend = SUFFIX_BACKEND_TABLES;
+    suffix_memo_init();
+
+    ThreadArgs partsArgs[MAX_STRING_LENGTH] = { 0 };
+    TaskGroup tablesGroup = { 0 };
+    resolve_parts(&tablesGroup, partsArgs);
+}
+
+const MasterPartsTables *processor_master_parts_tables() {
+    return &ctx.mp;
+}
+
+HTable *const *processor_parts_tables() {
+    return ctx.partTables;
 }
 
 void processor_clean() {
     for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
-        htable_free(ctx.mpSuffixesTables[length]);
-        htable_free(ctx.mpNhSuffixesTables[length]);
+        htable_free(ctx.mp.mpSuffixesTables[length]);
+        htable_free(ctx.mp.mpNhSuffixesTables[length]);
+        bloom_free(ctx.mp.mpSuffixesFilters[length]);
+        bloom_free(ctx.mp.mpNhSuffixesFilters[length]);
+        htable_free(ctx.mp.mpMatchTables[length]);
+        bloom_free(ctx.mp.mpMatchFilters[length]);
         htable_free(ctx.partTables[length]);
     }
-    htable_free(ctx.mpTable);
+    suffix_index_free(ctx.mp.mpSuffixIndex);
+    suffix_index_free(ctx.mp.mpNhSuffixIndex);
+    suffix_trie_free(ctx.mp.mpSuffixTrie);
+    htable_free(ctx.mp.mpTable);
+    bloom_free(ctx.mp.mpTableFilter);
+    if (ctx.suffixMemo) {
+        for (size_t i = 0; i < SUFFIX_MEMO_SHARDS; i++) {
+            thread_mutex_destroy(&ctx.suffixMemo[i].mutex);
+        }
+    }
+}
+
+static thread_ret_t create_suffix_hashes(thread_arg_t arg) {
+    HashChunkArgs *args = (HashChunkArgs *)arg;
+    PhaseTimer timer = stats_phase_begin();
+    const Records *records = args->records;
+    SuffixHashes *suffixHashes = args->suffixHashes;
+
+    uint64_t hashes[MAX_STRING_LENGTH];
+    for (size_t i = args->startIndex; i < args->endIndex; i++) {
+        size_t codeLength = records_length(records, i);
+        htable_hash_suffixes(records_code(records, i), codeLength, hashes);
+        for (size_t length = MIN_STRING_LENGTH; length <= codeLength; length++) {
+            suffixHashes->hashes[length][i - suffixHashes->startIndexByLength[length]] = hashes[length];
+        }
+    }
+    stats_phase_end(STATS_PHASE_SUFFIX_HASHES, timer);
+    return 0;
 }
 
 static thread_ret_t create_suffix_tables_for_masterParts(thread_arg_t arg) {
     ThreadArgs *args = (ThreadArgs *)arg;
+    PhaseTimer timer = stats_phase_begin();
     size_t startIndex = args->startIndex;
     size_t length = args->length;
-    const Part *masterPartsAsc = args->ctx->data->masterPartsAsc;
-    size_t masterPartsAscCount = args->ctx->data->masterPartsAscCount;
+    const Records *masterPartsAsc = &args->ctx->data->masterPartsAsc;
+    size_t masterPartsAscCount = masterPartsAsc->count;
+    const uint64_t *hashes = args->ctx->mpSuffixHashes.hashes[length];
 
-    HTable *table = htable_create(masterPartsAscCount - startIndex);
+    HTable *table = htable_create(masterPartsAscCount - startIndex, args->ctx->data->stringBlock.blockMasterParts, length);
+    BloomFilter *filter = bloom_create(masterPartsAscCount - startIndex);
     for (size_t i = startIndex; i < masterPartsAscCount; i++) {
-        Part mp = masterPartsAsc[i];
-        const char *suffix = mp.code + (mp.codeLength - length);
-        htable_insert_if_not_exists(table, suffix, length, mp.index);
+        const char *suffix = records_code(masterPartsAsc, i) + (records_length(masterPartsAsc, i) - length);
+        htable_insert_if_not_exists_hashed(table, suffix, length, hashes[i - startIndex], records_index(masterPartsAsc, i));
     }
-    args->ctx->mpSuffixesTables[length] = table;
+    // Filled in a separate pass, the probes of the inserts would stall the adds.
+    bloom_add_hashes(filter, hashes, masterPartsAscCount - startIndex);
+    args->ctx->mp.mpSuffixesTables[length] = table;
+    args->ctx->mp.mpSuffixesFilters[length] = filter;
+    stats_phase_end(STATS_PHASE_MP_SUFFIX_TABLES, timer);
     return 0;
 }
 
 static thread_ret_t create_suffix_tables_for_masterPartsNh(thread_arg_t arg) {
     ThreadArgs *args = (ThreadArgs *)arg;
+    PhaseTimer timer = stats_phase_begin();
     size_t startIndex = args->startIndex;
     size_t length = args->length;
-    const Part *masterPartsNhAsc = args->ctx->data->masterPartsNhAsc;
-    size_t masterPartsNhAscCount = args->ctx->data->masterPartsNhAscCount;
+    const Records *masterPartsNhAsc = &args->ctx->data->masterPartsNhAsc;
+    size_t masterPartsNhAscCount = masterPartsNhAsc->count;
+    const uint64_t *hashes = args->ctx->mpNhSuffixHashes.hashes[length];
 
-    HTable *table = htable_create(masterPartsNhAscCount - startIndex);
+    HTable *table = htable_create(masterPartsNhAscCount - startIndex, args->ctx->data->stringBlock.blockMasterParts, length);
+    BloomFilter *filter = bloom_create(masterPartsNhAscCount - startIndex);
     for (size_t i = startIndex; i < masterPartsNhAscCount; i++) {
-        Part mpNh = masterPartsNhAsc[i];
-        const char *suffix = mpNh.code + (mpNh.codeLength - length);
-        htable_insert_if_not_exists(table, suffix, length, mpNh.index);
+        const char *suffix = records_code(masterPartsNhAsc, i) + (records_length(masterPartsNhAsc, i) - length);
+        htable_insert_if_not_exists_hashed(table, suffix, length, hashes[i - startIndex], records_index(masterPartsNhAsc, i));
     }
-    args->ctx->mpNhSuffixesTables[length] = table;
+    bloom_add_hashes(filter, hashes, masterPartsNhAscCount - startIndex);
+    args->ctx->mp.mpNhSuffixesTables[length] = table;
+    args->ctx->mp.mpNhSuffixesFilters[length] = filter;
+    stats_phase_end(STATS_PHASE_MP_NH_SUFFIX_TABLES, timer);
+    return 0;
+}
+
+// The rule 1 matches are inserted first, so they take precedence over the rule 2 matches of the same key.
+// The codes without hyphens are never longer than their master parts, so the tasks by the lengths of the master parts cover them.
+static thread_ret_t create_match_tables_for_masterParts(thread_arg_t arg) {
+    ThreadArgs *args = (ThreadArgs *)arg;
+    PhaseTimer timer = stats_phase_begin();
+    size_t startIndex = args->startIndex;
+    size_t length = args->length;
+    const SourceData *data = args->ctx->data;
+    const Records *masterPartsAsc = &data->masterPartsAsc;
+    const Records *masterPartsNhAsc = &data->masterPartsNhAsc;
+    size_t count = masterPartsAsc->count - startIndex;
+    size_t nhStartIndex = data->masterPartsNhAscStartIndexByLength[length];
+    size_t nhCount = masterPartsNhAsc->count - nhStartIndex;
+    const uint64_t *hashes = args->ctx->mpSuffixHashes.hashes[length];
+    const uint64_t *nhHashes = args->ctx->mpNhSuffixHashes.hashes[length];
+
+    HTable *table = htable_create(count + nhCount, data->stringBlock.blockMasterParts, length);
+    BloomFilter *filter = bloom_create(count + nhCount);
+    for (size_t i = 0; i < count; i++) {
+        size_t index = startIndex + i;
+        const char *suffix = records_code(masterPartsAsc, index) + (records_length(masterPartsAsc, index) - length);
+        htable_insert_if_not_exists_hashed(table, suffix, length, hashes[i], pack_match(records_index(masterPartsAsc, index), MATCH_RULE_1));
+    }
+    for (size_t i = 0; i < nhCount; i++) {
+        size_t index = nhStartIndex + i;
+        const char *suffix = records_code(masterPartsNhAsc, index) + (records_length(masterPartsNhAsc, index) - length);
+        htable_insert_if_not_exists_hashed(table, suffix, length, nhHashes[i], pack_match(records_index(masterPartsNhAsc, index), MATCH_RULE_2));
+    }
+    bloom_add_hashes(filter, hashes, count);
+    if (nhCount > 0) {
+        bloom_add_hashes(filter, nhHashes, nhCount);
+    }
+    args->ctx->mp.mpMatchTables[length] = table;
+    args->ctx->mp.mpMatchFilters[length] = filter;
+    stats_phase_end(STATS_PHASE_MP_MATCH_TABLES, timer);
+    return 0;
+}
+
+// The full-length hashes of the records with each length are contiguous.
+static void add_code_hashes(BloomFilter *filter, const SuffixHashes *suffixHashes) {
+    for (size_t length = MIN_STRING_LENGTH; length < MAX_STRING_LENGTH; length++) {
+        size_t startIndex = suffixHashes->startIndexByLength[length];
+        size_t endIndex = suffixHashes->startIndexByLength[length + 1];
+        if (endIndex > startIndex) {
+            bloom_add_hashes(filter, suffixHashes->hashes[length], endIndex - startIndex);
+        }
+    }
+}
+
+// With the fused backend, the filter of mpTable is built without the table. The probes of rule 3 are mostly suffixes of some
+// master part, but seldom a whole one. The fused tables would let them through their filters, this one rejects them.
+static thread_ret_t create_table_filter_for_masterParts(thread_arg_t arg) {
+    ThreadArgs *args = (ThreadArgs *)arg;
+    PhaseTimer timer = stats_phase_begin();
+    BloomFilter *filter = bloom_create(args->ctx->data->masterPartsAsc.count);
+    add_code_hashes(filter, &args->ctx->mpSuffixHashes);
+    args->ctx->mp.mpTableFilter = filter;
+    stats_phase_end(STATS_PHASE_MP_TABLE, timer);
     return 0;
 }
 
 static thread_ret_t create_table_for_masterParts(thread_arg_t arg) {
     ThreadArgs *args = (ThreadArgs *)arg;
-    const Part *masterPartsAsc = args->ctx->data->masterPartsAsc;
-    size_t masterPartsAscCount = args->ctx->data->masterPartsAscCount;
+    PhaseTimer timer = stats_phase_begin();
+    const Records *masterPartsAsc = &args->ctx->data->masterPartsAsc;
+    size_t masterPartsAscCount = masterPartsAsc->count;
+    const SuffixHashes *suffixHashes = &args->ctx->mpSuffixHashes;
+    bool hashed = suffixHashes->startIndexByLength != NULL;
 
-    HTable *table = htable_create(masterPartsAscCount);
+    HTable *table = htable_create(masterPartsAscCount, args->ctx->data->stringBlock.blockMasterParts, HTABLE_MIXED_KEY_LENGTH);
+    BloomFilter *filter = bloom_create(masterPartsAscCount);
     for (size_t i = 0; i < masterPartsAscCount; i++) {
-        Part mp = masterPartsAsc[i];
-        htable_insert_if_not_exists(table, mp.code, mp.codeLength, mp.index);
+        size_t codeLength = records_length(masterPartsAsc, i);
+        // The whole code is the suffix with the full length. The sorted backend computes no suffix hashes.
+        uint64_t hash = hashed
+            ? suffixHashes->hashes[codeLength][i - suffixHashes->startIndexByLength[codeLength]]
+            : htable_hash(records_code(masterPartsAsc, i), codeLength);
+        htable_insert_if_not_exists_hashed(table, records_code(masterPartsAsc, i), codeLength, hash, records_index(masterPartsAsc, i));
+        if (!hashed) {
+            bloom_add(filter, hash);
+        }
+    }
+    if (hashed) {
+        add_code_hashes(filter, suffixHashes);
     }
-    args->ctx->mpTable = table;
+    args->ctx->mp.mpTable = table;
+    args->ctx->mp.mpTableFilter = filter;
+    stats_phase_end(STATS_PHASE_MP_TABLE, timer);
+    return 0;
+}
+
+// The records shorter than the minimum are sorted first, they're left out.
+static SuffixIndex *create_suffix_index(const Records *records, const size_t *startIndexByLength) {
+    size_t startIndex = startIndexByLength[MIN_STRING_LENGTH];
+    Records indexed = {
+        .base = records->base,
+        .offsets = records->offsets + startIndex,
+        .lengths = records->lengths + startIndex,
+        .indices = records->indices + startIndex,
+        .count = records->count - startIndex,
+    };
+    return suffix_index_create(&indexed);
+}
+
+// The trie of rule 3 is built from the order of the index.
+static thread_ret_t create_suffix_index_for_masterParts(thread_arg_t arg) {
+    ThreadArgs *args = (ThreadArgs *)arg;
+    PhaseTimer timer = stats_phase_begin();
+    const SourceData *data = args->ctx->data;
+    SuffixIndex *index = create_suffix_index(&data->masterPartsAsc, data->masterPartsAscStartIndexByLength);
+    args->ctx->mp.mpSuffixIndex = index;
+    stats_phase_end(STATS_PHASE_MP_SUFFIX_INDEXES, timer);
+
+    timer = stats_phase_begin();
+    args->ctx->mp.mpSuffixTrie = suffix_trie_create(&index->records, index->order);
+    stats_phase_end(STATS_PHASE_MP_SUFFIX_TRIE, timer);
+    return 0;
+}
+
+static thread_ret_t create_suffix_index_for_masterPartsNh(thread_arg_t arg) {
+    ThreadArgs *args = (ThreadArgs *)arg;
+    PhaseTimer timer = stats_phase_begin();
+    const SourceData *data = args->ctx->data;
+    args->ctx->mp.mpNhSuffixIndex = create_suffix_index(&data->masterPartsNhAsc, data->masterPartsNhAscStartIndexByLength);
+    stats_phase_end(STATS_PHASE_MP_SUFFIX_INDEXES, timer);
     return 0;
 }
 
 static thread_ret_t create_tables_for_parts(thread_arg_t arg) {
     ThreadArgs *args = (ThreadArgs *)arg;
+    PhaseTimer timer = stats_phase_begin();
     size_t startIndex = args->startIndex;
     size_t length = args->length;
-    HTable *mpTable = args->ctx->mpTable;
-    const Part *partsAsc = args->ctx->data->partsAsc;
-    size_t partsAscCount = args->ctx->data->partsAscCount;
-
-    HTable *table = htable_create(partsAscCount - startIndex);
-    for (size_t i = startIndex; i < partsAscCount; i++) {
-        Part part = partsAsc[i];
-        if (part.codeLength > length) break;
-
-        for (size_t suffixLength = part.codeLength - 1; suffixLength >= MIN_STRING_LENGTH; suffixLength--) {
-            const char *suffix = part.code + (part.codeLength - suffixLength);
-            size_t mpIndex;
-            if (htable_search(mpTable, suffix, suffixLength, &mpIndex)) {
-                htable_insert_if_not_exists(table, part.code, part.codeLength, mpIndex);
-                break;
+    const Records *partsAsc = &args->ctx->data->partsAsc;
+    size_t endIndex = args->ctx->data->partsAscStartIndexByLength[length + 1];
+
+    uint32_t *partMatches = args->ctx->partMatches;
+
+    // The same code shows up many times in the parts, it's resolved only at its first occurrence.
+    // All the records in this range have the same length.
+    // The codes are resolved in groups, prefetched like the batched lookups, see LOOKUP_GROUP_SIZE.
+    HTable *table = htable_create(endIndex - startIndex, args->ctx->data->stringBlock.blockParts, length);
+    uint64_t hashes[LOOKUP_GROUP_SIZE];
+    for (size_t groupStart = startIndex; groupStart < endIndex; groupStart += LOOKUP_GROUP_SIZE) {
+        size_t groupEnd = endIndex - groupStart < LOOKUP_GROUP_SIZE ? endIndex : groupStart + LOOKUP_GROUP_SIZE;
+        for (size_t i = groupStart; i < groupEnd; i++) {
+            hashes[i - groupStart] = htable_hash(records_code(partsAsc, i), length);
+            htable_prefetch(table, hashes[i - groupStart]);
+            prefetch_filters(length, hashes[i - groupStart]);
+        }
+        for (size_t i = groupStart; i < groupEnd; i++) {
+            prefetch_tables(length, hashes[i - groupStart]);
+        }
+
+        for (size_t i = groupStart; i < groupEnd; i++) {
+            const char *code = records_code(partsAsc, i);
+            uint64_t hash = hashes[i - groupStart];
+            size_t packedMatch;
+            if (!htable_search_hashed(table, code, length, hash, &packedMatch)) {
+                MatchRule rule;
+                size_t mpIndex = resolve_match(code, length, hash, &rule);
+                packedMatch = pack_match(mpIndex, rule);
+                htable_insert_if_not_exists_hashed(table, code, length, hash, packedMatch);
             }
+            partMatches[records_index(partsAsc, i)] = (uint32_t)packedMatch;
         }
     }
     args->ctx->partTables[length] = table;
+    stats_phase_end(STATS_PHASE_PARTS_TABLES, timer);
     return 0;
 }
 
-static inline void backward_fill(size_t *array) {
-    size_t tmp = array[MAX_STRING_LENGTH - 1];
-    for (long length = (long)MAX_STRING_LENGTH - 1; length >= 0; length--) {
-        if (array[length] == MAX_SIZE_T_VALUE) {
-            array[length] = tmp;
-        }
-        else {
-            tmp = array[length];
+// Allocates the hash arrays and submits the tasks that fill them, it doesn't wait for them.
+static void submit_suffix_hashes_tasks(TaskGroup *group, Arena *arena, const Records *records, const size_t *startIndexByLength, SuffixHashes *suffixHashes) {
+    size_t count = records->count;
+    suffixHashes->startIndexByLength = startIndexByLength;
+    for (size_t length = MIN_STRING_LENGTH; length < MAX_STRING_LENGTH; length++) {
+        size_t startIndex = startIndexByLength[length];
+        if (startIndex < count) {
+            suffixHashes->hashes[length] = arena_alloc(arena, (count - startIndex) * sizeof(*suffixHashes->hashes[length]));
+            CHECK_ALLOC(suffixHashes->hashes[length]);
         }
     }
-}
 
-static void create_tables_in_parallel(Context *ctx, const Part *parts, size_t count, thread_func_t func, bool create_mp_table) {
-    size_t startIndexByLength[MAX_STRING_LENGTH] = { 0 };
-    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
-        startIndexByLength[length] = MAX_SIZE_T_VALUE;
+    size_t chunkCount = thread_pool_concurrency();
+    if (chunkCount > count / MIN_RECORDS_PER_HASH_CHUNK) {
+        chunkCount = count / MIN_RECORDS_PER_HASH_CHUNK;
     }
-    for (size_t i = 0; i < count; i++) {
-        size_t length = parts[i].codeLength;
-        if (startIndexByLength[length] == MAX_SIZE_T_VALUE) {
-            startIndexByLength[length] = i;
-        }
+    if (chunkCount == 0) {
+        chunkCount = 1;
     }
-    backward_fill(startIndexByLength);
+    size_t recordsPerChunk = count / chunkCount;
 
-    thread_t threads[MAX_STRING_LENGTH] = { 0 };
-    ThreadArgs threadArgs[MAX_STRING_LENGTH] = { 0 };
+    HashChunkArgs *chunks = arena_alloc(arena, chunkCount * sizeof(*chunks));
+    CHECK_ALLOC(chunks);
+    for (size_t i = 0; i < chunkCount; i++) {
+        chunks[i].records = records;
+        chunks[i].startIndex = i * recordsPerChunk;
+        chunks[i].endIndex = i == chunkCount - 1 ? count : (i + 1) * recordsPerChunk;
+        chunks[i].suffixHashes = suffixHashes;
+        thread_pool_submit(group, create_suffix_hashes, &chunks[i]);
+    }
+}
 
-    // We will sneak in and use one thread to create the table for master parts.
-    if (create_mp_table) {
-        int status = create_thread(&threads[0], create_table_for_masterParts, &(ThreadArgs) {.ctx = ctx});
-        CHECK_THREAD_CREATE_STATUS(status, (size_t)0);
+// Resolves the loaded parts, one task per length. The master parts tables must be complete.
+static void resolve_parts(TaskGroup *group, ThreadArgs *threadArgs) {
+    const Records *partsAsc = &ctx.data->partsAsc;
+    if (partsAsc->count == 0) {
+        return;
     }
+    ctx.partMatches = allocator_alloc(partsAsc->count * sizeof(*ctx.partMatches));
+    CHECK_ALLOC(ctx.partMatches);
 
-    for (size_t length = MIN_STRING_LENGTH; length < MAX_STRING_LENGTH; length++) {
-        if (startIndexByLength[length] != MAX_SIZE_T_VALUE) {
-            threadArgs[length].ctx = ctx;
-            threadArgs[length].length = length;
-            threadArgs[length].startIndex = startIndexByLength[length];
-            int status = create_thread(&threads[length], func, &threadArgs[length]);
-            CHECK_THREAD_CREATE_STATUS(status, length);
-        }
+    // The codes shorter than the minimum are never matched, they're sorted first.
+    for (size_t i = 0; i < ctx.data->partsAscStartIndexByLength[MIN_STRING_LENGTH]; i++) {
+        ctx.partMatches[records_index(partsAsc, i)] = (uint32_t)pack_match(0, MATCH_NONE);
     }
+    submit_tables_tasks(group, ctx.data->partsAscStartIndexByLength, create_tables_for_parts, threadArgs);
+    thread_pool_wait(group);
+}
 
-    for (size_t length = MIN_STRING_LENGTH; length < MAX_STRING_LENGTH; length++) {
-        if (threads[length]) {
-            int status = join_thread(threads[length], NULL);
-            CHECK_THREAD_JOIN_STATUS(status, length);
-        }
+static void suffix_memo_init() {
+    if (!ctx.resolveSuffixesOnDemand) {
+        return;
+    }
+    ctx.suffixMemo = allocator_alloc(SUFFIX_MEMO_SHARDS * sizeof(*ctx.suffixMemo));
+    CHECK_ALLOC(ctx.suffixMemo);
+    memset(ctx.suffixMemo, 0, SUFFIX_MEMO_SHARDS * sizeof(*ctx.suffixMemo));
+    for (size_t i = 0; i < SUFFIX_MEMO_SHARDS; i++) {
+        thread_mutex_init(&ctx.suffixMemo[i].mutex);
     }
+}
 
-    if (create_mp_table) {
-        int status = join_thread(threads[0], NULL);
-        CHECK_THREAD_JOIN_STATUS(status, (size_t)0);
+// Submits one task per length into the pool, it doesn't wait for them.
+// The threadArgs array must outlive the tasks, so it's owned by the caller.
+static void submit_tables_tasks(TaskGroup *group, const size_t *startIndexByLength, thread_func_t func, ThreadArgs *threadArgs) {
+    size_t count = startIndexByLength[MAX_STRING_LENGTH];
+
+    // Shorter lengths have the most records to process, so they're queued first.
+    for (size_t length = MIN_STRING_LENGTH; length < MAX_STRING_LENGTH; length++) {
+        if (startIndexByLength[length] < count) {
+            threadArgs[length].ctx = &ctx;
+            threadArgs[length].length = length;
+            threadArgs[length].startIndex = startIndexByLength[length];
+            thread_pool_submit(group, func, &threadArgs[length]);
+        }
     }
 }
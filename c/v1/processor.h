@@ -1,10 +1,89 @@
 #ifndef PROCESSOR_H
 #define PROCESSOR_H
 
+#include "hash_table.h"
+#include "bloom_filter.h"
+#include "suffix_index.h"
+#include "suffix_trie.h"
 #include "source_data.h"
 
+#define MP_KEY_BYTES_WORDS ((size_t)(UINT8_MAX + 1) / 64)
+
+// The tables built from the master parts only. They can be persisted and reloaded, see index_file.h.
+// Each table has a filter over its keys, checked before probing it. Most lookups miss, and the filters reject them cheaply.
+typedef struct MasterPartsTables {
+    HTable *mpTable;
+    HTable *mpSuffixesTables[MAX_STRING_LENGTH];
+    HTable *mpNhSuffixesTables[MAX_STRING_LENGTH];
+    BloomFilter *mpTableFilter;
+    BloomFilter *mpSuffixesFilters[MAX_STRING_LENGTH];
+    BloomFilter *mpNhSuffixesFilters[MAX_STRING_LENGTH];
+
+    // For each master part with hyphens, the next one in file order with the same code without hyphens, or MP_INDEX_NONE.
+    // Only the delta updates need it, so it's NULL unless the tables were loaded from an index. See delta_update.h.
+    uint32_t *mpNhNext;
+
+    // The bytes that occur in the keys, one bit per byte value. Set along with mpNhNext.
+    // A removal looks for the next master part among the keys one byte longer, it only tries these bytes.
+    uint64_t mpKeyBytes[MP_KEY_BYTES_WORDS];
+
+    // Set instead of the suffix tables and their filters with SUFFIX_BACKEND_SORTED. They're never persisted.
+    SuffixIndex *mpSuffixIndex;
+    SuffixIndex *mpNhSuffixIndex;
+
+    // Rule 3 walks it instead of probing mpTable once per suffix length, mpTable is not built then.
+    // The tables backend hashes the suffixes of the parts for rules 1 and 2 anyway, the probes cost little there.
+    SuffixTrie *mpSuffixTrie;
+
+    // Set instead of all the tables above but mpTableFilter with SUFFIX_BACKEND_FUSED, and never persisted either.
+    // Every suffix of the master parts and of their codes without hyphens, with its packed rule 1 or rule 2 match, by length.
+    HTable *mpMatchTables[MAX_STRING_LENGTH];
+    BloomFilter *mpMatchFilters[MAX_STRING_LENGTH];
+} MasterPartsTables;
+
+// The table value of a key whose master parts were all removed by delta updates. The lookups treat it as a miss.
+#define MP_INDEX_NONE ((size_t)UINT32_MAX)
+
+// The rule that produced a match, in the order they're tried.
+typedef enum MatchRule {
+    MATCH_NONE,
+    MATCH_RULE_1,                       // The part is a suffix of a master part
+    MATCH_RULE_2,                       // The part is a suffix of a master part without hyphens
+    MATCH_RULE_3,                       // A master part is a suffix of the part
+    MATCH_RULE_COUNT,
+} MatchRule;
+
+// How the master parts that end with a part are found for rule 1 and rule 2.
+// Rule 3 uses mpTable, the trie with the sorted backend, or the fused tables with the fused backend.
+typedef enum SuffixBackend {
+    SUFFIX_BACKEND_TABLES,              // A table per suffix length, a single probe per lookup
+    SUFFIX_BACKEND_SORTED,              // The reversed codes sorted, see suffix_index.h. The lookups are binary searches, for a fraction of the memory.
+    SUFFIX_BACKEND_FUSED,               // A single table per length for both rules, one probe per lookup. Rule 3 probes it too, there's no mpTable.
+} SuffixBackend;
+
+// Thread-safe once initialized. If the data has no parts, the lookups resolve rule 3 on demand, so any code can be looked up.
 size_t processor_find_mp_index(const char *partNumber, size_t partCodeLength);
-void processor_initialize(const SourceData *data);
+void processor_initialize(const SourceData *data, SuffixBackend backend);
+
+// Writes the result line "<part>;<master part>\n", the master part is empty if there's no match. Returns the length written.
+// The output must have room for partCodeLength + MAX_STRING_LENGTH + 1.
+size_t processor_write_match(const SourceData *data, const char *partCode, size_t partCodeLength, char *output, MatchRule *outRule);
+
+// Same as processor_write_match for count codes, the result lines are written one after the other. Returns the total length written.
+// The lookups are prefetched in groups, so their cache misses overlap. Prefer it whenever more than one code is at hand.
+// The output must have room for the sum of codeLengths[i] + MAX_STRING_LENGTH + 1, outRules for count rules.
+size_t processor_write_matches(const SourceData *data, const char *const *codes, const size_t *codeLengths, size_t count, char *output, MatchRule *outRules);
+
+// Same as processor_write_match, for the loaded part at partIndex in data->partsOriginal.
+// The loaded parts are resolved once per distinct code at initialization, so this only writes the line.
+size_t processor_write_part_match(const SourceData *data, size_t partIndex, char *output, MatchRule *outRule);
+
+// Uses prebuilt master parts tables, only the tables for the parts are built.
+void processor_initialize_with_tables(const SourceData *data, const MasterPartsTables *tables);
+const MasterPartsTables *processor_master_parts_tables();
+
+// The distinct codes of the loaded parts with their matches, by length. The entries are NULL when no parts were loaded.
+HTable *const *processor_parts_tables();
 void processor_clean();
 
 #endif
@@ -0,0 +1,231 @@
+#include <string.h>
+#include "allocator.h"
+#include "thread_utils.h"
+#include "common.h"
+#include "processor.h"
+#include "server.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+
+bool server_run(const char *socketPath, const SourceData *data) {
+    fprintf(stderr, "The server mode is not supported on Windows.\n");
+    return false;
+}
+
+#else
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+// A line longer than the input buffer is a protocol error, the connection is closed.
+#define INPUT_BUFFER_SIZE ((size_t)(64 * 1024))
+
+// A response is at most the line plus the master part and two separators. The output is flushed early if it doesn't fit.
+#define OUTPUT_BUFFER_SIZE (2 * INPUT_BUFFER_SIZE)
+
+// Lines answered together, their lookups are prefetched in groups. See processor_write_matches.
+#define LOOKUP_BATCH_SIZE ((size_t)64)
+
+// The connections mostly wait on the clients, so we keep more of them than the hardware threads.
+#define MIN_CONNECTION_THREADS ((size_t)4)
+
+// Out of file descriptors or memory, accept keeps failing until a connection is closed. The threads wait instead of spinning.
+#define ACCEPT_RETRY_DELAY_MS 100
+
+/* Each thread blocks in accept on the shared listening socket, and serves one connection at a time.
+* The tables are read-only once initialized, so the threads share nothing else.
+*/
+typedef struct ConnectionThread {
+    int listenFd;
+    const SourceData *data;
+    char *input;
+    char *output;
+} ConnectionThread;
+
+static const char *boundSocketPath = NULL;
+
+static void handle_termination(int signalNumber) {
+    // Only async-signal-safe calls here.
+    if (boundSocketPath) {
+        unlink(boundSocketPath);
+    }
+    _exit(0);
+}
+
+static bool write_all(int fd, const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        buffer += written;
+        length -= (size_t)written;
+    }
+    return true;
+}
+
+static void serve_connection(int fd, const ConnectionThread *thread) {
+    char *input = thread->input;
+    char *output = thread->output;
+    size_t inputLength = 0;
+    const char *codes[LOOKUP_BATCH_SIZE];
+    size_t codeLengths[LOOKUP_BATCH_SIZE];
+    MatchRule rules[LOOKUP_BATCH_SIZE];
+
+    for (;;) {
+        ssize_t received = read(fd, input + inputLength, INPUT_BUFFER_SIZE - inputLength);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        bool closed = received == 0;
+        inputLength += (size_t)received;
+
+        // The lines are answered in batches, the output is reserved for the pending ones until they're written.
+        const char *line = input;
+        const char *end = input + inputLength;
+        size_t outputLength = 0;
+        size_t pendingSize = 0;
+        size_t codeCount = 0;
+        for (;;) {
+            const char *lineEnd = str_kernels.find_char(line, end, '\n');
+            // The last line may be unterminated, it's answered only once the client is done sending.
+            if (lineEnd == end && (!closed || line == end)) {
+                break;
+            }
+            size_t responseSize = (size_t)(lineEnd - line) + MAX_STRING_LENGTH + 2;
+            if (outputLength + pendingSize + responseSize > OUTPUT_BUFFER_SIZE) {
+                outputLength += processor_write_matches(thread->data, codes, codeLengths, codeCount, output + outputLength, rules);
+                codeCount = 0;
+                pendingSize = 0;
+                if (!write_all(fd, output, outputLength)) {
+                    return;
+                }
+                outputLength = 0;
+            }
+            line = str_read_line(line, end, &codes[codeCount], &codeLengths[codeCount]);
+            codeCount++;
+            pendingSize += responseSize;
+            if (codeCount == LOOKUP_BATCH_SIZE) {
+                outputLength += processor_write_matches(thread->data, codes, codeLengths, codeCount, output + outputLength, rules);
+                codeCount = 0;
+                pendingSize = 0;
+            }
+        }
+        outputLength += processor_write_matches(thread->data, codes, codeLengths, codeCount, output + outputLength, rules);
+        if (outputLength > 0 && !write_all(fd, output, outputLength)) {
+            return;
+        }
+        if (closed) {
+            return;
+        }
+
+        inputLength = (size_t)(end - line);
+        memmove(input, line, inputLength);
+        if (inputLength == INPUT_BUFFER_SIZE) {
+            return;
+        }
+    }
+}
+
+static thread_ret_t serve_connections(thread_arg_t arg) {
+    ConnectionThread *thread = (ConnectionThread *)arg;
+
+    for (;;) {
+        int fd = accept(thread->listenFd, NULL, NULL);
+        if (fd == -1) {
+            int error = errno;
+            if (error != EINTR && error != ECONNABORTED) {
+                perror("Failed to accept connection");
+            }
+            if (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM) {
+                poll(NULL, 0, ACCEPT_RETRY_DELAY_MS);
+            }
+            continue;
+        }
+        serve_connection(fd, thread);
+        close(fd);
+    }
+    return 0;
+}
+
+static int listen_on(const char *socketPath) {
+    struct sockaddr_un address = { 0 };
+    address.sun_family = AF_UNIX;
+    if (strlen(socketPath) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "The socket path is too long: %s\n", socketPath);
+        return -1;
+    }
+    strcpy(address.sun_path, socketPath);
+
+    // A socket left behind by a previous run would fail the bind. Anything else at that path is left alone.
+    struct stat st;
+    if (stat(socketPath, &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socketPath);
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("Failed to create socket");
+        return -1;
+    }
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0) {
+        perror("Failed to listen on socket");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+bool server_run(const char *socketPath, const SourceData *data) {
+    int listenFd = listen_on(socketPath);
+    if (listenFd == -1) {
+        return false;
+    }
+    boundSocketPath = socketPath;
+    signal(SIGINT, handle_termination);
+    signal(SIGTERM, handle_termination);
+    // A client that disconnects early must not take the server down.
+    signal(SIGPIPE, SIG_IGN);
+
+    size_t threadCount = get_hardware_thread_count();
+    if (threadCount < MIN_CONNECTION_THREADS) {
+        threadCount = MIN_CONNECTION_THREADS;
+    }
+
+    thread_t *threads = allocator_alloc(threadCount * sizeof(*threads));
+    CHECK_ALLOC(threads);
+    ConnectionThread *connectionThreads = allocator_alloc(threadCount * sizeof(*connectionThreads));
+    CHECK_ALLOC(connectionThreads);
+
+    for (size_t i = 0; i < threadCount; i++) {
+        connectionThreads[i].listenFd = listenFd;
+        connectionThreads[i].data = data;
+        connectionThreads[i].input = allocator_alloc(INPUT_BUFFER_SIZE);
+        CHECK_ALLOC(connectionThreads[i].input);
+        connectionThreads[i].output = allocator_alloc(OUTPUT_BUFFER_SIZE);
+        CHECK_ALLOC(connectionThreads[i].output);
+
+        if (create_thread(&threads[i], serve_connections, &connectionThreads[i]) != 0) {
+            fprintf(stderr, "Error creating connection thread\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    printf("Listening on %s\n", socketPath);
+    fflush(stdout);
+
+    // The threads never return, the process ends on SIGINT/SIGTERM.
+    for (size_t i = 0; i < threadCount; i++) {
+        join_thread(threads[i], NULL);
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,19 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <stdbool.h>
+#include "source_data.h"
+
+/* Answers lookups over a Unix domain socket, keeping the tables resident between requests.
+* The client sends newline-delimited part codes, any number per write. For each line the server sends back
+* "<part>;<master part>\n" (the master part is empty if there's no match), in the same order.
+* The responses for all complete lines received in one read are sent in one write, so a batch costs one round trip.
+* Lines are trimmed and CR is ignored, same as in the input files.
+* The server writes while the client may still be sending, so a client sending large batches must read concurrently.
+*/
+
+// The processor must be initialized with the master parts and no parts.
+// Runs until the process is terminated. Returns false if the socket can't be set up, or on Windows where it isn't supported.
+bool server_run(const char *socketPath, const SourceData *data);
+
+#endif
@@ -1,44 +1,79 @@
-#include <sys/stat.h>
 #include "allocator.h"
 #include "thread_utils.h"
 #include "common.h"
 #include "source_data.h"
-
-static thread_ret_t build_parts(thread_arg_t arg);
-static thread_ret_t build_masterParts(thread_arg_t arg);
-static char *read_file(const char *filePath, unsigned int sizeFactor, size_t *contentSizeOut, size_t *lineCountOut);
-static void merge_sort_by_code_length(Part *array, size_t size);
+#include "stats.h"
+
+// Below this size per chunk, the task overhead outweighs the parsing work.
+#define MIN_BYTES_PER_CHUNK ((size_t)(256 * 1024))
+
+/* Each file is split at line boundaries into chunks that are parsed concurrently, in two passes.
+* The first pass counts the records of each chunk. A prefix sum over the counts gives each chunk
+* the global index of its first record. The second pass parses the records and writes them at
+* their global position, so the order and the indices are the same as parsing the file sequentially.
+*
+* Each line takes at least (length + 1) bytes in the file, so the derived strings of a chunk always
+* fit within the chunk size. Each chunk writes them at its own offset in the string block.
+*/
+typedef struct RecordRange {
+    size_t startIndex;                  // Global index of the first record in this chunk
+    size_t count;
+    size_t countByLength[MAX_STRING_LENGTH];
+    size_t nextSortedIndexByLength[MAX_STRING_LENGTH];
+} RecordRange;
+
+typedef struct ParseChunk {
+    const char *start;
+    const char *end;
+    RecordRange records;
+    RecordRange recordsNh;
+    char *block;                        // Uppercased records of this chunk
+    char *blockNh;                      // Uppercased records without hyphens of this chunk
+    Records *original;
+    Records *asc;                       // Unsorted, each record at its global index
+    Records *nhAsc;
+    Records *ascSorted;
+    Records *nhAscSorted;
+    StatsPhase sortPhase;
+} ParseChunk;
 
 typedef struct ThreadArgs {
     const char *filePath;
     SourceData *data;
 } ThreadArgs;
 
+static thread_ret_t build_parts(thread_arg_t arg);
+static thread_ret_t build_masterParts(thread_arg_t arg);
+static thread_ret_t count_parts_chunk(thread_arg_t arg);
+static thread_ret_t parse_parts_chunk(thread_arg_t arg);
+static thread_ret_t count_masterParts_chunk(thread_arg_t arg);
+static thread_ret_t parse_masterParts_chunk(thread_arg_t arg);
+static void map_file(const char *filePath, MappedFile *outFile);
+static size_t split_into_chunks(Arena *arena, const MappedFile *file, ParseChunk **outChunks);
+static void run_chunk_tasks(ParseChunk *chunks, size_t chunkCount, thread_func_t func);
+static void records_init(Records *records, Arena *arena, const char *base, size_t count, bool withIndices);
+static void sort_by_code_length(ParseChunk *chunks, size_t chunkCount, bool noHyphens, size_t *outStartIndexByLength);
+static thread_ret_t scatter_chunk_by_code_length(thread_arg_t arg);
+static thread_ret_t scatter_chunk_by_code_length_nh(thread_arg_t arg);
+
 void source_data_load(SourceData *data, const char *partsFile, const char *masterPartsFile) {
-    thread_t thread1;
-    int status = create_thread(&thread1, build_parts, &(ThreadArgs){.data = data, .filePath = partsFile });
-    CHECK_THREAD_CREATE_STATUS(status, (size_t)0);
-    thread_t thread2;
-    status = create_thread(&thread2, build_masterParts, &(ThreadArgs){.data = data, .filePath = masterPartsFile });
-    CHECK_THREAD_CREATE_STATUS(status, (size_t)0);
-
-
-    status = join_thread(thread1, NULL);
-    CHECK_THREAD_JOIN_STATUS(status, (size_t)0);
-    status = join_thread(thread2, NULL);
-    CHECK_THREAD_JOIN_STATUS(status, (size_t)0);
+    ThreadArgs partsArgs = { .data = data, .filePath = partsFile };
+    ThreadArgs masterPartsArgs = { .data = data, .filePath = masterPartsFile };
+
+    TaskGroup group = { 0 };
+    if (partsFile) {
+        thread_pool_submit(&group, build_parts, &partsArgs);
+    }
+    if (masterPartsFile) {
+        thread_pool_submit(&group, build_masterParts, &masterPartsArgs);
+    }
+    thread_pool_wait(&group);
 }
 
 void source_data_clean(const SourceData *data) {
-    // All strings are allocated from a single block
-    free((void *)data->stringBlock.blockParts);
-    free((void *)data->stringBlock.blockMasterParts);
-
-    free((void *)data->masterPartsOriginal);
-    free((void *)data->masterPartsAsc);
-    free((void *)data->masterPartsNhAsc);
-    free((void *)data->partsOriginal);
-    free((void *)data->partsAsc);
+    // The strings and the records are in the default arena, only the files are released here.
+    file_unmap((MappedFile *)&data->stringBlock.partsFile);
+    file_unmap((MappedFile *)&data->stringBlock.masterPartsFile);
 }
 
 static thread_ret_t build_parts(thread_arg_t arg) {
@@ -46,51 +81,52 @@ static thread_ret_t build_parts(thread_arg_t arg) {
     const char *partsPath = args->filePath;
     SourceData *data = args->data;
 
-    size_t lineCount;
-    size_t contentSize;
-    char *block = read_file(partsPath, 2, &contentSize, &lineCount);
+    MappedFile file;
+    PhaseTimer readTimer = stats_phase_begin();
+    map_file(partsPath, &file);
+    stats_phase_end(STATS_PHASE_READ_PARTS, readTimer);
 
-    Part *partsOriginal = allocator_alloc(lineCount * sizeof(*partsOriginal));
-    CHECK_ALLOC(partsOriginal);
-    Part *partsAsc = allocator_alloc(lineCount * sizeof(*partsAsc));
-    CHECK_ALLOC(partsAsc);
+    // The chunks and the unsorted records are needed only until the sort is done.
+    Arena *tempArena = arena_create();
 
-    size_t partsIndex = 0;
-    size_t blockIndex = 0;
-    size_t blockUpperIndex = contentSize;
-
-    for (size_t i = 0; i < contentSize; i++) {
-        if (block[i] != '\n') continue;
+    ParseChunk *chunks;
+    size_t chunkCount = split_into_chunks(tempArena, &file, &chunks);
+    run_chunk_tasks(chunks, chunkCount, count_parts_chunk);
 
-        block[i] = '\0';
-        size_t length = i - blockIndex;
-        if (i > 0 && block[i - 1] == '\r') {
-            block[i - 1] = '\0';
-            length--;
-        }
-        assert(partsIndex < lineCount);
-
-        const char *trimmedRecord = str_trim_in_place(&block[blockIndex], length, &length);
-        partsOriginal[partsIndex].code = trimmedRecord;
-        partsOriginal[partsIndex].codeLength = length;
-        partsOriginal[partsIndex].index = partsIndex;
+    size_t partsCount = 0;
+    for (size_t i = 0; i < chunkCount; i++) {
+        chunks[i].records.startIndex = partsCount;
+        partsCount += chunks[i].records.count;
+    }
 
-        partsAsc[partsIndex].code = str_to_upper(trimmedRecord, length, &block[blockUpperIndex]);
-        partsAsc[partsIndex].codeLength = length;
-        partsAsc[partsIndex].index = partsIndex;
-        blockUpperIndex += length + 1; // +1 for null terminator
+    // Only the uppercased records are stored. One byte per char plus the null terminator fits in the file size + 1.
+    char *block = allocator_alloc(file.size + 1);
+    CHECK_ALLOC(block);
 
-        partsIndex++;
-        blockIndex = i + 1;
+    // The unsorted uppercased records have the same lengths as the original ones, and they're in the original order.
+    Records partsOriginal, partsAsc;
+    records_init(&partsOriginal, NULL, file.data, partsCount, false);
+    records_init(&partsAsc, NULL, block, partsCount, true);
+    Records partsAscUnsorted = { .base = block, .lengths = partsOriginal.lengths, .count = partsCount };
+    partsAscUnsorted.offsets = arena_alloc(tempArena, partsCount * sizeof(*partsAscUnsorted.offsets));
+    CHECK_ALLOC(partsAscUnsorted.offsets);
+
+    for (size_t i = 0; i < chunkCount; i++) {
+        chunks[i].block = block + (chunks[i].start - file.data);
+        chunks[i].original = &partsOriginal;
+        chunks[i].asc = &partsAscUnsorted;
+        chunks[i].ascSorted = &partsAsc;
+        chunks[i].sortPhase = STATS_PHASE_SORT_PARTS;
     }
+    run_chunk_tasks(chunks, chunkCount, parse_parts_chunk);
 
-    merge_sort_by_code_length(partsAsc, partsIndex);
+    sort_by_code_length(chunks, chunkCount, false, data->partsAscStartIndexByLength);
+    arena_destroy(tempArena);
 
     data->partsOriginal = partsOriginal;
-    data->partsOriginalCount = partsIndex;
     data->partsAsc = partsAsc;
-    data->partsAscCount = partsIndex;
     data->stringBlock.blockParts = block;
+    data->stringBlock.partsFile = file;
     return 0;
 }
 
@@ -99,180 +135,323 @@ static thread_ret_t build_masterParts(thread_arg_t arg) {
     const char *masterPartsPath = args->filePath;
     SourceData *data = args->data;
 
-    size_t lineCount;
-    size_t contentSize;
-    char *block = read_file(masterPartsPath, 3, &contentSize, &lineCount);
-
-    Part *mpOriginal = allocator_alloc(lineCount * sizeof(*mpOriginal));
-    CHECK_ALLOC(mpOriginal);
-    Part *mpAsc = allocator_alloc(lineCount * sizeof(*mpAsc));
-    CHECK_ALLOC(mpAsc);
-    Part *mpNhAsc = allocator_alloc(lineCount * sizeof(*mpNhAsc));
-    CHECK_ALLOC(mpNhAsc);
-
-    size_t mpIndex = 0;
-    size_t mpNhIndex = 0;
-    size_t blockIndex = 0;
-    size_t blockIndexExtra = contentSize;
-    bool containsHyphens = false;
-
-    for (size_t i = 0; i < contentSize; i++) {
-        if (block[i] == CHAR_HYPHEN) containsHyphens = true;
-        if (block[i] != '\n') continue;
-
-        block[i] = '\0';
-        size_t length = i - blockIndex;
-        if (i > 0 && block[i - 1] == '\r') {
-            block[i - 1] = '\0';
-            length--;
-        }
-        assert(mpIndex < lineCount);
+    MappedFile file;
+    PhaseTimer readTimer = stats_phase_begin();
+    map_file(masterPartsPath, &file);
+    stats_phase_end(STATS_PHASE_READ_MASTER_PARTS, readTimer);
+
+    // The chunks and the unsorted records are needed only until the sort is done.
+    Arena *tempArena = arena_create();
+
+    ParseChunk *chunks;
+    size_t chunkCount = split_into_chunks(tempArena, &file, &chunks);
+    run_chunk_tasks(chunks, chunkCount, count_masterParts_chunk);
+
+    size_t mpCount = 0;
+    size_t mpNhCount = 0;
+    for (size_t i = 0; i < chunkCount; i++) {
+        chunks[i].records.startIndex = mpCount;
+        chunks[i].recordsNh.startIndex = mpNhCount;
+        mpCount += chunks[i].records.count;
+        mpNhCount += chunks[i].recordsNh.count;
+    }
 
-        const char *trimmedRecord = str_trim_in_place(&block[blockIndex], length, &length);
-        if (length >= MIN_STRING_LENGTH) {
-            mpOriginal[mpIndex].code = trimmedRecord;
-            mpOriginal[mpIndex].codeLength = length;
-            mpOriginal[mpIndex].index = mpIndex;
-
-            const char *upperRecord = str_to_upper(trimmedRecord, length, &block[blockIndexExtra]);
-            mpAsc[mpIndex].code = upperRecord;
-            mpAsc[mpIndex].codeLength = length;
-            mpAsc[mpIndex].index = mpIndex;
-            blockIndexExtra += length + 1; // +1 for null terminator
-
-            if (containsHyphens) {
-                size_t codeNhLength;
-                mpNhAsc[mpNhIndex].code = str_remove_hyphens(upperRecord, length, &block[blockIndexExtra], &codeNhLength);
-                mpNhAsc[mpNhIndex].codeLength = codeNhLength;
-                mpNhAsc[mpNhIndex].index = mpIndex;
-                mpNhIndex++;
-                blockIndexExtra += codeNhLength + 1; // +1 for null terminator
-            }
+    // The uppercased records and the ones without hyphens are stored. Each fits in the file size + 1.
+    // Both kinds of derived records are offsets from the start of the block, the ones without hyphens are in its second half.
+    char *block = allocator_alloc(2 * (file.size + 1));
+    CHECK_ALLOC(block);
 
-            mpIndex++;
-        }
-        blockIndex = i + 1;
-        containsHyphens = false;
+    Records mpOriginal, mpAsc, mpNhAsc, mpNhAscUnsorted;
+    records_init(&mpOriginal, NULL, file.data, mpCount, false);
+    records_init(&mpAsc, NULL, block, mpCount, true);
+    records_init(&mpNhAsc, NULL, block, mpNhCount, true);
+    records_init(&mpNhAscUnsorted, tempArena, block, mpNhCount, true);
+    Records mpAscUnsorted = { .base = block, .lengths = mpOriginal.lengths, .count = mpCount };
+    mpAscUnsorted.offsets = arena_alloc(tempArena, mpCount * sizeof(*mpAscUnsorted.offsets));
+    CHECK_ALLOC(mpAscUnsorted.offsets);
+
+    for (size_t i = 0; i < chunkCount; i++) {
+        chunks[i].block = block + (chunks[i].start - file.data);
+        chunks[i].blockNh = block + (file.size + 1) + (chunks[i].start - file.data);
+        chunks[i].original = &mpOriginal;
+        chunks[i].asc = &mpAscUnsorted;
+        chunks[i].nhAsc = &mpNhAscUnsorted;
+        chunks[i].ascSorted = &mpAsc;
+        chunks[i].nhAscSorted = &mpNhAsc;
+        chunks[i].sortPhase = STATS_PHASE_SORT_MASTER_PARTS;
     }
+    run_chunk_tasks(chunks, chunkCount, parse_masterParts_chunk);
 
-    merge_sort_by_code_length(mpAsc, mpIndex);
-    merge_sort_by_code_length(mpNhAsc, mpNhIndex);
+    sort_by_code_length(chunks, chunkCount, false, data->masterPartsAscStartIndexByLength);
+    sort_by_code_length(chunks, chunkCount, true, data->masterPartsNhAscStartIndexByLength);
+    arena_destroy(tempArena);
 
     data->masterPartsOriginal = mpOriginal;
-    data->masterPartsOriginalCount = mpIndex;
     data->masterPartsAsc = mpAsc;
-    data->masterPartsAscCount = mpIndex;
     data->masterPartsNhAsc = mpNhAsc;
-    data->masterPartsNhAscCount = mpNhIndex;
     data->stringBlock.blockMasterParts = block;
+    data->stringBlock.blockMasterPartsSize = 2 * (file.size + 1);
+    data->stringBlock.masterPartsSourceSize = file.size;
+    data->stringBlock.masterPartsFile = file;
     return 0;
 }
 
-static long get_file_size_bytes(const char *filePath) {
-    assert(filePath);
+static thread_ret_t count_parts_chunk(thread_arg_t arg) {
+    ParseChunk *chunk = (ParseChunk *)arg;
+    PhaseTimer timer = stats_phase_begin();
 
-    struct stat st;
-    if (stat(filePath, &st) != 0) {
-        perror("stat failed");
-        return -1;
+    // Chunks end right after a newline. Only the last one may end with an unterminated line.
+    size_t count = str_kernels.count_char(chunk->start, chunk->end, '\n');
+    if (chunk->end > chunk->start && chunk->end[-1] != '\n') {
+        count++;
     }
-    return st.st_size;
+    chunk->records.count = count;
+    stats_phase_end(STATS_PHASE_PARSE_PARTS, timer);
+    return 0;
 }
 
-static char *read_file(const char *filePath, unsigned int sizeFactor, size_t *contentSizeOut, size_t *lineCountOut) {
-    long fileSize = get_file_size_bytes(filePath);
-    FILE *file = fopen(filePath, "rb");
-    if (!file || fileSize == -1) {
-        fprintf(stderr, "Failed to open file: %s\n", filePath);
-        exit(EXIT_FAILURE);
-    }
-    assert(fileSize > 0);
-    assert(sizeFactor > 0);
+static thread_ret_t parse_parts_chunk(thread_arg_t arg) {
+    ParseChunk *chunk = (ParseChunk *)arg;
+    PhaseTimer timer = stats_phase_begin();
+    Records *partsOriginal = chunk->original;
+    Records *partsAsc = chunk->asc;
+    char *block = chunk->block;
 
-    size_t blockSize = sizeof(char) * fileSize * sizeFactor + sizeFactor;
-    char *block = allocator_alloc(blockSize);
-    CHECK_ALLOC(block);
-    size_t contentSize = fread(block, 1, fileSize, file);
-    fclose(file);
+    size_t *countByLength = chunk->records.countByLength;
+    size_t partsIndex = chunk->records.startIndex;
+    size_t blockIndex = 0;
 
-#pragma warning(disable: 6385 6386 )
-    // MSVC thinks there is a buffer overrun, it can't calculate based on sizeFactor.
-    // If you put a literal for sizeFactor, e.g. 1, warning goes way.
+    for (const char *line = chunk->start; line < chunk->end; ) {
+        const char *record;
+        size_t length;
+        line = str_read_line(line, chunk->end, &record, &length);
+        assert(partsIndex < chunk->records.startIndex + chunk->records.count);
+
+        partsOriginal->offsets[partsIndex] = (uint32_t)(record - partsOriginal->base);
+        if (length >= MAX_STRING_LENGTH) {
+            // It's sorted with the empty records, so it's never looked up.
+            partsOriginal->lengths[partsIndex] = RECORD_LENGTH_OVERLONG;
+            block[blockIndex] = '\0';
+            partsAsc->offsets[partsIndex] = (uint32_t)(&block[blockIndex] - partsAsc->base);
+            blockIndex++;
+            countByLength[0]++;
+            partsIndex++;
+            continue;
+        }
+        partsOriginal->lengths[partsIndex] = (uint8_t)length;
+
+        // The lengths are shared with the original records.
+        partsAsc->offsets[partsIndex] = (uint32_t)(str_to_upper(record, length, &block[blockIndex]) - partsAsc->base);
+        blockIndex += length + 1; // +1 for null terminator
+        countByLength[length]++;
 
-    // Handle the case where the file does not end with a newline
-    if (contentSize > 0 && block[contentSize - 1] != '\n') {
-        block[contentSize] = '\n';
-        contentSize++;
+        partsIndex++;
     }
+    stats_phase_end(STATS_PHASE_PARSE_PARTS, timer);
+    return 0;
+}
+
+static inline bool contains_hyphens(const char *record, size_t length) {
+    return str_kernels.find_char(record, record + length, CHAR_HYPHEN) != record + length;
+}
 
-    size_t lineCount = 0;
-    for (size_t i = 0; i < contentSize; i++) {
-        if (block[i] == '\n') {
-            lineCount++;
+static thread_ret_t count_masterParts_chunk(thread_arg_t arg) {
+    ParseChunk *chunk = (ParseChunk *)arg;
+    PhaseTimer timer = stats_phase_begin();
+
+    size_t count = 0;
+    size_t countNh = 0;
+    for (const char *line = chunk->start; line < chunk->end; ) {
+        const char *record;
+        size_t length;
+        line = str_read_line(line, chunk->end, &record, &length);
+        if (length >= MAX_STRING_LENGTH) {
+            fprintf(stderr, "The master parts must be shorter than %zu chars, this one has %zu: %.*s\n", MAX_STRING_LENGTH, length, (int)length, record);
+            exit(EXIT_FAILURE);
+        }
+        if (length >= MIN_STRING_LENGTH) {
+            count++;
+            if (contains_hyphens(record, length)) {
+                countNh++;
+            }
         }
     }
-#pragma warning(default: 6385 6386  )
+    chunk->records.count = count;
+    chunk->recordsNh.count = countNh;
+    stats_phase_end(STATS_PHASE_PARSE_MASTER_PARTS, timer);
+    return 0;
+}
 
-    *contentSizeOut = contentSize;
-    *lineCountOut = lineCount;
-    return block;
+static thread_ret_t parse_masterParts_chunk(thread_arg_t arg) {
+    ParseChunk *chunk = (ParseChunk *)arg;
+    PhaseTimer timer = stats_phase_begin();
+    Records *mpOriginal = chunk->original;
+    Records *mpAsc = chunk->asc;
+    Records *mpNhAsc = chunk->nhAsc;
+    char *block = chunk->block;
+    char *blockNh = chunk->blockNh;
+
+    size_t *countByLength = chunk->records.countByLength;
+    size_t *countNhByLength = chunk->recordsNh.countByLength;
+    size_t mpIndex = chunk->records.startIndex;
+    size_t mpNhIndex = chunk->recordsNh.startIndex;
+    size_t blockIndex = 0;
+    size_t blockNhIndex = 0;
+
+    for (const char *line = chunk->start; line < chunk->end; ) {
+        const char *record;
+        size_t length;
+        line = str_read_line(line, chunk->end, &record, &length);
+        if (length < MIN_STRING_LENGTH) continue;
+        assert(mpIndex < chunk->records.startIndex + chunk->records.count);
+        assert(length < MAX_STRING_LENGTH);
+
+        mpOriginal->offsets[mpIndex] = (uint32_t)(record - mpOriginal->base);
+        mpOriginal->lengths[mpIndex] = (uint8_t)length;
+
+        // The lengths are shared with the original records.
+        const char *upperRecord = str_to_upper(record, length, &block[blockIndex]);
+        mpAsc->offsets[mpIndex] = (uint32_t)(upperRecord - mpAsc->base);
+        blockIndex += length + 1; // +1 for null terminator
+        countByLength[length]++;
+
+        if (contains_hyphens(record, length)) {
+            size_t codeNhLength;
+            const char *nhRecord = str_remove_hyphens(upperRecord, length, &blockNh[blockNhIndex], &codeNhLength);
+            mpNhAsc->offsets[mpNhIndex] = (uint32_t)(nhRecord - mpNhAsc->base);
+            mpNhAsc->lengths[mpNhIndex] = (uint8_t)codeNhLength;
+            mpNhAsc->indices[mpNhIndex] = (uint32_t)mpIndex;
+            mpNhIndex++;
+            blockNhIndex += codeNhLength + 1; // +1 for null terminator
+            countNhByLength[codeNhLength]++;
+        }
+
+        mpIndex++;
+    }
+    stats_phase_end(STATS_PHASE_PARSE_MASTER_PARTS, timer);
+    return 0;
 }
 
+static void map_file(const char *filePath, MappedFile *outFile) {
+    assert(filePath);
 
-/*  We need stable sorting algorithm.
-    I was using the built-in qsort (unstable) with a custom compare function that additionally uses the index to make it stable.
-    But it was slower (~40 ms overall) than the hand rolled merge sort, which is a stable algorithm.
-    For reference, here is the comparison function I used for qsort.
+    if (!file_map(filePath, FILE_ACCESS_SEQUENTIAL, outFile)) {
+        fprintf(stderr, "Failed to open file: %s\n", filePath);
+        exit(EXIT_FAILURE);
+    }
+    if (outFile->size > MAX_FILE_SIZE) {
+        fprintf(stderr, "The file is larger than %zu bytes: %s\n", MAX_FILE_SIZE, filePath);
+        exit(EXIT_FAILURE);
+    }
+}
 
-    static int compare_by_code_length_asc(const void *a, const void *b) {
-        const Part *partA = (const Part *)a;
-        const Part *partB = (const Part *)b;
-        return partA->codeLength == partB->codeLength
-            ? (int)partA->index - (int)partB->index
-            : (int)partA->codeLength - (int)partB->codeLength;
+// With a NULL arena, the arrays are allocated from the default one.
+static void records_init(Records *records, Arena *arena, const char *base, size_t count, bool withIndices) {
+    *records = (Records){ .base = base, .count = count };
+    if (count == 0) {
+        return;
     }
-*/
+    records->offsets = arena ? arena_alloc(arena, count * sizeof(*records->offsets)) : allocator_alloc(count * sizeof(*records->offsets));
+    CHECK_ALLOC(records->offsets);
+    records->lengths = arena ? arena_alloc(arena, count * sizeof(*records->lengths)) : allocator_alloc(count * sizeof(*records->lengths));
+    CHECK_ALLOC(records->lengths);
+    if (withIndices) {
+        records->indices = arena ? arena_alloc(arena, count * sizeof(*records->indices)) : allocator_alloc(count * sizeof(*records->indices));
+        CHECK_ALLOC(records->indices);
+    }
+}
 
-static void merge(Part *array, Part *tempArray, size_t left, size_t mid, size_t right) {
-    size_t i = left, j = mid + 1, k = left;
+// Splits the content into chunks of roughly equal size, each ending right after a newline (or at the end of the content).
+static size_t split_into_chunks(Arena *arena, const MappedFile *file, ParseChunk **outChunks) {
+    size_t chunkCount = thread_pool_concurrency();
+    if (chunkCount > file->size / MIN_BYTES_PER_CHUNK) {
+        chunkCount = file->size / MIN_BYTES_PER_CHUNK;
+    }
+    if (chunkCount == 0) {
+        chunkCount = 1;
+    }
 
-    while (i <= mid && j <= right) {
-        if (array[i].codeLength <= array[j].codeLength) {
-            tempArray[k++] = array[i++];
-        }
-        else {
-            tempArray[k++] = array[j++];
+    ParseChunk *chunks = arena_alloc(arena, chunkCount * sizeof(*chunks));
+    CHECK_ALLOC(chunks);
+
+    const char *contentEnd = file->data + file->size;
+    const char *start = file->data;
+    size_t count = 0;
+    for (size_t i = 0; i < chunkCount && start < contentEnd; i++) {
+        const char *end = contentEnd;
+        if (i < chunkCount - 1) {
+            end = file->data + file->size / chunkCount * (i + 1);
+            if (end < start) {
+                end = start;
+            }
+            end = str_kernels.find_char(end, contentEnd, '\n');
+            if (end < contentEnd) end++;
         }
+        chunks[count] = (ParseChunk){ .start = start, .end = end };
+        count++;
+        start = end;
     }
 
-    // I tried memcpy instead of these loops but it was slower.
-    // Looping though the elements is faster.
+    *outChunks = chunks;
+    return count;
+}
 
-    while (i <= mid) {
-        tempArray[k++] = array[i++];
+static void run_chunk_tasks(ParseChunk *chunks, size_t chunkCount, thread_func_t func) {
+    TaskGroup group = { 0 };
+    for (size_t i = 0; i < chunkCount; i++) {
+        thread_pool_submit(&group, func, &chunks[i]);
     }
+    thread_pool_wait(&group);
+}
 
-    while (j <= right) {
-        tempArray[k++] = array[j++];
-    }
 
-    for (i = left; i <= right; i++) {
-        array[i] = tempArray[i];
+/*  We need a stable sorting algorithm, and the key is only the length, which is below MAX_STRING_LENGTH.
+    So we use a counting sort. The parse pass already counted the records per length for each chunk.
+    A prefix sum over (length, chunk) gives each chunk the position of its first record of each length.
+    The chunks then scatter their records in parallel. Within a length, the records keep their original
+    order (chunk order first, then the order within the chunk), so it's stable.
+    We used a hand rolled merge sort before, it was O(n log n) and it needed a full pass per level.
+*/
+static void sort_by_code_length(ParseChunk *chunks, size_t chunkCount, bool noHyphens, size_t *outStartIndexByLength) {
+    size_t index = 0;
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        outStartIndexByLength[length] = index;
+        for (size_t i = 0; i < chunkCount; i++) {
+            RecordRange *range = noHyphens ? &chunks[i].recordsNh : &chunks[i].records;
+            range->nextSortedIndexByLength[length] = index;
+            index += range->countByLength[length];
+        }
     }
+    outStartIndexByLength[MAX_STRING_LENGTH] = index;
+
+    run_chunk_tasks(chunks, chunkCount, noHyphens ? scatter_chunk_by_code_length_nh : scatter_chunk_by_code_length);
 }
 
-static void merge_sort_recursive(Part *array, Part *tempArray, size_t left, size_t right) {
-    if (left < right) {
-        size_t mid = left + (right - left) / 2;
-        merge_sort_recursive(array, tempArray, left, mid);
-        merge_sort_recursive(array, tempArray, mid + 1, right);
-        merge(array, tempArray, left, mid, right);
+static void scatter_by_code_length(const Records *source, Records *destination, RecordRange *range) {
+    size_t *nextSortedIndexByLength = range->nextSortedIndexByLength;
+    size_t endIndex = range->startIndex + range->count;
+    for (size_t i = range->startIndex; i < endIndex; i++) {
+        // The over-long parts go with the empty ones, see RECORD_LENGTH_OVERLONG.
+        uint8_t length = source->lengths[i] == RECORD_LENGTH_OVERLONG ? 0 : source->lengths[i];
+        size_t sortedIndex = nextSortedIndexByLength[length]++;
+        destination->offsets[sortedIndex] = source->offsets[i];
+        destination->lengths[sortedIndex] = length;
+        destination->indices[sortedIndex] = (uint32_t)records_index(source, i);
     }
 }
 
-static void merge_sort_by_code_length(Part *array, size_t size) {
-    Part *tempArray = allocator_alloc(size * sizeof(Part));
-    CHECK_ALLOC(tempArray);
-    merge_sort_recursive(array, tempArray, 0, size - 1);
-    //free(tempArray); // We switched to allocator.
+static thread_ret_t scatter_chunk_by_code_length(thread_arg_t arg) {
+    ParseChunk *chunk = (ParseChunk *)arg;
+    PhaseTimer timer = stats_phase_begin();
+    scatter_by_code_length(chunk->asc, chunk->ascSorted, &chunk->records);
+    stats_phase_end(chunk->sortPhase, timer);
+    return 0;
+}
+
+static thread_ret_t scatter_chunk_by_code_length_nh(thread_arg_t arg) {
+    ParseChunk *chunk = (ParseChunk *)arg;
+    PhaseTimer timer = stats_phase_begin();
+    scatter_by_code_length(chunk->nhAsc, chunk->nhAscSorted, &chunk->recordsNh);
+    stats_phase_end(chunk->sortPhase, timer);
+    return 0;
 }
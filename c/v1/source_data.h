@@ -2,44 +2,86 @@
 #define SOURCE_DATA_H
 
 #include <stdlib.h>
+#include <stdint.h>
+#include "file_utils.h"
 
 // Based on the requirements the part codes are less than 50 characters (ASCII).
 // Defining the max as 50 makes it easier to work with arrays and buffer sizes (null terminator).
 #define MAX_STRING_LENGTH ((size_t)50)
 
+// A longer part can't be matched, it's reported as unmatched like in the stream and server modes.
+// Its length may not fit the records, so it's stored as this, and the part is read again from its line when written.
+// A longer master part would be dropped from the tables along with its matches, so the file is rejected instead.
+#define RECORD_LENGTH_OVERLONG ((uint8_t)UINT8_MAX)
+
 // Based on the requirements we should ignore part codes with less than 3 characters.
 #define MIN_STRING_LENGTH ((size_t)3)
 
+// The records and the hash tables store 32-bit offsets into the files and the string blocks.
+// The master parts block holds two copies of the records, so the input files are limited to 2 GB.
+#define MAX_FILE_SIZE ((size_t)(UINT32_MAX / 2))
+
+// The original records point directly into the mapped input files.
+// Only the derived strings (uppercased, without hyphens) are stored in these blocks.
+// The original master parts may also point into a copy of their file, from an index or extended by delta updates.
+// So the sizes are kept separately from the mapped files.
 typedef struct StringAllocationBlock {
     const void *blockParts;
     const void *blockMasterParts;
+    size_t blockMasterPartsSize;
+    size_t masterPartsSourceSize;       // Size of the text the original master parts point into, from masterPartsOriginal.base
+    MappedFile partsFile;
+    MappedFile masterPartsFile;
 } StringAllocationBlock;
 
-typedef struct Part {
-    const char *code;
-    size_t codeLength;
-    size_t index;                       // Index to the original records. Also used for stable sorting.
-} Part;
+/* Records as a structure of arrays, 5 bytes per original record and 9 per derived one.
+* A code is stored as an offset from the base, the mapped file for the original records or the string block for the derived ones.
+* The codes of the original records are not null-terminated, always use the length.
+*/
+typedef struct Records {
+    const char *base;
+    uint32_t *offsets;
+    uint8_t *lengths;
+    uint32_t *indices;                  // Index to the original records. NULL for the original records themselves.
+    size_t count;
+} Records;
+
+static inline const char *records_code(const Records *records, size_t i) {
+    return records->base + records->offsets[i];
+}
+
+static inline size_t records_length(const Records *records, size_t i) {
+    return records->lengths[i];
+}
+
+static inline size_t records_index(const Records *records, size_t i) {
+    return records->indices ? records->indices[i] : i;
+}
 
+/* The sorted arrays come with the start index of each length, a by-product of the counting sort.
+* StartIndexByLength[length] is the index of the first record with codeLength >= length,
+* so the records with that exact length are in [StartIndexByLength[length], StartIndexByLength[length + 1]).
+* StartIndexByLength[MAX_STRING_LENGTH] is the count.
+*/
 typedef struct SourceData {
-    const Part *masterPartsOriginal;    // Original master parts records, trimmed
-    size_t masterPartsOriginalCount;
+    Records masterPartsOriginal;        // Original master parts records, trimmed
+    size_t masterPartsDeltaCount;       // Delta updates applied since the master parts were loaded from their file
 
-    const Part *masterPartsAsc;         // Sorted master parts records, uppercased
-    size_t masterPartsAscCount;
+    Records masterPartsAsc;             // Sorted master parts records, uppercased
+    size_t masterPartsAscStartIndexByLength[MAX_STRING_LENGTH + 1];
 
-    const Part *masterPartsNhAsc;       // Sorted master parts records, uppercased, without hyphens (Nh = no hyphens)
-    size_t masterPartsNhAscCount;
+    Records masterPartsNhAsc;           // Sorted master parts records, uppercased, without hyphens (Nh = no hyphens)
+    size_t masterPartsNhAscStartIndexByLength[MAX_STRING_LENGTH + 1];
 
-    const Part *partsOriginal;          // Original parts records, trimmed
-    size_t partsOriginalCount;
+    Records partsOriginal;              // Original parts records, trimmed
 
-    const Part *partsAsc;               // Sorted parts records, uppercased
-    size_t partsAscCount;
+    Records partsAsc;                   // Sorted parts records, uppercased
+    size_t partsAscStartIndexByLength[MAX_STRING_LENGTH + 1];
 
     StringAllocationBlock stringBlock;
 } SourceData;
 
+// Either path can be NULL, then that side is left empty (e.g. the master parts come from an index file).
 void source_data_load(SourceData *data, const char *partsFile, const char *masterPartsFile);
 void source_data_clean(const SourceData *data);
 
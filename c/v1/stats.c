@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include "allocator.h"
+#include "thread_utils.h"
+#include "common.h"
+#include "cross_platform_time.h"
+#include "hash_table.h"
+#include "suffix_index.h"
+#include "suffix_trie.h"
+#include "stats.h"
+
+#if defined(_WIN32) || defined(_WIN64)
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// mpTable, then the suffix, nh suffix, match and parts tables of each length.
+#define MAX_TABLE_REPORTS (1 + 4 * MAX_STRING_LENGTH)
+
+// The structures that replace the suffix tables and mpTable with the sorted backend.
+#define MAX_INDEX_REPORTS 3
+
+typedef struct PhaseStats {
+    size_t calls;
+    double wallStart;                   // Earliest start among the calls
+    double wallEnd;                     // Latest end among the calls
+    double cpuSeconds;
+    size_t peakRssBytes;                // Process high-water mark at the latest end, it includes the earlier phases
+} PhaseStats;
+
+typedef struct TableReport {
+    const char *name;
+    size_t length;                      // 0 for mpTable, it has all lengths
+    const HTable *table;
+    HTableStats stats;
+} TableReport;
+
+typedef struct IndexReport {
+    const char *name;
+    size_t count;                       // Records for a suffix index, nodes for the trie
+    size_t bytes;
+} IndexReport;
+
+static const char *PHASE_NAMES[STATS_PHASE_COUNT] = {
+    "read_parts",
+    "parse_parts",
+    "sort_parts",
+    "read_master_parts",
+    "parse_master_parts",
+    "sort_master_parts",
+    "load_index",
+    "delta_update",
+    "suffix_hashes",
+    "mp_table",
+    "mp_suffix_tables",
+    "mp_nh_suffix_tables",
+    "mp_suffix_indexes",
+    "mp_suffix_trie",
+    "mp_match_tables",
+    "parts_tables",
+    "lookup",
+    "write",
+};
+
+static const char *RULE_NAMES[MATCH_RULE_COUNT] = {
+    "none",
+    "rule1",
+    "rule2",
+    "rule3",
+};
+
+static struct {
+    StatsFormat format;
+    double startTime;
+    PhaseStats phases[STATS_PHASE_COUNT];
+    size_t countByRule[MATCH_RULE_COUNT];
+    thread_mutex_t mutex;
+} stats = { 0 };
+
+static size_t get_peak_rss_bytes(void) {
+#if defined(_WIN32) || defined(_WIN64)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return (size_t)counters.PeakWorkingSetSize;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#if defined(__APPLE__)
+    return (size_t)usage.ru_maxrss;     // Bytes on macOS
+#else
+    return (size_t)usage.ru_maxrss * 1024;
+#endif
+#endif
+}
+
+void stats_init(StatsFormat format) {
+    stats.format = format;
+    if (format != STATS_OFF) {
+        thread_mutex_init(&stats.mutex);
+        stats.startTime = time_get_seconds();
+    }
+}
+
+PhaseTimer stats_phase_begin(void) {
+    PhaseTimer timer = { 0 };
+    if (stats.format != STATS_OFF) {
+        timer.wallStart = time_get_seconds();
+        timer.cpuStart = time_get_thread_cpu_seconds();
+    }
+    return timer;
+}
+
+void stats_phase_end(StatsPhase phase, PhaseTimer timer) {
+    if (stats.format == STATS_OFF) {
+        return;
+    }
+    double wallEnd = time_get_seconds();
+    double cpuSeconds = time_get_thread_cpu_seconds() - timer.cpuStart;
+    size_t peakRssBytes = get_peak_rss_bytes();
+
+    thread_mutex_lock(&stats.mutex);
+    PhaseStats *phaseStats = &stats.phases[phase];
+    if (phaseStats->calls == 0 || timer.wallStart < phaseStats->wallStart) {
+        phaseStats->wallStart = timer.wallStart;
+    }
+    if (phaseStats->calls == 0 || wallEnd > phaseStats->wallEnd) {
+        phaseStats->wallEnd = wallEnd;
+    }
+    phaseStats->cpuSeconds += cpuSeconds;
+    if (peakRssBytes > phaseStats->peakRssBytes) {
+        phaseStats->peakRssBytes = peakRssBytes;
+    }
+    phaseStats->calls++;
+    thread_mutex_unlock(&stats.mutex);
+}
+
+void stats_add_rule_hits(const size_t *countByRule) {
+    if (stats.format == STATS_OFF) {
+        return;
+    }
+    thread_mutex_lock(&stats.mutex);
+    for (size_t rule = 0; rule < MATCH_RULE_COUNT; rule++) {
+        stats.countByRule[rule] += countByRule[rule];
+    }
+    thread_mutex_unlock(&stats.mutex);
+}
+
+static thread_ret_t collect_table_stats(thread_arg_t arg) {
+    TableReport *report = (TableReport *)arg;
+    htable_stats(report->table, &report->stats);
+    return 0;
+}
+
+static void add_table(TableReport *reports, size_t *count, const char *name, size_t length, const HTable *table) {
+    if (table) {
+        assert(*count < MAX_TABLE_REPORTS);
+        reports[(*count)++] = (TableReport){ .name = name, .length = length, .table = table };
+    }
+}
+
+// The tables are walked in parallel, one task per table.
+static size_t collect_tables(TableReport *reports) {
+    const MasterPartsTables *mp = processor_master_parts_tables();
+    HTable *const *partTables = processor_parts_tables();
+
+    size_t count = 0;
+    add_table(reports, &count, "mp", 0, mp->mpTable);
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        add_table(reports, &count, "mp_suffixes", length, mp->mpSuffixesTables[length]);
+    }
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        add_table(reports, &count, "mp_nh_suffixes", length, mp->mpNhSuffixesTables[length]);
+    }
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        add_table(reports, &count, "mp_matches", length, mp->mpMatchTables[length]);
+    }
+    for (size_t length = 0; length < MAX_STRING_LENGTH; length++) {
+        add_table(reports, &count, "parts", length, partTables[length]);
+    }
+
+    TaskGroup group = { 0 };
+    for (size_t i = 0; i < count; i++) {
+        thread_pool_submit(&group, collect_table_stats, &reports[i]);
+    }
+    thread_pool_wait(&group);
+    return count;
+}
+
+static void add_suffix_index(IndexReport *reports, size_t *count, const char *name, const SuffixIndex *index) {
+    if (index) {
+        assert(*count < MAX_INDEX_REPORTS);
+        reports[(*count)++] = (IndexReport){ .name = name, .count = index->records.count, .bytes = suffix_index_size(index) };
+    }
+}
+
+static size_t collect_indexes(IndexReport *reports) {
+    const MasterPartsTables *mp = processor_master_parts_tables();
+
+    size_t count = 0;
+    add_suffix_index(reports, &count, "mp_suffixes", mp->mpSuffixIndex);
+    add_suffix_index(reports, &count, "mp_nh_suffixes", mp->mpNhSuffixIndex);
+    if (mp->mpSuffixTrie) {
+        assert(count < MAX_INDEX_REPORTS);
+        reports[count++] = (IndexReport){ .name = "mp_suffix_trie", .count = mp->mpSuffixTrie->count, .bytes = suffix_trie_size(mp->mpSuffixTrie) };
+    }
+    return count;
+}
+
+static inline double load_factor(const HTableStats *tableStats) {
+    return tableStats->size > 0 ? (double)tableStats->count / (double)tableStats->size : 0.0;
+}
+
+static void report_text(const TableReport *reports, size_t tableCount, const IndexReport *indexReports, size_t indexCount, size_t peakBytes, size_t peakRssBytes, double totalSeconds) {
+    fprintf(stderr, "\n%-22s %8s %12s %12s %14s\n", "Phase", "Calls", "Wall (ms)", "CPU (ms)", "Peak RSS (MiB)");
+    for (size_t phase = 0; phase < STATS_PHASE_COUNT; phase++) {
+        const PhaseStats *phaseStats = &stats.phases[phase];
+        if (phaseStats->calls > 0) {
+            fprintf(stderr, "%-22s %8zu %12.3f %12.3f %14.1f\n", PHASE_NAMES[phase], phaseStats->calls,
+                (phaseStats->wallEnd - phaseStats->wallStart) * 1e3, phaseStats->cpuSeconds * 1e3,
+                (double)phaseStats->peakRssBytes / (1024.0 * 1024.0));
+        }
+    }
+
+    fprintf(stderr, "\n%-16s %6s %10s %10s %6s %10s %11s\n", "Table", "Length", "Count", "Slots", "Load", "Max probe", "Mean probe");
+    for (size_t i = 0; i < tableCount; i++) {
+        const HTableStats *tableStats = &reports[i].stats;
+        fprintf(stderr, "%-16s %6zu %10zu %10zu %6.3f %10zu %11.3f\n", reports[i].name, reports[i].length,
+            tableStats->count, tableStats->size, load_factor(tableStats), tableStats->maxProbeLength, tableStats->meanProbeLength);
+    }
+
+    if (indexCount > 0) {
+        fprintf(stderr, "\n%-16s %10s %14s\n", "Index", "Count", "Bytes");
+        for (size_t i = 0; i < indexCount; i++) {
+            fprintf(stderr, "%-16s %10zu %14zu\n", indexReports[i].name, indexReports[i].count, indexReports[i].bytes);
+        }
+    }
+
+    fprintf(stderr, "\nRule hits:");
+    for (size_t rule = 0; rule < MATCH_RULE_COUNT; rule++) {
+        fprintf(stderr, " %s %zu%s", RULE_NAMES[rule], stats.countByRule[rule], rule + 1 < MATCH_RULE_COUNT ? "," : "\n");
+    }
+    fprintf(stderr, "Allocator peak reserved: %zu bytes (%.1f MiB)\n", peakBytes, (double)peakBytes / (1024.0 * 1024.0));
+    fprintf(stderr, "Peak RSS: %zu bytes (%.1f MiB)\n", peakRssBytes, (double)peakRssBytes / (1024.0 * 1024.0));
+    fprintf(stderr, "Total wall: %.3f ms\n", totalSeconds * 1e3);
+}
+
+static void report_json(const TableReport *reports, size_t tableCount, const IndexReport *indexReports, size_t indexCount, size_t peakBytes, size_t peakRssBytes, double totalSeconds) {
+    fprintf(stderr, "{\"phases\":[");
+    bool first = true;
+    for (size_t phase = 0; phase < STATS_PHASE_COUNT; phase++) {
+        const PhaseStats *phaseStats = &stats.phases[phase];
+        if (phaseStats->calls > 0) {
+            fprintf(stderr, "%s{\"name\":\"%s\",\"calls\":%zu,\"wall_seconds\":%.6f,\"cpu_seconds\":%.6f,\"peak_rss_bytes\":%zu}",
+                first ? "" : ",", PHASE_NAMES[phase], phaseStats->calls, phaseStats->wallEnd - phaseStats->wallStart,
+                phaseStats->cpuSeconds, phaseStats->peakRssBytes);
+            first = false;
+        }
+    }
+
+    fprintf(stderr, "],\"tables\":[");
+    for (size_t i = 0; i < tableCount; i++) {
+        const HTableStats *tableStats = &reports[i].stats;
+        fprintf(stderr, "%s{\"name\":\"%s\",\"length\":%zu,\"count\":%zu,\"slots\":%zu,\"load_factor\":%.6f,\"max_probe_length\":%zu,\"mean_probe_length\":%.6f}",
+            i == 0 ? "" : ",", reports[i].name, reports[i].length, tableStats->count, tableStats->size,
+            load_factor(tableStats), tableStats->maxProbeLength, tableStats->meanProbeLength);
+    }
+
+    fprintf(stderr, "],\"indexes\":[");
+    for (size_t i = 0; i < indexCount; i++) {
+        fprintf(stderr, "%s{\"name\":\"%s\",\"count\":%zu,\"bytes\":%zu}",
+            i == 0 ? "" : ",", indexReports[i].name, indexReports[i].count, indexReports[i].bytes);
+    }
+
+    fprintf(stderr, "],\"rule_hits\":{");
+    for (size_t rule = 0; rule < MATCH_RULE_COUNT; rule++) {
+        fprintf(stderr, "%s\"%s\":%zu", rule == 0 ? "" : ",", RULE_NAMES[rule], stats.countByRule[rule]);
+    }
+    fprintf(stderr, "},\"allocator_peak_reserved_bytes\":%zu,\"peak_rss_bytes\":%zu,\"total_wall_seconds\":%.6f}\n",
+        peakBytes, peakRssBytes, totalSeconds);
+}
+
+void stats_report(void) {
+    if (stats.format == STATS_OFF) {
+        return;
+    }
+    double totalSeconds = time_get_seconds() - stats.startTime;
+
+    TableReport *reports = allocator_alloc(MAX_TABLE_REPORTS * sizeof(*reports));
+    CHECK_ALLOC(reports);
+    size_t tableCount = collect_tables(reports);
+    IndexReport indexReports[MAX_INDEX_REPORTS];
+    size_t indexCount = collect_indexes(indexReports);
+    size_t peakBytes = allocator_peak_reserved_bytes();
+    size_t peakRssBytes = get_peak_rss_bytes();
+
+    if (stats.format == STATS_JSON) {
+        report_json(reports, tableCount, indexReports, indexCount, peakBytes, peakRssBytes, totalSeconds);
+    }
+    else {
+        report_text(reports, tableCount, indexReports, indexCount, peakBytes, peakRssBytes, totalSeconds);
+    }
+}
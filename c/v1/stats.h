@@ -0,0 +1,56 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdlib.h>
+#include "processor.h"
+
+/* Opt-in run statistics, reported to stderr at the end of the run.
+* The phases are measured per task. The wall time of a phase is the span from its first start to its last end,
+* and the CPU time is the sum over all its tasks, so phases running concurrently are still attributed correctly.
+* Each phase also records the process peak RSS at its latest end. It's a high-water mark, so it includes the earlier phases.
+* When disabled, timing a phase is a single branch.
+*/
+typedef enum StatsPhase {
+    STATS_PHASE_READ_PARTS,
+    STATS_PHASE_PARSE_PARTS,
+    STATS_PHASE_SORT_PARTS,
+    STATS_PHASE_READ_MASTER_PARTS,
+    STATS_PHASE_PARSE_MASTER_PARTS,
+    STATS_PHASE_SORT_MASTER_PARTS,
+    STATS_PHASE_LOAD_INDEX,
+    STATS_PHASE_DELTA_UPDATE,
+    STATS_PHASE_SUFFIX_HASHES,
+    STATS_PHASE_MP_TABLE,
+    STATS_PHASE_MP_SUFFIX_TABLES,
+    STATS_PHASE_MP_NH_SUFFIX_TABLES,
+    STATS_PHASE_MP_SUFFIX_INDEXES,
+    STATS_PHASE_MP_SUFFIX_TRIE,
+    STATS_PHASE_MP_MATCH_TABLES,
+    STATS_PHASE_PARTS_TABLES,
+    STATS_PHASE_LOOKUP,
+    STATS_PHASE_WRITE,
+    STATS_PHASE_COUNT,
+} StatsPhase;
+
+typedef enum StatsFormat {
+    STATS_OFF,
+    STATS_TEXT,
+    STATS_JSON,
+} StatsFormat;
+
+typedef struct PhaseTimer {
+    double wallStart;
+    double cpuStart;
+} PhaseTimer;
+
+void stats_init(StatsFormat format);
+PhaseTimer stats_phase_begin(void);
+void stats_phase_end(StatsPhase phase, PhaseTimer timer);
+
+// Adds the hits counted by a lookup task, indexed by MatchRule.
+void stats_add_rule_hits(const size_t *countByRule);
+
+// Also reports the processor tables and the allocator peak. Call it before the thread pool is destroyed.
+void stats_report(void);
+
+#endif
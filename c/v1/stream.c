@@ -0,0 +1,242 @@
+#include <string.h>
+#include "allocator.h"
+#include "thread_utils.h"
+#include "common.h"
+#include "processor.h"
+#include "stream.h"
+#include "stats.h"
+
+// Input bytes per batch. Large enough to amortize the task overhead, small enough that the first results come out early.
+#define BATCH_SIZE ((size_t)(64 * 1024))
+
+/* Worst case output of a batch. Each result line is the code, the separator, the master part and the newline.
+* The code and the two terminators fit in twice the input (+2 for an unterminated last line). A master part is
+* added only for a code with at least MIN_STRING_LENGTH chars, so there are at most BATCH_SIZE / MIN_STRING_LENGTH of them.
+*/
+#define BATCH_OUTPUT_SIZE (2 * BATCH_SIZE + 2 + (BATCH_SIZE / MIN_STRING_LENGTH) * MAX_STRING_LENGTH)
+
+// Lines resolved together, their lookups are prefetched in groups. See processor_write_matches.
+#define LOOKUP_BATCH_SIZE ((size_t)64)
+
+// More than one batch in flight per thread, so the reader and the writer don't stall the matchers.
+#define BATCHES_PER_THREAD ((size_t)2)
+#define MIN_BATCHES ((size_t)4)
+
+/* The batches form a ring. The reader fills a free batch and submits it to the pool. The writer waits for
+* the batches in submission order, writes them out and frees them for the reader. So the output is in input order,
+* and the memory is bounded by the ring, regardless of the input size.
+* The writer runs pool tasks while it waits for a batch, so it helps with the matching.
+*/
+typedef enum BatchState {
+    BATCH_FREE,
+    BATCH_SUBMITTED,
+} BatchState;
+
+typedef struct Batch {
+    const SourceData *data;
+    char *input;                        // Complete lines only, the partial last line is carried to the next batch
+    size_t inputLength;
+    char *output;
+    size_t outputLength;
+    size_t matchCount;
+    TaskGroup group;
+    BatchState state;
+} Batch;
+
+typedef struct Pipeline {
+    Batch *batches;
+    size_t batchCount;
+    size_t submittedCount;              // Total batches submitted so far. Batch i is in slot i % batchCount.
+    bool inputDone;
+    FILE *output;
+    bool writeFailed;
+    size_t matchCount;
+    thread_mutex_t mutex;
+    thread_cond_t changed;
+} Pipeline;
+
+static thread_ret_t match_batch(thread_arg_t arg) {
+    Batch *batch = (Batch *)arg;
+    PhaseTimer timer = stats_phase_begin();
+    const char *line = batch->input;
+    const char *end = batch->input + batch->inputLength;
+    size_t outputLength = 0;
+    size_t countByRule[MATCH_RULE_COUNT] = { 0 };
+    size_t count = 0;
+
+    const char *codes[LOOKUP_BATCH_SIZE];
+    size_t codeLengths[LOOKUP_BATCH_SIZE];
+    MatchRule rules[LOOKUP_BATCH_SIZE];
+    while (line < end) {
+        size_t codeCount = 0;
+        while (line < end && codeCount < LOOKUP_BATCH_SIZE) {
+            line = str_read_line(line, end, &codes[codeCount], &codeLengths[codeCount]);
+            codeCount++;
+        }
+        outputLength += processor_write_matches(batch->data, codes, codeLengths, codeCount, batch->output + outputLength, rules);
+        for (size_t i = 0; i < codeCount; i++) {
+            countByRule[rules[i]]++;
+        }
+        count += codeCount;
+    }
+
+    batch->outputLength = outputLength;
+    batch->matchCount = count - countByRule[MATCH_NONE];
+    stats_add_rule_hits(countByRule);
+    stats_phase_end(STATS_PHASE_LOOKUP, timer);
+    return 0;
+}
+
+static thread_ret_t write_batches(thread_arg_t arg) {
+    Pipeline *pipeline = (Pipeline *)arg;
+
+    for (size_t index = 0;; index++) {
+        Batch *batch = &pipeline->batches[index % pipeline->batchCount];
+
+        thread_mutex_lock(&pipeline->mutex);
+        while (index >= pipeline->submittedCount && !pipeline->inputDone) {
+            thread_cond_wait(&pipeline->changed, &pipeline->mutex);
+        }
+        bool done = index >= pipeline->submittedCount;
+        thread_mutex_unlock(&pipeline->mutex);
+        if (done) {
+            break;
+        }
+
+        thread_pool_wait(&batch->group);
+        PhaseTimer timer = stats_phase_begin();
+        if (!pipeline->writeFailed) {
+            // Flushed per batch, so a consumer reading from a pipe gets the results as they're produced.
+            pipeline->writeFailed = fwrite(batch->output, 1, batch->outputLength, pipeline->output) != batch->outputLength
+                || fflush(pipeline->output) != 0;
+        }
+        stats_phase_end(STATS_PHASE_WRITE, timer);
+        pipeline->matchCount += batch->matchCount;
+
+        thread_mutex_lock(&pipeline->mutex);
+        batch->state = BATCH_FREE;
+        thread_cond_broadcast(&pipeline->changed);
+        thread_mutex_unlock(&pipeline->mutex);
+    }
+    return 0;
+}
+
+static const char *find_last_newline(const char *start, const char *end) {
+    for (const char *current = end; current > start; current--) {
+        if (current[-1] == '\n') {
+            return current - 1;
+        }
+    }
+    return NULL;
+}
+
+static FILE *open_file(const char *path, const char *mode, FILE *standardFile) {
+    if (strcmp(path, "-") == 0) {
+        return standardFile;
+    }
+    FILE *file = fopen(path, mode);
+    if (!file) {
+        fprintf(stderr, "Failed to open file: %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return file;
+}
+
+size_t stream_run(const char *partsPath, const char *resultsPath, const SourceData *data) {
+    FILE *input = open_file(partsPath, "rb", stdin);
+    FILE *output = open_file(resultsPath, "w", stdout);
+
+    Pipeline pipeline = { 0 };
+    pipeline.output = output;
+    pipeline.batchCount = thread_pool_concurrency() * BATCHES_PER_THREAD;
+    if (pipeline.batchCount < MIN_BATCHES) {
+        pipeline.batchCount = MIN_BATCHES;
+    }
+    thread_mutex_init(&pipeline.mutex);
+    thread_cond_init(&pipeline.changed);
+
+    // The buffers are needed only while streaming.
+    Arena *arena = arena_create();
+    pipeline.batches = arena_alloc(arena, pipeline.batchCount * sizeof(*pipeline.batches));
+    CHECK_ALLOC(pipeline.batches);
+    for (size_t i = 0; i < pipeline.batchCount; i++) {
+        Batch *batch = &pipeline.batches[i];
+        *batch = (Batch){ .data = data, .state = BATCH_FREE };
+        batch->input = arena_alloc(arena, BATCH_SIZE);
+        CHECK_ALLOC(batch->input);
+        batch->output = arena_alloc(arena, BATCH_OUTPUT_SIZE);
+        CHECK_ALLOC(batch->output);
+    }
+
+    thread_t writer;
+    if (create_thread(&writer, write_batches, &pipeline) != 0) {
+        fprintf(stderr, "Error creating writer thread\n");
+        exit(EXIT_FAILURE);
+    }
+
+    const char *carry = NULL;
+    size_t carryLength = 0;
+    for (size_t index = 0;; index++) {
+        Batch *batch = &pipeline.batches[index % pipeline.batchCount];
+
+        thread_mutex_lock(&pipeline.mutex);
+        while (batch->state != BATCH_FREE) {
+            thread_cond_wait(&pipeline.changed, &pipeline.mutex);
+        }
+        thread_mutex_unlock(&pipeline.mutex);
+
+        // The carried partial line is past the end of the previous batch, its matcher never reads it.
+        if (carryLength > 0) {
+            memcpy(batch->input, carry, carryLength);
+        }
+        PhaseTimer timer = stats_phase_begin();
+        size_t readLength = fread(batch->input + carryLength, 1, BATCH_SIZE - carryLength, input);
+        stats_phase_end(STATS_PHASE_READ_PARTS, timer);
+        if (ferror(input)) {
+            fprintf(stderr, "Failed to read file: %s\n", partsPath);
+            exit(EXIT_FAILURE);
+        }
+        size_t length = carryLength + readLength;
+        if (length == 0) {
+            break;
+        }
+
+        // fread returns less than requested only at the end of the input, then the last line goes in as is.
+        // A line longer than a whole batch has no newline to split at, so it's split at the batch end.
+        const char *lastNewline = find_last_newline(batch->input, batch->input + length);
+        bool endOfInput = readLength < BATCH_SIZE - carryLength;
+        batch->inputLength = endOfInput || lastNewline == NULL ? length : (size_t)(lastNewline - batch->input) + 1;
+        carry = batch->input + batch->inputLength;
+        carryLength = length - batch->inputLength;
+
+        thread_pool_submit(&batch->group, match_batch, batch);
+        thread_mutex_lock(&pipeline.mutex);
+        batch->state = BATCH_SUBMITTED;
+        pipeline.submittedCount++;
+        thread_cond_broadcast(&pipeline.changed);
+        thread_mutex_unlock(&pipeline.mutex);
+
+        if (endOfInput) {
+            break;
+        }
+    }
+
+    thread_mutex_lock(&pipeline.mutex);
+    pipeline.inputDone = true;
+    thread_cond_broadcast(&pipeline.changed);
+    thread_mutex_unlock(&pipeline.mutex);
+    join_thread(writer, NULL);
+
+    if (input != stdin) {
+        fclose(input);
+    }
+    if (pipeline.writeFailed || (output != stdout && fclose(output) != 0)) {
+        fprintf(stderr, "Failed to write file: %s\n", resultsPath);
+        exit(EXIT_FAILURE);
+    }
+
+    thread_cond_destroy(&pipeline.changed);
+    thread_mutex_destroy(&pipeline.mutex);
+    arena_destroy(arena);
+    return pipeline.matchCount;
+}
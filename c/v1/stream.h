@@ -0,0 +1,14 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include "source_data.h"
+
+/* Streams the parts through the matcher in fixed-size batches, with memory bounded by the batches in flight.
+* A reader fills the batches, the pool matches them, and a writer emits the results in input order.
+* Output starts as soon as the first batch is matched, before the input is fully read.
+* Use "-" for stdin/stdout. The processor must be initialized with the master parts and no parts.
+* Returns the number of matches.
+*/
+size_t stream_run(const char *partsPath, const char *resultsPath, const SourceData *data);
+
+#endif
@@ -0,0 +1,350 @@
+#include <string.h>
+#include <stdint.h>
+#include "string_utils.h"
+
+/* Fati Iseni
+* DO NOT use these implementations for general purpose stuff.
+* They're tailored for our scenario (ASCII records) and they're safe to use only within this context.
+*/
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define STRING_UTILS_X86 1
+#endif
+
+static inline char to_upper_char(char c) {
+    return (unsigned int)(c - 97) <= 25 // 25 = 122 - 97
+        ? c & 0x5F
+        : c;
+}
+
+/* Scalar */
+
+static const char *find_char_scalar(const char *start, const char *end, char c) {
+    const char *p = memchr(start, c, end - start);
+    return p ? p : end;
+}
+
+static const char *find_not_char_scalar(const char *start, const char *end, char c) {
+    while (start < end && *start == c) {
+        start++;
+    }
+    return start;
+}
+
+static const char *rfind_not_char_scalar(const char *start, const char *end, char c) {
+    while (end > start && end[-1] == c) {
+        end--;
+    }
+    return end;
+}
+
+static size_t count_char_scalar(const char *start, const char *end, char c) {
+    size_t count = 0;
+    for (const char *p = start; (p = memchr(p, c, end - p)) != NULL; p++) {
+        count++;
+    }
+    return count;
+}
+
+static void to_upper_scalar(const char *src, size_t length, char *dst) {
+    for (size_t i = 0; i < length; i++) {
+        dst[i] = to_upper_char(src[i]);
+    }
+}
+
+static size_t remove_char_scalar(const char *src, size_t length, char c, char *dst) {
+    size_t j = 0;
+    for (size_t i = 0; i < length; i++) {
+        if (src[i] != c) {
+            dst[j++] = src[i];
+        }
+    }
+    return j;
+}
+
+#ifdef STRING_UTILS_X86
+
+#include <immintrin.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TARGET_AVX2
+static inline unsigned int trailing_zeros(uint32_t mask) {
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (unsigned int)index;
+}
+static inline unsigned int leading_zeros(uint32_t mask) {
+    unsigned long index;
+    _BitScanReverse(&index, mask);
+    return 31 - (unsigned int)index;
+}
+#else
+#define TARGET_AVX2 __attribute__((target("avx2")))
+static inline unsigned int trailing_zeros(uint32_t mask) {
+    return (unsigned int)__builtin_ctz(mask);
+}
+static inline unsigned int leading_zeros(uint32_t mask) {
+    return (unsigned int)__builtin_clz(mask);
+}
+#endif
+
+/* SSE2
+* Each block is compared against the char, and the movemask gives one bit per byte.
+* The position of the first (or last) set bit is the position of the match.
+*/
+
+static const char *find_char_sse2(const char *start, const char *end, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    const char *p = start;
+    for (; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)p);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask) {
+            return p + trailing_zeros(mask);
+        }
+    }
+    for (; p < end; p++) {
+        if (*p == c) return p;
+    }
+    return end;
+}
+
+static const char *find_not_char_sse2(const char *start, const char *end, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    const char *p = start;
+    for (; end - p >= 16; p += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)p);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)) ^ 0xFFFF;
+        if (mask) {
+            return p + trailing_zeros(mask);
+        }
+    }
+    return find_not_char_scalar(p, end, c);
+}
+
+static const char *rfind_not_char_sse2(const char *start, const char *end, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    const char *p = end;
+    for (; p - start >= 16; p -= 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(p - 16));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)) ^ 0xFFFF;
+        if (mask) {
+            return p - 16 + (32 - leading_zeros(mask));
+        }
+    }
+    return rfind_not_char_scalar(start, p, c);
+}
+
+static size_t count_char_sse2(const char *start, const char *end, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    const __m128i zero = _mm_setzero_si128();
+    size_t count = 0;
+    const char *p = start;
+    while (end - p >= 16) {
+        // Each matching byte subtracts 1 (0xFF) from its lane. A lane overflows after 255 blocks,
+        // so we flush the lanes into the total with a sum of absolute differences before that.
+        __m128i counters = zero;
+        for (int i = 0; i < 255 && end - p >= 16; i++, p += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i *)p);
+            counters = _mm_sub_epi8(counters, _mm_cmpeq_epi8(block, needle));
+        }
+        __m128i sums = _mm_sad_epu8(counters, zero);
+        count += (size_t)_mm_cvtsi128_si32(sums) + (size_t)_mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+    }
+    for (; p < end; p++) {
+        count += *p == c;
+    }
+    return count;
+}
+
+static void to_upper_sse2(const char *src, size_t length, char *dst) {
+    const __m128i lowerBound = _mm_set1_epi8('a' - 1);
+    const __m128i upperBound = _mm_set1_epi8('z' + 1);
+    const __m128i caseBit = _mm_set1_epi8(0x20);
+    size_t i = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(src + i));
+        // Non-ASCII bytes are negative as signed chars, so they're never in the range.
+        __m128i isLower = _mm_and_si128(_mm_cmpgt_epi8(block, lowerBound), _mm_cmplt_epi8(block, upperBound));
+        block = _mm_sub_epi8(block, _mm_and_si128(isLower, caseBit));
+        _mm_storeu_si128((__m128i *)(dst + i), block);
+    }
+    to_upper_scalar(src + i, length - i, dst + i);
+}
+
+static size_t remove_char_sse2(const char *src, size_t length, char c, char *dst) {
+    const __m128i needle = _mm_set1_epi8(c);
+    size_t i = 0;
+    size_t j = 0;
+    for (; i + 16 <= length; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i *)(src + i));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+        if (mask == 0) {
+            // Since j <= i, the whole block fits within the destination length.
+            _mm_storeu_si128((__m128i *)(dst + j), block);
+            j += 16;
+        }
+        else {
+            j += remove_char_scalar(src + i, 16, c, dst + j);
+        }
+    }
+    return j + remove_char_scalar(src + i, length - i, c, dst + j);
+}
+
+/* AVX2
+* Same as SSE2, with 32-byte blocks. The tail is handled by the SSE2 kernel.
+* The SSE2 kernels are not VEX-encoded, so we clear the upper halves of the YMM registers before calling them.
+* Otherwise, every call pays the AVX-SSE transition penalty, which costs more than the whole kernel for short records.
+*/
+
+TARGET_AVX2 static const char *find_char_avx2(const char *start, const char *end, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    const char *p = start;
+    for (; end - p >= 32; p += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)p);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (mask) {
+            return p + trailing_zeros(mask);
+        }
+    }
+    _mm256_zeroupper();
+    return find_char_sse2(p, end, c);
+}
+
+TARGET_AVX2 static const char *find_not_char_avx2(const char *start, const char *end, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    const char *p = start;
+    for (; end - p >= 32; p += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)p);
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (mask) {
+            return p + trailing_zeros(mask);
+        }
+    }
+    _mm256_zeroupper();
+    return find_not_char_sse2(p, end, c);
+}
+
+TARGET_AVX2 static const char *rfind_not_char_avx2(const char *start, const char *end, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    const char *p = end;
+    for (; p - start >= 32; p -= 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(p - 32));
+        uint32_t mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (mask) {
+            return p - 32 + (32 - leading_zeros(mask));
+        }
+    }
+    _mm256_zeroupper();
+    return rfind_not_char_sse2(start, p, c);
+}
+
+TARGET_AVX2 static size_t count_char_avx2(const char *start, const char *end, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t count = 0;
+    const char *p = start;
+    while (end - p >= 32) {
+        __m256i counters = zero;
+        for (int i = 0; i < 255 && end - p >= 32; i++, p += 32) {
+            __m256i block = _mm256_loadu_si256((const __m256i *)p);
+            counters = _mm256_sub_epi8(counters, _mm256_cmpeq_epi8(block, needle));
+        }
+        __m256i sums = _mm256_sad_epu8(counters, zero);
+        count += (size_t)_mm256_extract_epi64(sums, 0) + (size_t)_mm256_extract_epi64(sums, 1)
+            + (size_t)_mm256_extract_epi64(sums, 2) + (size_t)_mm256_extract_epi64(sums, 3);
+    }
+    _mm256_zeroupper();
+    return count + count_char_sse2(p, end, c);
+}
+
+TARGET_AVX2 static void to_upper_avx2(const char *src, size_t length, char *dst) {
+    const __m256i lowerBound = _mm256_set1_epi8('a' - 1);
+    const __m256i upperBound = _mm256_set1_epi8('z' + 1);
+    const __m256i caseBit = _mm256_set1_epi8(0x20);
+    size_t i = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i isLower = _mm256_and_si256(_mm256_cmpgt_epi8(block, lowerBound), _mm256_cmpgt_epi8(upperBound, block));
+        block = _mm256_sub_epi8(block, _mm256_and_si256(isLower, caseBit));
+        _mm256_storeu_si256((__m256i *)(dst + i), block);
+    }
+    _mm256_zeroupper();
+    to_upper_sse2(src + i, length - i, dst + i);
+}
+
+TARGET_AVX2 static size_t remove_char_avx2(const char *src, size_t length, char c, char *dst) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t i = 0;
+    size_t j = 0;
+    for (; i + 32 <= length; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(src + i));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+        if (mask == 0) {
+            _mm256_storeu_si256((__m256i *)(dst + j), block);
+            j += 32;
+        }
+        else {
+            j += remove_char_scalar(src + i, 32, c, dst + j);
+        }
+    }
+    _mm256_zeroupper();
+    return j + remove_char_sse2(src + i, length - i, c, dst + j);
+}
+
+static int cpu_supports_avx2(void) {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return 0;
+    __cpuid(info, 1);
+    // OSXSAVE and AVX, and the OS saves the YMM registers.
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0) return 0;
+    if ((_xgetbv(0) & 0x6) != 0x6) return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+StringKernels str_kernels = {
+    .find_char = find_char_scalar,
+    .find_not_char = find_not_char_scalar,
+    .rfind_not_char = rfind_not_char_scalar,
+    .count_char = count_char_scalar,
+    .to_upper = to_upper_scalar,
+    .remove_char = remove_char_scalar,
+    .name = "scalar",
+};
+
+void string_kernels_init(void) {
+#ifdef STRING_UTILS_X86
+    // SSE2 is part of the x86-64 baseline.
+    str_kernels = (StringKernels){
+        .find_char = find_char_sse2,
+        .find_not_char = find_not_char_sse2,
+        .rfind_not_char = rfind_not_char_sse2,
+        .count_char = count_char_sse2,
+        .to_upper = to_upper_sse2,
+        .remove_char = remove_char_sse2,
+        .name = "sse2",
+    };
+
+    if (cpu_supports_avx2()) {
+        str_kernels = (StringKernels){
+            .find_char = find_char_avx2,
+            .find_not_char = find_not_char_avx2,
+            .rfind_not_char = rfind_not_char_avx2,
+            .count_char = count_char_avx2,
+            .to_upper = to_upper_avx2,
+            .remove_char = remove_char_avx2,
+            .name = "avx2",
+        };
+    }
+#endif
+}
@@ -0,0 +1,38 @@
+#ifndef STRING_UTILS_H
+#define STRING_UTILS_H
+
+#include <stdlib.h>
+
+/* String kernels used for parsing. Each one has a scalar, an SSE2 and an AVX2 implementation.
+* The best one supported by the CPU is picked at startup, so the same build runs on any x86-64 machine.
+* Other architectures use the scalar versions.
+* All kernels read only within [src, src + length), there is no over-read past the end.
+*/
+typedef struct StringKernels {
+    // Returns the first occurrence of c, or end if not found.
+    const char *(*find_char)(const char *start, const char *end, char c);
+
+    // Returns the first char that is not c, or end if none.
+    const char *(*find_not_char)(const char *start, const char *end, char c);
+
+    // Returns the position after the last char that is not c, or start if none.
+    const char *(*rfind_not_char)(const char *start, const char *end, char c);
+
+    size_t (*count_char)(const char *start, const char *end, char c);
+
+    // The destination must have space for length chars. It's not null-terminated.
+    void (*to_upper)(const char *src, size_t length, char *dst);
+
+    // Copies the source without the c chars and returns the copied length. It's not null-terminated.
+    size_t (*remove_char)(const char *src, size_t length, char c, char *dst);
+
+    const char *name;
+} StringKernels;
+
+// Defaults to the scalar kernels until string_kernels_init is called.
+extern StringKernels str_kernels;
+
+// This will be called at startup on the main thread.
+void string_kernels_init(void);
+
+#endif
@@ -0,0 +1,294 @@
+#include <string.h>
+#include "allocator.h"
+#include "common.h"
+#include "thread_utils.h"
+#include "suffix_index.h"
+
+#define BUCKET_COUNT ((size_t)1 << 16)
+
+// The byte buckets of the radix sort. Bucket 0 is for the codes that end before the sorted position, so the shorter codes come first.
+#define BYTE_BUCKET_COUNT ((size_t)UINT8_MAX + 2)
+
+// Below this many records, the counting passes of the radix sort cost more than comparing the codes.
+#define INSERTION_SORT_THRESHOLD ((size_t)32)
+
+// The range minimum is scanned within the blocks at the edges of a range, and taken from the sparse table in between.
+#define RMQ_BLOCK_SIZE ((size_t)64)
+
+// Below this many records per chunk, the task overhead outweighs the sorting work.
+#define MIN_RECORDS_PER_SORT_CHUNK ((size_t)16384)
+
+typedef struct SortChunkArgs {
+    SuffixIndex *index;
+    uint32_t *scratch;
+    size_t startBucket;
+    size_t endBucket;
+} SortChunkArgs;
+
+static inline const char *code_end(const Records *records, size_t position) {
+    return records_code(records, position) + records_length(records, position);
+}
+
+// The two bytes the codes are bucketed by, from the end of the code.
+static inline size_t bucket_of(const char *end) {
+    return ((size_t)(unsigned char)end[-1] << 8) | (size_t)(unsigned char)end[-2];
+}
+
+// The byte at the given distance from the end, shifted by one, or 0 if the code is shorter.
+static inline size_t byte_bucket_of(const Records *records, size_t position, size_t depth) {
+    size_t length = records_length(records, position);
+    return depth < length ? (size_t)(unsigned char)*(code_end(records, position) - 1 - depth) + 1 : 0;
+}
+
+// Compares the codes backwards from their ends, starting at the given depth. The one that runs out first is the smaller one.
+static inline int compare_reversed(const char *aEnd, size_t aLength, const char *bEnd, size_t bLength, size_t depth) {
+    size_t length = aLength < bLength ? aLength : bLength;
+    for (size_t i = depth; i < length; i++) {
+        unsigned char a = (unsigned char)*(aEnd - 1 - i);
+        unsigned char b = (unsigned char)*(bEnd - 1 - i);
+        if (a != b) {
+            return a < b ? -1 : 1;
+        }
+    }
+    return aLength < bLength ? -1 : aLength > bLength ? 1 : 0;
+}
+
+static void insertion_sort(const Records *records, uint32_t *order, size_t count, size_t depth) {
+    for (size_t i = 1; i < count; i++) {
+        uint32_t position = order[i];
+        const char *end = code_end(records, position);
+        size_t length = records_length(records, position);
+        size_t j = i;
+        while (j > 0 && compare_reversed(code_end(records, order[j - 1]), records_length(records, order[j - 1]), end, length, depth) > 0) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = position;
+    }
+}
+
+// MSD radix sort, the codes in the range are equal up to the depth. The codes are shorter than MAX_STRING_LENGTH, that bounds the recursion.
+static void sort_range(const Records *records, uint32_t *order, uint32_t *scratch, size_t count, size_t depth) {
+    if (count <= INSERTION_SORT_THRESHOLD) {
+        insertion_sort(records, order, count, depth);
+        return;
+    }
+
+    size_t starts[BYTE_BUCKET_COUNT + 1] = { 0 };
+    for (size_t i = 0; i < count; i++) {
+        starts[byte_bucket_of(records, order[i], depth) + 1]++;
+    }
+    for (size_t bucket = 0; bucket < BYTE_BUCKET_COUNT; bucket++) {
+        starts[bucket + 1] += starts[bucket];
+    }
+
+    size_t next[BYTE_BUCKET_COUNT];
+    memcpy(next, starts, sizeof(next));
+    for (size_t i = 0; i < count; i++) {
+        scratch[next[byte_bucket_of(records, order[i], depth)]++] = order[i];
+    }
+    memcpy(order, scratch, count * sizeof(*order));
+
+    // The codes in bucket 0 all ended, they're equal.
+    for (size_t bucket = 1; bucket < BYTE_BUCKET_COUNT; bucket++) {
+        size_t bucketCount = starts[bucket + 1] - starts[bucket];
+        if (bucketCount > 1) {
+            sort_range(records, order + starts[bucket], scratch, bucketCount, depth + 1);
+        }
+    }
+}
+
+static thread_ret_t sort_buckets(thread_arg_t arg) {
+    SortChunkArgs *args = (SortChunkArgs *)arg;
+    SuffixIndex *index = args->index;
+    for (size_t bucket = args->startBucket; bucket < args->endBucket; bucket++) {
+        size_t start = index->bucketStarts[bucket];
+        size_t count = index->bucketStarts[bucket + 1] - start;
+        if (count > 1) {
+            sort_range(&index->records, index->order + start, args->scratch + start, count, 2);
+        }
+    }
+    return 0;
+}
+
+// The codes are first bucketed by their last two bytes with a counting sort, the buckets are then sorted in parallel.
+static void sort_records(SuffixIndex *index) {
+    const Records *records = &index->records;
+    size_t count = records->count;
+
+    index->bucketStarts = allocator_alloc((BUCKET_COUNT + 1) * sizeof(*index->bucketStarts));
+    CHECK_ALLOC(index->bucketStarts);
+    memset(index->bucketStarts, 0, (BUCKET_COUNT + 1) * sizeof(*index->bucketStarts));
+    for (size_t i = 0; i < count; i++) {
+        index->bucketStarts[bucket_of(code_end(records, i)) + 1]++;
+    }
+    for (size_t bucket = 0; bucket < BUCKET_COUNT; bucket++) {
+        index->bucketStarts[bucket + 1] += index->bucketStarts[bucket];
+    }
+
+    // The scratch is needed only while sorting.
+    Arena *arena = arena_create();
+    uint32_t *next = arena_alloc(arena, BUCKET_COUNT * sizeof(*next));
+    uint32_t *scratch = arena_alloc(arena, (count > 0 ? count : 1) * sizeof(*scratch));
+    CHECK_ALLOC(next);
+    CHECK_ALLOC(scratch);
+    memcpy(next, index->bucketStarts, BUCKET_COUNT * sizeof(*next));
+    for (size_t i = 0; i < count; i++) {
+        index->order[next[bucket_of(code_end(records, i))]++] = (uint32_t)i;
+    }
+
+    size_t chunkCount = thread_pool_concurrency();
+    if (chunkCount > count / MIN_RECORDS_PER_SORT_CHUNK) {
+        chunkCount = count / MIN_RECORDS_PER_SORT_CHUNK;
+    }
+    if (chunkCount == 0) {
+        chunkCount = 1;
+    }
+    SortChunkArgs *chunks = arena_alloc(arena, chunkCount * sizeof(*chunks));
+    CHECK_ALLOC(chunks);
+
+    // The chunks get about the same number of records, the buckets are far from even.
+    TaskGroup group = { 0 };
+    size_t startBucket = 0;
+    for (size_t i = 0; i < chunkCount; i++) {
+        size_t endBucket = startBucket;
+        size_t endRecord = i == chunkCount - 1 ? count : (i + 1) * (count / chunkCount);
+        while (endBucket < BUCKET_COUNT && (i == chunkCount - 1 || index->bucketStarts[endBucket] < endRecord)) {
+            endBucket++;
+        }
+        chunks[i] = (SortChunkArgs){ .index = index, .scratch = scratch, .startBucket = startBucket, .endBucket = endBucket };
+        thread_pool_submit(&group, sort_buckets, &chunks[i]);
+        startBucket = endBucket;
+    }
+    thread_pool_wait(&group);
+    arena_destroy(arena);
+}
+
+static inline size_t floor_log2(size_t value) {
+    size_t log = 0;
+    while (value >>= 1) {
+        log++;
+    }
+    return log;
+}
+
+static void build_block_mins(SuffixIndex *index) {
+    size_t count = index->records.count;
+    index->blockCount = (count + RMQ_BLOCK_SIZE - 1) / RMQ_BLOCK_SIZE;
+    index->levelCount = index->blockCount > 0 ? floor_log2(index->blockCount) + 1 : 0;
+    index->blockMins = allocator_alloc((index->blockCount * index->levelCount + 1) * sizeof(*index->blockMins));
+    CHECK_ALLOC(index->blockMins);
+
+    uint32_t *level = index->blockMins;
+    for (size_t block = 0; block < index->blockCount; block++) {
+        size_t end = (block + 1) * RMQ_BLOCK_SIZE < count ? (block + 1) * RMQ_BLOCK_SIZE : count;
+        uint32_t min = UINT32_MAX;
+        for (size_t i = block * RMQ_BLOCK_SIZE; i < end; i++) {
+            min = index->order[i] < min ? index->order[i] : min;
+        }
+        level[block] = min;
+    }
+    // Level k has the minimum of the 2^k blocks starting at each block.
+    for (size_t k = 1; k < index->levelCount; k++) {
+        const uint32_t *previous = level;
+        level += index->blockCount;
+        size_t half = (size_t)1 << (k - 1);
+        for (size_t block = 0; block + ((size_t)1 << k) <= index->blockCount; block++) {
+            level[block] = previous[block] < previous[block + half] ? previous[block] : previous[block + half];
+        }
+    }
+}
+
+static inline uint32_t scan_min(const uint32_t *order, size_t start, size_t end, uint32_t min) {
+    for (size_t i = start; i < end; i++) {
+        min = order[i] < min ? order[i] : min;
+    }
+    return min;
+}
+
+static uint32_t range_min(const SuffixIndex *index, size_t start, size_t end) {
+    size_t firstBlock = (start + RMQ_BLOCK_SIZE - 1) / RMQ_BLOCK_SIZE;
+    size_t endBlock = end / RMQ_BLOCK_SIZE;
+    if (firstBlock >= endBlock) {
+        return scan_min(index->order, start, end, UINT32_MAX);
+    }
+
+    uint32_t min = scan_min(index->order, start, firstBlock * RMQ_BLOCK_SIZE, UINT32_MAX);
+    min = scan_min(index->order, endBlock * RMQ_BLOCK_SIZE, end, min);
+
+    // Two overlapping runs of 2^k blocks cover the full blocks.
+    size_t k = floor_log2(endBlock - firstBlock);
+    const uint32_t *level = index->blockMins + k * index->blockCount;
+    uint32_t blocksMin = level[firstBlock] < level[endBlock - ((size_t)1 << k)] ? level[firstBlock] : level[endBlock - ((size_t)1 << k)];
+    return blocksMin < min ? blocksMin : min;
+}
+
+SuffixIndex *suffix_index_create(const Records *records) {
+    assert(records->count <= UINT32_MAX);
+
+    SuffixIndex *index = allocator_alloc(sizeof(*index));
+    CHECK_ALLOC(index);
+    index->records = *records;
+    index->order = allocator_alloc((records->count > 0 ? records->count : 1) * sizeof(*index->order));
+    CHECK_ALLOC(index->order);
+
+    sort_records(index);
+    build_block_mins(index);
+    return index;
+}
+
+bool suffix_index_find(const SuffixIndex *index, const char *key, size_t keyLength, size_t *outIndex) {
+    const Records *records = &index->records;
+    const char *keyEnd = key + keyLength;
+    size_t bucket = bucket_of(keyEnd);
+    size_t low = index->bucketStarts[bucket];
+    size_t high = index->bucketStarts[bucket + 1];
+
+    // The codes are compared only up to the key length, the ones that end with the key compare equal.
+    // First the lower bound of the range, then its upper bound, in what's left after the lower one.
+    size_t end = high;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        size_t length = records_length(records, index->order[middle]);
+        if (compare_reversed(code_end(records, index->order[middle]), length < keyLength ? length : keyLength, keyEnd, keyLength, 2) < 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    size_t start = low;
+    high = end;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        size_t length = records_length(records, index->order[middle]);
+        if (compare_reversed(code_end(records, index->order[middle]), length < keyLength ? length : keyLength, keyEnd, keyLength, 2) <= 0) {
+            low = middle + 1;
+        }
+        else {
+            high = middle;
+        }
+    }
+    if (start == low) {
+        return false;
+    }
+
+    *outIndex = records_index(records, range_min(index, start, low));
+    return true;
+}
+
+size_t suffix_index_size(const SuffixIndex *index) {
+    return sizeof(*index)
+        + index->records.count * sizeof(*index->order)
+        + (BUCKET_COUNT + 1) * sizeof(*index->bucketStarts)
+        + (index->blockCount * index->levelCount + 1) * sizeof(*index->blockMins);
+}
+
+void suffix_index_free(SuffixIndex *index) {
+    if (index) {
+        free(index->order);
+        free(index->bucketStarts);
+        free(index->blockMins);
+        free(index);
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef SUFFIX_INDEX_H
+#define SUFFIX_INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "source_data.h"
+
+/* The records sorted by their reversed codes, an alternative to the per-length suffix tables.
+* The codes that end with a given key are then a contiguous range, found with two binary searches.
+* The index stores only positions into the records, about 5 bytes per record, whatever the length of the codes.
+* The suffix tables need an entry for every suffix of every code, so they grow with the count times the mean length.
+*
+* The records must be sorted by length, then in file order (masterPartsAsc, masterPartsNhAsc).
+* So the lowest position in a range is the shortest code, and the first one in the file on ties.
+* That's the same master part the suffix tables keep, it's found with a range minimum query.
+*/
+typedef struct SuffixIndex {
+    Records records;                    // Not owned, the index only points into them.
+    uint32_t *order;                    // Positions in the records, sorted by the reversed codes
+    uint32_t *bucketStarts;             // Start in order of the codes that end with each pair of bytes, by (last << 8 | second to last)
+    uint32_t *blockMins;                // Sparse table over the minimum of each block of order, levelCount levels of blockCount entries
+    size_t blockCount;
+    size_t levelCount;
+} SuffixIndex;
+
+// The records are sorted in parallel on the thread pool. It waits for its own tasks, so it can be called from a task.
+SuffixIndex *suffix_index_create(const Records *records);
+
+// Finds the shortest code that ends with the key, the first one in the file on ties. The key is compared as is.
+// Returns the original index of the record, same as the values of the suffix tables. The key has at least MIN_STRING_LENGTH chars.
+bool suffix_index_find(const SuffixIndex *index, const char *key, size_t keyLength, size_t *outIndex);
+
+// Bytes allocated by the index, the records excluded. Meant for reporting only, see stats.c.
+size_t suffix_index_size(const SuffixIndex *index);
+void suffix_index_free(SuffixIndex *index);
+
+#endif
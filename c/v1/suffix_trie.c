@@ -0,0 +1,238 @@
+#include <string.h>
+#include "allocator.h"
+#include "common.h"
+#include "thread_utils.h"
+#include "suffix_trie.h"
+
+#define NO_VALUE UINT32_MAX
+
+// The top levels are built first, the subtrees below them in parallel.
+#define TOP_DEPTH ((size_t)2)
+#define TOP_NODE_CAPACITY ((size_t)1 + 256 + 256 * 256)
+
+// Below this many records per chunk, the task overhead outweighs the building work.
+#define MIN_RECORDS_PER_TRIE_CHUNK ((size_t)16384)
+
+typedef struct TrieBuild {
+    const Records *records;
+    const uint32_t *order;
+    TrieNode *nodes;
+    uint8_t *firstBytes;
+} TrieBuild;
+
+// A node at TOP_DEPTH or below, its subtree is built by a task into its own region of the nodes.
+typedef struct Subtree {
+    uint32_t node;
+    uint32_t start;
+    uint32_t end;
+    uint32_t depth;
+    uint32_t regionStart;
+} Subtree;
+
+typedef struct SubtreeChunkArgs {
+    const TrieBuild *build;
+    const Subtree *subtrees;
+    size_t count;
+    size_t nodeCount;                   // Nodes created by the chunk
+} SubtreeChunkArgs;
+
+static inline const char *code_end(const Records *records, size_t position) {
+    return records_code(records, position) + records_length(records, position);
+}
+
+// Number of equal chars, backwards from the depth, until one of the codes runs out.
+static size_t common_length(const Records *records, size_t a, size_t b, size_t depth) {
+    const char *aEnd = code_end(records, a);
+    const char *bEnd = code_end(records, b);
+    size_t length = records_length(records, a) < records_length(records, b) ? records_length(records, a) : records_length(records, b);
+    size_t i = depth;
+    while (i < length && *(aEnd - 1 - i) == *(bEnd - 1 - i)) {
+        i++;
+    }
+    return i - depth;
+}
+
+/* Builds the node from its range of the sorted records, all of them share the reversed chars up to the depth.
+* The records that end at the node come first, the rest is split by the byte that follows the label.
+* The records of a child share the chars up to the common length of the first and the last one, since they're sorted.
+* All children are created before descending into them, so they're contiguous. Then it goes depth-first, while the records are still cached.
+* Every node below a node ends a code or branches, so a range of count records has less than 2 * count nodes below its node.
+* The nodes at TOP_DEPTH or below are only collected into the subtrees, if given.
+*/
+static void build_node(const TrieBuild *build, size_t node, size_t start, size_t end, size_t depth, size_t *nextNode, Subtree *subtrees, size_t *subtreeCount) {
+    const Records *records = build->records;
+    const uint32_t *order = build->order;
+    TrieNode *nodes = build->nodes;
+
+    if (subtrees && depth >= TOP_DEPTH) {
+        subtrees[(*subtreeCount)++] = (Subtree){ .node = (uint32_t)node, .start = (uint32_t)start, .end = (uint32_t)end, .depth = (uint32_t)depth };
+        return;
+    }
+
+    // The duplicates have the same length, the lowest position is the first one in the file.
+    uint32_t first = NO_VALUE;
+    while (start < end && records_length(records, order[start]) == depth) {
+        first = order[start] < first ? order[start] : first;
+        start++;
+    }
+    nodes[node].value = first == NO_VALUE ? NO_VALUE : (uint32_t)records_index(records, first);
+    nodes[node].firstChild = (uint32_t)*nextNode;
+
+    uint32_t groupEnds[UINT8_MAX + 1];
+    size_t childStart = start;
+    size_t childCount = 0;
+    while (start < end) {
+        const char *startEnd = code_end(records, order[start]);
+        char byte = *(startEnd - 1 - depth);
+        size_t groupEnd = start + 1;
+        while (groupEnd < end && *(code_end(records, order[groupEnd]) - 1 - depth) == byte) {
+            groupEnd++;
+        }
+        size_t child = (*nextNode)++;
+        nodes[child] = (TrieNode){
+            .labelEnd = (uint32_t)(startEnd - records->base - depth),
+            .value = NO_VALUE,
+            .labelLength = (uint8_t)(1 + common_length(records, order[start], order[groupEnd - 1], depth + 1)),
+        };
+        build->firstBytes[child] = (uint8_t)byte;
+        groupEnds[childCount++] = (uint32_t)groupEnd;
+        start = groupEnd;
+    }
+    nodes[node].childCount = (uint16_t)childCount;
+
+    for (size_t i = 0; i < childCount; i++) {
+        size_t child = nodes[node].firstChild + i;
+        build_node(build, child, childStart, groupEnds[i], depth + nodes[child].labelLength, nextNode, subtrees, subtreeCount);
+        childStart = groupEnds[i];
+    }
+}
+
+static thread_ret_t build_subtrees(thread_arg_t arg) {
+    SubtreeChunkArgs *args = (SubtreeChunkArgs *)arg;
+    for (size_t i = 0; i < args->count; i++) {
+        const Subtree *subtree = &args->subtrees[i];
+        size_t nextNode = subtree->regionStart;
+        build_node(args->build, subtree->node, subtree->start, subtree->end, subtree->depth, &nextNode, NULL, NULL);
+        args->nodeCount += nextNode - subtree->regionStart;
+    }
+    return 0;
+}
+
+/* The nodes are allocated at their upper bound and each subtree gets a region of its own, so the tasks never share a node.
+* The unused parts of the regions are never touched.
+*/
+SuffixTrie *suffix_trie_create(const Records *records, const uint32_t *order) {
+    size_t count = records->count;
+    size_t capacity = TOP_NODE_CAPACITY + 2 * count;
+    assert(capacity <= UINT32_MAX);
+
+    SuffixTrie *trie = allocator_alloc(sizeof(*trie));
+    CHECK_ALLOC(trie);
+    trie->base = records->base;
+    trie->nodes = allocator_alloc(capacity * sizeof(*trie->nodes));
+    trie->firstBytes = allocator_alloc(capacity * sizeof(*trie->firstBytes));
+    CHECK_ALLOC(trie->nodes);
+    CHECK_ALLOC(trie->firstBytes);
+
+    TrieBuild build = { .records = records, .order = order, .nodes = trie->nodes, .firstBytes = trie->firstBytes };
+    trie->nodes[0] = (TrieNode){ .value = NO_VALUE };
+    trie->firstBytes[0] = 0;
+
+    // The subtrees are needed only while building.
+    Arena *arena = arena_create();
+    Subtree *subtrees = arena_alloc(arena, TOP_NODE_CAPACITY * sizeof(*subtrees));
+    CHECK_ALLOC(subtrees);
+    size_t subtreeCount = 0;
+    size_t nextNode = 1;
+    build_node(&build, 0, 0, count, 0, &nextNode, subtrees, &subtreeCount);
+    trie->count = nextNode;
+
+    size_t regionStart = TOP_NODE_CAPACITY;
+    for (size_t i = 0; i < subtreeCount; i++) {
+        subtrees[i].regionStart = (uint32_t)regionStart;
+        regionStart += 2 * (size_t)(subtrees[i].end - subtrees[i].start);
+    }
+
+    size_t chunkCount = thread_pool_concurrency();
+    if (chunkCount > count / MIN_RECORDS_PER_TRIE_CHUNK) {
+        chunkCount = count / MIN_RECORDS_PER_TRIE_CHUNK;
+    }
+    if (chunkCount == 0) {
+        chunkCount = 1;
+    }
+    SubtreeChunkArgs *chunks = arena_alloc(arena, chunkCount * sizeof(*chunks));
+    CHECK_ALLOC(chunks);
+
+    // The chunks get about the same number of records, the subtrees are in the order of the records.
+    TaskGroup group = { 0 };
+    size_t startSubtree = 0;
+    for (size_t i = 0; i < chunkCount; i++) {
+        size_t endSubtree = startSubtree;
+        size_t endRecord = (i + 1) * (count / chunkCount);
+        while (endSubtree < subtreeCount && (i == chunkCount - 1 || subtrees[endSubtree].start < endRecord)) {
+            endSubtree++;
+        }
+        chunks[i] = (SubtreeChunkArgs){ .build = &build, .subtrees = subtrees + startSubtree, .count = endSubtree - startSubtree };
+        thread_pool_submit(&group, build_subtrees, &chunks[i]);
+        startSubtree = endSubtree;
+    }
+    thread_pool_wait(&group);
+
+    for (size_t i = 0; i < chunkCount; i++) {
+        trie->count += chunks[i].nodeCount;
+    }
+    arena_destroy(arena);
+    return trie;
+}
+
+bool suffix_trie_find_longest(const SuffixTrie *trie, const char *key, size_t keyLength, size_t *outIndex) {
+    const char *keyEnd = key + keyLength;
+    const TrieNode *node = trie->nodes;
+    size_t depth = 0;
+    uint32_t found = NO_VALUE;
+
+    // A code as long as the key is not a match, the walk ends before it could reach one.
+    while (depth < keyLength && node->childCount > 0) {
+        const uint8_t *childBytes = trie->firstBytes + node->firstChild;
+        const uint8_t *child = memchr(childBytes, (unsigned char)*(keyEnd - 1 - depth), node->childCount);
+        if (child == NULL) {
+            break;
+        }
+        node = trie->nodes + node->firstChild + (child - childBytes);
+        if (depth + node->labelLength >= keyLength) {
+            break;
+        }
+
+        // The first byte was matched with the child.
+        const char *labelEnd = trie->base + node->labelEnd;
+        size_t i = 1;
+        while (i < node->labelLength && *(labelEnd - 1 - i) == *(keyEnd - 1 - depth - i)) {
+            i++;
+        }
+        if (i < node->labelLength) {
+            break;
+        }
+        depth += node->labelLength;
+        if (node->value != NO_VALUE) {
+            found = node->value;
+        }
+    }
+
+    if (found == NO_VALUE) {
+        return false;
+    }
+    *outIndex = found;
+    return true;
+}
+
+size_t suffix_trie_size(const SuffixTrie *trie) {
+    return sizeof(*trie) + trie->count * (sizeof(*trie->nodes) + sizeof(*trie->firstBytes));
+}
+
+void suffix_trie_free(SuffixTrie *trie) {
+    if (trie) {
+        free(trie->nodes);
+        free(trie->firstBytes);
+        free(trie);
+    }
+}
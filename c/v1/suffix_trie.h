@@ -0,0 +1,45 @@
+#ifndef SUFFIX_TRIE_H
+#define SUFFIX_TRIE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include "source_data.h"
+
+/* Trie over the reversed codes, for rule 3. A part is walked once from its last char, and each code met on the way is a suffix of it.
+* Probing the table once per suffix length rehashes and compares the part over and over, the walk reads each char of the part once.
+*
+* The paths without branches are compressed, a node has a label of any length and there are at most two nodes per code.
+* The labels are not copied, they're read backwards from the codes of the records.
+* The children of a node are contiguous, and sorted by the first byte of their label.
+* The nodes array has gaps, the subtrees are built in parallel, each one in a region sized for the worst case.
+*/
+typedef struct TrieNode {
+    uint32_t labelEnd;                  // Offset from the base of the records, the label ends right before it
+    uint32_t value;                     // Original index of the first master part with the code that ends at this node, or UINT32_MAX
+    uint32_t firstChild;
+    uint16_t childCount;
+    uint8_t labelLength;
+} TrieNode;
+
+typedef struct SuffixTrie {
+    const char *base;
+    TrieNode *nodes;                    // The root is the first node, with an empty label
+    uint8_t *firstBytes;                // The first byte of the label of each node, scanned to find a child
+    size_t count;                       // Nodes in use, without the gaps
+} SuffixTrie;
+
+// The order is the positions of the records sorted by their reversed codes, the order of a SuffixIndex.
+// The subtrees are built on the thread pool. It waits for its own tasks, so it can be called from a task.
+// The records must be sorted by length, then in file order, so the first of the duplicates has the lowest position.
+SuffixTrie *suffix_trie_create(const Records *records, const uint32_t *order);
+
+// Finds the longest code that is a suffix of the key and shorter than it. The key is compared as is.
+// Returns the original index of the first master part with that code, same as the values of mpTable.
+bool suffix_trie_find_longest(const SuffixTrie *trie, const char *key, size_t keyLength, size_t *outIndex);
+
+// Bytes of the nodes in use, the gaps excluded since they're never touched. Meant for reporting only, see stats.c.
+size_t suffix_trie_size(const SuffixTrie *trie);
+void suffix_trie_free(SuffixTrie *trie);
+
+#endif
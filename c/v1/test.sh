@@ -0,0 +1,63 @@
+#!/bin/bash
+
+# Checks of the C v1 app on inputs the shared test data can't have, since the other implementations don't handle them.
+# The codes are less than 50 chars by the requirements. A longer part is reported as unmatched, a longer master part is rejected.
+#
+# Usage: test.sh
+
+set -euo pipefail
+
+script_dir=$(dirname "$(realpath "$0")")
+data_dir="$script_dir/../../data"
+app="$script_dir/publish/app"
+
+echo "Building..."
+bash "$script_dir/build.sh" >/dev/null
+
+work_dir=$(mktemp -d)
+trap 'rm -rf "$work_dir"' EXIT
+
+failed=0
+check() {
+  local name=$1 expected=$2 actual=$3
+  if cmp -s "$expected" "$actual"; then
+    echo "Passed: $name"
+  else
+    echo "Failed: $name"
+    failed=1
+  fi
+}
+
+####################################################################
+# Over-long parts, one that fits the stored lengths and one that doesn't. No master part is a suffix of them.
+long_part=$(printf 'A%.0s' {1..59})Q
+longer_part=$(printf 'b%.0s' {1..299})Q
+
+cp "$data_dir/test-parts.txt" "$work_dir/parts.txt"
+cp "$data_dir/test-expected.txt" "$work_dir/expected.txt"
+printf '%s\n %s \n' "$long_part" "$longer_part" >> "$work_dir/parts.txt"
+printf '%s;\n%s;\n' "$long_part" "$longer_part" >> "$work_dir/expected.txt"
+
+for backend in tables sorted fused; do
+  "$app" --suffix-backend=$backend "$work_dir/parts.txt" "$data_dir/test-master-parts.txt" "$work_dir/results.txt" >/dev/null
+  check "over-long parts ($backend)" "$work_dir/expected.txt" "$work_dir/results.txt"
+
+  "$app" --stream --suffix-backend=$backend "$work_dir/parts.txt" "$data_dir/test-master-parts.txt" "$work_dir/results.txt" >/dev/null 2>&1
+  check "over-long parts, streamed ($backend)" "$work_dir/expected.txt" "$work_dir/results.txt"
+done
+
+####################################################################
+cp "$data_dir/test-master-parts.txt" "$work_dir/master-parts.txt"
+echo "$long_part" >> "$work_dir/master-parts.txt"
+if "$app" "$data_dir/test-parts.txt" "$work_dir/master-parts.txt" "$work_dir/results.txt" >/dev/null 2>"$work_dir/error.txt"; then
+  echo "Failed: over-long master part, it was accepted"
+  failed=1
+elif grep -q "must be shorter" "$work_dir/error.txt"; then
+  echo "Passed: over-long master part"
+else
+  echo "Failed: over-long master part, unexpected error"
+  cat "$work_dir/error.txt"
+  failed=1
+fi
+
+exit $failed
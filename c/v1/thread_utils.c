@@ -1,4 +1,5 @@
 #include "allocator.h"
+#include "common.h"
 #include "thread_utils.h"
 
 #ifdef _WIN32
@@ -49,8 +50,16 @@ int join_thread(thread_t thread, thread_ret_t *ret) {
     return 0;
 }
 
+size_t get_hardware_thread_count(void) {
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors > 0 ? (size_t)info.dwNumberOfProcessors : 1;
+}
+
 #else
 
+#include <unistd.h>
+
 int create_thread(thread_t *thread, thread_func_t func, thread_arg_t arg) {
     return pthread_create(thread, NULL, func, arg);
 }
@@ -59,4 +68,155 @@ int join_thread(thread_t thread, thread_ret_t *ret) {
     return pthread_join(thread, ret);
 }
 
+size_t get_hardware_thread_count(void) {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (size_t)count : 1;
+}
+
 #endif
+
+/* Thread pool
+* The queue is a fixed ring buffer. If it's full, the submitter runs the task inline.
+* The tasks in our app are coarse (per-length tables, file chunks, lookup chunks), so a single
+* mutex guarding the queue and the group counters is not a point of contention.
+*/
+
+#define TASK_QUEUE_CAPACITY ((size_t)1024)
+
+typedef struct Task {
+    thread_func_t func;
+    thread_arg_t arg;
+    TaskGroup *group;
+} Task;
+
+typedef struct ThreadPool {
+    thread_t *threads;
+    size_t threadCount;
+
+    Task *queue;
+    size_t queueHead;
+    size_t queueCount;
+
+    thread_mutex_t mutex;
+    thread_cond_t taskAvailable;
+    thread_cond_t taskCompleted;
+    bool shutdown;
+} ThreadPool;
+
+static ThreadPool pool = { 0 };
+
+// Must be called with the mutex held and a non-empty queue.
+static Task dequeue_task(void) {
+    Task task = pool.queue[pool.queueHead];
+    pool.queueHead = (pool.queueHead + 1) % TASK_QUEUE_CAPACITY;
+    pool.queueCount--;
+    return task;
+}
+
+// Runs the task outside the lock, and returns with the lock held again.
+static void run_task(Task task) {
+    thread_mutex_unlock(&pool.mutex);
+    task.func(task.arg);
+    thread_mutex_lock(&pool.mutex);
+
+    task.group->pending--;
+    if (task.group->pending == 0) {
+        thread_cond_broadcast(&pool.taskCompleted);
+    }
+}
+
+static thread_ret_t worker_loop(thread_arg_t arg) {
+    thread_mutex_lock(&pool.mutex);
+    while (true) {
+        while (pool.queueCount == 0 && !pool.shutdown) {
+            thread_cond_wait(&pool.taskAvailable, &pool.mutex);
+        }
+        if (pool.queueCount == 0 && pool.shutdown) {
+            break;
+        }
+        run_task(dequeue_task());
+    }
+    thread_mutex_unlock(&pool.mutex);
+    return 0;
+}
+
+// This will be called at startup on the main thread.
+void thread_pool_init(size_t threadCount) {
+    if (threadCount == 0) {
+        // The thread waiting on a group runs tasks too, so we leave one hardware thread for it.
+        size_t hardwareThreadCount = get_hardware_thread_count();
+        threadCount = hardwareThreadCount > 1 ? hardwareThreadCount - 1 : 1;
+    }
+
+    thread_mutex_init(&pool.mutex);
+    thread_cond_init(&pool.taskAvailable);
+    thread_cond_init(&pool.taskCompleted);
+    pool.shutdown = false;
+    pool.queueHead = 0;
+    pool.queueCount = 0;
+    pool.queue = allocator_alloc(TASK_QUEUE_CAPACITY * sizeof(*pool.queue));
+    CHECK_ALLOC(pool.queue);
+    pool.threads = allocator_alloc(threadCount * sizeof(*pool.threads));
+    CHECK_ALLOC(pool.threads);
+
+    for (size_t i = 0; i < threadCount; i++) {
+        int status = create_thread(&pool.threads[i], worker_loop, NULL);
+        CHECK_THREAD_CREATE_STATUS(status, i);
+    }
+    pool.threadCount = threadCount;
+}
+
+void thread_pool_destroy(void) {
+    thread_mutex_lock(&pool.mutex);
+    pool.shutdown = true;
+    thread_cond_broadcast(&pool.taskAvailable);
+    thread_mutex_unlock(&pool.mutex);
+
+    for (size_t i = 0; i < pool.threadCount; i++) {
+        int status = join_thread(pool.threads[i], NULL);
+        CHECK_THREAD_JOIN_STATUS(status, i);
+    }
+    pool.threadCount = 0;
+
+    thread_cond_destroy(&pool.taskCompleted);
+    thread_cond_destroy(&pool.taskAvailable);
+    thread_mutex_destroy(&pool.mutex);
+}
+
+size_t thread_pool_concurrency(void) {
+    return pool.threadCount + 1;
+}
+
+void thread_pool_submit(TaskGroup *group, thread_func_t func, thread_arg_t arg) {
+    assert(group);
+    assert(func);
+
+    thread_mutex_lock(&pool.mutex);
+    if (pool.queueCount == TASK_QUEUE_CAPACITY) {
+        thread_mutex_unlock(&pool.mutex);
+        func(arg);
+        return;
+    }
+
+    size_t tail = (pool.queueHead + pool.queueCount) % TASK_QUEUE_CAPACITY;
+    pool.queue[tail] = (Task){ .func = func, .arg = arg, .group = group };
+    pool.queueCount++;
+    group->pending++;
+    thread_cond_signal(&pool.taskAvailable);
+    thread_mutex_unlock(&pool.mutex);
+}
+
+void thread_pool_wait(TaskGroup *group) {
+    assert(group);
+
+    thread_mutex_lock(&pool.mutex);
+    while (group->pending > 0) {
+        if (pool.queueCount > 0) {
+            run_task(dequeue_task());
+        }
+        else {
+            thread_cond_wait(&pool.taskCompleted, &pool.mutex);
+        }
+    }
+    thread_mutex_unlock(&pool.mutex);
+}
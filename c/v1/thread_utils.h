@@ -1,6 +1,8 @@
 #ifndef THREAD_UTILS_H
 #define THREAD_UTILS_H
 
+#include <stdlib.h>
+
 #define CHECK_THREAD_CREATE_STATUS(status, length)                              \
     do {                                                                        \
         if (status != 0) {                                                      \
@@ -24,12 +26,28 @@
 typedef HANDLE thread_t;
 typedef DWORD thread_ret_t;
 typedef LPVOID thread_arg_t;
+
+typedef CONDITION_VARIABLE thread_cond_t;
+
+#define thread_cond_init(cond) InitializeConditionVariable(cond)
+#define thread_cond_wait(cond, mutex) SleepConditionVariableCS(cond, mutex, INFINITE)
+#define thread_cond_signal(cond) WakeConditionVariable(cond)
+#define thread_cond_broadcast(cond) WakeAllConditionVariable(cond)
+#define thread_cond_destroy(cond) ((void)(cond))
 #else
 // POSIX-specific includes and definitions
 #include <pthread.h>
 typedef pthread_t thread_t;
 typedef void *thread_ret_t;
 typedef void *thread_arg_t;
+
+typedef pthread_cond_t thread_cond_t;
+
+#define thread_cond_init(cond) pthread_cond_init(cond, NULL)
+#define thread_cond_wait(cond, mutex) pthread_cond_wait(cond, mutex)
+#define thread_cond_signal(cond) pthread_cond_signal(cond)
+#define thread_cond_broadcast(cond) pthread_cond_broadcast(cond)
+#define thread_cond_destroy(cond) pthread_cond_destroy(cond)
 #endif
 
 // Thread function signature
@@ -41,4 +59,26 @@ int create_thread(thread_t *thread, thread_func_t func, thread_arg_t arg);
 // Thread join function
 int join_thread(thread_t thread, thread_ret_t *ret);
 
+// Number of hardware threads available to the process (at least 1).
+size_t get_hardware_thread_count(void);
+
+/* A single process-wide pool of worker threads with a FIFO task queue.
+* Tasks are submitted into a TaskGroup, and the caller waits for the group to drain.
+* While waiting, the caller runs queued tasks itself. That's what makes it safe for
+* a task to submit and wait for its own sub-tasks.
+*/
+typedef struct TaskGroup {
+    size_t pending;
+} TaskGroup;
+
+// Pass 0 to size the pool to the hardware.
+void thread_pool_init(size_t threadCount);
+void thread_pool_destroy(void);
+
+// Number of threads that execute tasks, including the waiting caller.
+size_t thread_pool_concurrency(void);
+
+void thread_pool_submit(TaskGroup *group, thread_func_t func, thread_arg_t arg);
+void thread_pool_wait(TaskGroup *group);
+
 #endif